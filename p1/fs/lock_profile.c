@@ -0,0 +1,143 @@
+#include "lock_profile.h"
+
+#ifdef LOCK_PROFILE
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+// locks a thread can hold at once and still have their hold timed
+#define MAX_HELD_LOCKS (8)
+
+typedef struct {
+    _Atomic uint64_t acquisitions, contended, wait_ns, max_hold_ns;
+} lock_stats_t;
+
+static char const *const lock_names[LOCK_NAMES] = {
+    [LOCK_FILE_DATA] = "rwlock",
+    [LOCK_INODES] = "inodelock",
+    [LOCK_DATA] = "datalock",
+    [LOCK_OPEN_FILES] = "oftlock",
+};
+
+static lock_stats_t lock_stats[LOCK_NAMES];
+
+// the locks this thread holds, and since when
+typedef struct {
+    void const *lock;
+    struct timespec since;
+} held_lock_t;
+
+static _Thread_local held_lock_t held[MAX_HELD_LOCKS];
+static _Thread_local int held_count;
+
+static uint64_t elapsed_ns(struct timespec const *start, struct timespec const *end) {
+    return (uint64_t)((end->tv_sec - start->tv_sec) * 1000000000L + (end->tv_nsec - start->tv_nsec));
+}
+
+/*
+ * Counts an acquisition of a lock, that waited since start if it was
+ * contended, and starts timing how long it is held.
+ */
+static void acquired(void const *lock, lock_name_t name, struct timespec const *start) {
+    lock_stats_t *stats = &lock_stats[name];
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    atomic_fetch_add_explicit(&stats->acquisitions, 1, memory_order_relaxed);
+    if (start != NULL) {
+        atomic_fetch_add_explicit(&stats->contended, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stats->wait_ns, elapsed_ns(start, &now), memory_order_relaxed);
+    }
+    if (held_count < MAX_HELD_LOCKS)
+        held[held_count++] = (held_lock_t){.lock = lock, .since = now};
+}
+
+/*
+ * Stops timing how long a lock was held, keeping the longest hold.
+ */
+static void released(void const *lock, lock_name_t name) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = held_count - 1; i >= 0; i--) {
+        if (held[i].lock != lock)
+            continue;
+        uint64_t hold = elapsed_ns(&held[i].since, &now);
+        held[i] = held[--held_count];
+        _Atomic uint64_t *max = &lock_stats[name].max_hold_ns;
+        uint64_t seen = atomic_load_explicit(max, memory_order_relaxed);
+        while (hold > seen && !atomic_compare_exchange_weak_explicit(max, &seen, hold, memory_order_relaxed,
+                                                                     memory_order_relaxed))
+            ;
+        return;
+    }
+}
+
+int profiled_rwlock_rdlock(pthread_rwlock_t *rwlock, lock_name_t name) {
+    int ret = pthread_rwlock_tryrdlock(rwlock);
+    if (ret == 0) {
+        acquired(rwlock, name, NULL);
+        return 0;
+    }
+    if (ret != EBUSY)
+        return ret;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((ret = pthread_rwlock_rdlock(rwlock)) == 0)
+        acquired(rwlock, name, &start);
+    return ret;
+}
+
+int profiled_rwlock_wrlock(pthread_rwlock_t *rwlock, lock_name_t name) {
+    int ret = pthread_rwlock_trywrlock(rwlock);
+    if (ret == 0) {
+        acquired(rwlock, name, NULL);
+        return 0;
+    }
+    if (ret != EBUSY)
+        return ret;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((ret = pthread_rwlock_wrlock(rwlock)) == 0)
+        acquired(rwlock, name, &start);
+    return ret;
+}
+
+int profiled_rwlock_unlock(pthread_rwlock_t *rwlock, lock_name_t name) {
+    released(rwlock, name);
+    return pthread_rwlock_unlock(rwlock);
+}
+
+void lock_profile_report(FILE *out) {
+    fprintf(out, "%-20s %12s %12s %10s %12s %12s\n", "lock", "acquisitions", "contended", "contended%", "wait(us)",
+            "max_hold(us)");
+    for (int name = 0; name < LOCK_NAMES; name++) {
+        lock_stats_t *stats = &lock_stats[name];
+        uint64_t acquisitions = atomic_load_explicit(&stats->acquisitions, memory_order_relaxed);
+        uint64_t contended = atomic_load_explicit(&stats->contended, memory_order_relaxed);
+        fprintf(out, "%-20s %12lu %12lu %10.2f %12.1f %12.1f\n", lock_names[name], (unsigned long)acquisitions,
+                (unsigned long)contended, acquisitions > 0 ? 100.0 * (double)contended / (double)acquisitions : 0.0,
+                (double)atomic_load_explicit(&stats->wait_ns, memory_order_relaxed) / 1000.0,
+                (double)atomic_load_explicit(&stats->max_hold_ns, memory_order_relaxed) / 1000.0);
+    }
+    fflush(out);
+}
+
+void lock_profile_reset() {
+    for (int name = 0; name < LOCK_NAMES; name++) {
+        atomic_store_explicit(&lock_stats[name].acquisitions, 0, memory_order_relaxed);
+        atomic_store_explicit(&lock_stats[name].contended, 0, memory_order_relaxed);
+        atomic_store_explicit(&lock_stats[name].wait_ns, 0, memory_order_relaxed);
+        atomic_store_explicit(&lock_stats[name].max_hold_ns, 0, memory_order_relaxed);
+    }
+}
+
+#else
+
+void lock_profile_report(FILE *out) {
+    (void)out;
+}
+
+void lock_profile_reset() {}
+
+#endif // LOCK_PROFILE
@@ -0,0 +1,44 @@
+#ifndef LOCK_PROFILE_H
+#define LOCK_PROFILE_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+/*
+ * The file system's locks, by name
+ */
+typedef enum { LOCK_FILE_DATA, LOCK_INODES, LOCK_DATA, LOCK_OPEN_FILES, LOCK_NAMES } lock_name_t;
+
+/*
+ * Built with LOCK_PROFILE defined (make LOCK_PROFILE=yes), the file system
+ * takes its locks through the functions below, which count, for each named
+ * lock, its acquisitions, those that had to wait for it to be released,
+ * the total time spent waiting and the longest time it was held. Built
+ * without it, they are the pthread functions themselves.
+ */
+#ifdef LOCK_PROFILE
+
+int profiled_rwlock_rdlock(pthread_rwlock_t *rwlock, lock_name_t name);
+int profiled_rwlock_wrlock(pthread_rwlock_t *rwlock, lock_name_t name);
+int profiled_rwlock_unlock(pthread_rwlock_t *rwlock, lock_name_t name);
+
+#else
+
+#define profiled_rwlock_rdlock(rwlock, name) pthread_rwlock_rdlock(rwlock)
+#define profiled_rwlock_wrlock(rwlock, name) pthread_rwlock_wrlock(rwlock)
+#define profiled_rwlock_unlock(rwlock, name) pthread_rwlock_unlock(rwlock)
+
+#endif // LOCK_PROFILE
+
+/*
+ * Prints what was counted so far, one line per named lock (nothing unless
+ * built with LOCK_PROFILE)
+ */
+void lock_profile_report(FILE *out);
+
+/*
+ * Forgets what was counted so far
+ */
+void lock_profile_reset();
+
+#endif // LOCK_PROFILE_H
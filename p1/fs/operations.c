@@ -1,5 +1,6 @@
 #include "operations.h"
 #include "config.h"
+#include "lock_profile.h"
 #include "state.h"
 #include "math.h"
 #include <stdbool.h>
@@ -12,6 +13,7 @@ pthread_rwlock_t rwlock;
 
 int tfs_init() {
     state_init();
+    lock_profile_reset();
 
     /* create root inode.*/
     int root = inode_create(T_DIRECTORY);
@@ -24,6 +26,7 @@ int tfs_init() {
 
 int tfs_destroy() {
     state_destroy();
+    lock_profile_report(stderr);
     return 0;
 }
 
@@ -136,7 +139,7 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
     int block_index = (int)(inode->i_size / BLOCK_SIZE);
     char *buffer_pos = (char*)buffer;
     size_t left_to_write = to_write;
-    pthread_rwlock_wrlock(&rwlock);
+    profiled_rwlock_wrlock(&rwlock, LOCK_FILE_DATA);
     /* Writing in the data blocks */
     while (block_index < MAX_DIRECT_REFS) {
         char* block = data_block_get(inode->i_data_blocks[block_index]);
@@ -171,7 +174,7 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
     end:
     if (file->of_offset > inode->i_size)
         inode->i_size = file->of_offset;
-    pthread_rwlock_unlock(&rwlock);
+    profiled_rwlock_unlock(&rwlock, LOCK_FILE_DATA);
     return (ssize_t)to_write;
 }
 
@@ -196,7 +199,7 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
     size_t pre_trunc = file->of_offset % BLOCK_SIZE;
     size_t post_trunc = to_read % BLOCK_SIZE;
     size_t write_amount;
-    pthread_rwlock_wrlock(&rwlock);
+    profiled_rwlock_wrlock(&rwlock, LOCK_FILE_DATA);
     if (to_read > 0) {
         int read_times = (int )(to_read / BLOCK_SIZE) + 1;
         for (int i = first_block, j = 0; len > 0 && i < first_block + read_times; i++, j++) {
@@ -235,7 +238,7 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
         incremented accordingly
             file->of_offset += to_read;*/
     }
-    pthread_rwlock_unlock(&rwlock);
+    profiled_rwlock_unlock(&rwlock, LOCK_FILE_DATA);
     return (ssize_t)to_read;
 }
 
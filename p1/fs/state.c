@@ -1,5 +1,6 @@
 #include "state.h"
 #include "config.h"
+#include "lock_profile.h"
 
 #include <pthread.h>
 #include <stdbool.h>
@@ -101,8 +102,8 @@ void state_destroy() {
  *  new i-node's number if successfully created, -1 otherwise
  */
 int inode_create(inode_type n_type) {
-    pthread_rwlock_wrlock(&inodelock);
-    pthread_rwlock_wrlock(&datalock);
+    profiled_rwlock_wrlock(&inodelock, LOCK_INODES);
+    profiled_rwlock_wrlock(&datalock, LOCK_DATA);
     for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
         if ((inumber * (int) sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
             insert_delay(); // simulate storage access delay (to freeinode_ts)
@@ -148,8 +149,8 @@ int inode_create(inode_type n_type) {
                 }
                 inode_table[inumber].i_block = NULL;
             }
-            pthread_rwlock_unlock(&inodelock);
-            pthread_rwlock_unlock(&datalock);
+            profiled_rwlock_unlock(&inodelock, LOCK_INODES);
+            profiled_rwlock_unlock(&datalock, LOCK_DATA);
             return inumber;
         }
     }
@@ -166,7 +167,7 @@ int inode_delete(int inumber) {
     // simulate storage access delay (to i-node and freeinode_ts)
     insert_delay();
     insert_delay();
-    pthread_rwlock_wrlock(&inodelock);
+    profiled_rwlock_wrlock(&inodelock, LOCK_INODES);
     if (!valid_inumber(inumber) || freeinode_ts[inumber] == FREE) {
         return -1;
     }
@@ -178,7 +179,7 @@ int inode_delete(int inumber) {
             return -1;
         }
     }
-    pthread_rwlock_unlock(&inodelock);
+    profiled_rwlock_unlock(&inodelock, LOCK_INODES);
     return 0;
 }
 
@@ -215,17 +216,17 @@ int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
     }
 
     insert_delay(); // simulate storage access delay to i-node with inumber
-    pthread_rwlock_rdlock(&inodelock);
+    profiled_rwlock_rdlock(&inodelock, LOCK_INODES);
     if (inode_table[inumber].i_node_type != T_DIRECTORY) {
         return -1;
     }
-    pthread_rwlock_unlock(&inodelock);
+    profiled_rwlock_unlock(&inodelock, LOCK_INODES);
 
     if (strlen(sub_name) == 0) {
         return -1;
     }
 
-    pthread_rwlock_wrlock(&datalock);
+    profiled_rwlock_wrlock(&datalock, LOCK_DATA);
     /* Locates the block containing the directory's entries */
     dir_entry_t *dir_entry =
         (dir_entry_t *)data_block_get(inode_table[inumber].i_data_block);
@@ -239,11 +240,11 @@ int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
             dir_entry[i].d_inumber = sub_inumber;
             strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
             dir_entry[i].d_name[MAX_FILE_NAME - 1] = 0;
-            pthread_rwlock_unlock(&datalock);
+            profiled_rwlock_unlock(&datalock, LOCK_DATA);
             return 0;
         }
     }
-    pthread_rwlock_unlock(&datalock);
+    profiled_rwlock_unlock(&datalock, LOCK_DATA);
     return -1;
 }
 
@@ -255,14 +256,14 @@ int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
  */
 int find_in_dir(int inumber, char const *sub_name) {
     insert_delay(); // simulate storage access delay to i-node with inumber
-    pthread_rwlock_rdlock(&inodelock);
+    profiled_rwlock_rdlock(&inodelock, LOCK_INODES);
     if (!valid_inumber(inumber) ||
         inode_table[inumber].i_node_type != T_DIRECTORY) {
         return -1;
     }
-    pthread_rwlock_unlock(&inodelock);
+    profiled_rwlock_unlock(&inodelock, LOCK_INODES);
 
-    pthread_rwlock_wrlock(&datalock);
+    profiled_rwlock_wrlock(&datalock, LOCK_DATA);
     /* Locates the block containing the directory's entries */
     dir_entry_t *dir_entry =
         (dir_entry_t *)data_block_get(inode_table[inumber].i_data_block);
@@ -275,10 +276,10 @@ int find_in_dir(int inumber, char const *sub_name) {
     for (int i = 0; i < MAX_DIR_ENTRIES; i++)
         if ((dir_entry[i].d_inumber != -1) &&
             (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
-            pthread_rwlock_unlock(&datalock);
+            profiled_rwlock_unlock(&datalock, LOCK_DATA);
             return dir_entry[i].d_inumber;
         }
-    pthread_rwlock_unlock(&datalock);
+    profiled_rwlock_unlock(&datalock, LOCK_DATA);
     return -1;
 }
 
@@ -311,9 +312,9 @@ int data_block_free(int block_number) {
     }
 
     insert_delay(); // simulate storage access delay to free_blocks
-    pthread_rwlock_wrlock(&datalock);
+    profiled_rwlock_wrlock(&datalock, LOCK_DATA);
     free_blocks[block_number] = FREE;
-    pthread_rwlock_unlock(&datalock);
+    profiled_rwlock_unlock(&datalock, LOCK_DATA);
     return 0;
 }
 
@@ -329,16 +330,16 @@ int data_blocks_free(inode_t* inode) {
         }
 
         insert_delay(); // simulate storage access delay to free_blocks
-        pthread_rwlock_wrlock(&datalock);
+        profiled_rwlock_wrlock(&datalock, LOCK_DATA);
         free_blocks[inode->i_data_block] = FREE;
-        pthread_rwlock_unlock(&datalock);
+        profiled_rwlock_unlock(&datalock, LOCK_DATA);
         return 0;
     }
     else {
         int taken_blocks = (int) (inode->i_size / BLOCK_SIZE) + 1;
         if (taken_blocks > MAX_DIRECT_REFS)
             taken_blocks = MAX_DIRECT_REFS;
-        pthread_rwlock_wrlock(&datalock);
+        profiled_rwlock_wrlock(&datalock, LOCK_DATA);
         for (int i = 0; i < taken_blocks; ++i) {
             if (!valid_block_number(inode->i_data_blocks[i])) {
             return -1;
@@ -348,7 +349,7 @@ int data_blocks_free(inode_t* inode) {
             free_blocks[inode->i_data_blocks[i]] = FREE;
         }
         i_block_free(inode->i_block);
-        pthread_rwlock_unlock(&datalock);
+        profiled_rwlock_unlock(&datalock, LOCK_DATA);
         return 0;
     }
 }
@@ -357,11 +358,11 @@ int data_blocks_free(inode_t* inode) {
 
 i_block* i_block_alloc() {
     i_block* b =  malloc(sizeof(i_block));
-    pthread_rwlock_wrlock(&datalock);
+    profiled_rwlock_wrlock(&datalock, LOCK_DATA);
     for (int i = 0; i < MAX_SUPPL_REFS; i++) {
         b->indexes[i] = data_block_alloc();
     }
-    pthread_rwlock_unlock(&datalock);
+    profiled_rwlock_unlock(&datalock, LOCK_DATA);
     return b;
 }
 
@@ -403,7 +404,7 @@ void *data_block_get(int block_number) {
  * Returns: file handle if successful, -1 otherwise
  */
 int add_to_open_file_table(int inumber, size_t offset) {
-    pthread_rwlock_wrlock(&oftlock);
+    profiled_rwlock_wrlock(&oftlock, LOCK_OPEN_FILES);
     for (int i = 0; i < MAX_OPEN_FILES; i++) {
         if (free_open_file_entries[i] == FREE) {
             free_open_file_entries[i] = TAKEN;
@@ -412,7 +413,7 @@ int add_to_open_file_table(int inumber, size_t offset) {
             return i;
         }
     }
-    pthread_rwlock_unlock(&oftlock);
+    profiled_rwlock_unlock(&oftlock, LOCK_OPEN_FILES);
     return -1;
 }
 
@@ -422,13 +423,13 @@ int add_to_open_file_table(int inumber, size_t offset) {
  * Returns 0 if successful, -1 otherwise
  */
 int remove_from_open_file_table(int fhandle) {
-    pthread_rwlock_wrlock(&oftlock);
+    profiled_rwlock_wrlock(&oftlock, LOCK_OPEN_FILES);
     if (!valid_file_handle(fhandle) ||
         free_open_file_entries[fhandle] != TAKEN) {
         return -1;
     }
     free_open_file_entries[fhandle] = FREE;
-    pthread_rwlock_unlock(&oftlock);
+    profiled_rwlock_unlock(&oftlock, LOCK_OPEN_FILES);
     return 0;
 }
 
@@ -441,8 +442,8 @@ open_file_entry_t *get_open_file_entry(int fhandle) {
     if (!valid_file_handle(fhandle)) {
         return NULL;
     }
-    pthread_rwlock_rdlock(&oftlock);
+    profiled_rwlock_rdlock(&oftlock, LOCK_OPEN_FILES);
     open_file_entry_t* res = &open_file_table[fhandle];
-    pthread_rwlock_unlock(&oftlock);
+    profiled_rwlock_unlock(&oftlock, LOCK_OPEN_FILES);
     return res;
 }
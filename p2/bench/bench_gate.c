@@ -0,0 +1,382 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*  Checks a benchmark against a baseline, so that a change that makes it
+    slower is caught like one that breaks a test. The benchmark is any
+    command that prints CSV with a header, one row per workload, like
+    fs_bench or load_gen: the columns before "ops" tell the workload, and
+    one column is the metric compared (ops_per_s unless told otherwise;
+    latencies, in *_us columns, and seconds are better lower).
+
+    Usage: bench_gate [options] baseline_file [command...]
+      -s              runs the command and saves its results as the baseline
+                      instead of comparing against it
+      -r repeats      times the command runs, each workload's result being
+                      the mean of them (default 5)
+      -t percent      noise threshold: changes smaller than it never count
+                      (default 10)
+      -a alpha        significance level of the test (default 0.01)
+      -m metric       column compared (default ops_per_s), when saving
+    Comparing, the command is the one the baseline was saved with, unless
+    another one is given. A workload regressed if it got worse by more than
+    the threshold and Welch's t-test finds that unlikely to be noise (one
+    sided, at alpha). Prints a table of every workload, and exits with 1 if
+    any regressed or the command failed. */
+
+#define MAX_ROWS (512)
+#define MAX_LINE (1024)
+#define MAX_COLUMNS (32)
+#define DEFAULT_REPEATS (5)
+#define DEFAULT_THRESHOLD (10.0)
+#define DEFAULT_ALPHA (0.01)
+
+// a workload's results, over every run
+typedef struct {
+    char key[MAX_LINE];
+    int runs;
+    double mean, m2; // running, as in Welford's algorithm
+} row_t;
+
+typedef struct {
+    char key_header[MAX_LINE]; // the names of the key columns
+    row_t rows[MAX_ROWS];
+    int count;
+} results_t;
+
+static int repeats = DEFAULT_REPEATS;
+static double threshold = DEFAULT_THRESHOLD;
+static double alpha = DEFAULT_ALPHA;
+static char metric[MAX_LINE] = "ops_per_s";
+static results_t baseline, current;
+
+static double stddev(row_t const *row) {
+    return row->runs > 1 ? sqrt(row->m2 / (row->runs - 1)) : 0.0;
+}
+
+static void add_sample(row_t *row, double value) {
+    row->runs++;
+    double delta = value - row->mean;
+    row->mean += delta / row->runs;
+    row->m2 += delta * (value - row->mean);
+}
+
+static row_t *find_row(results_t *results, char const *key, int add) {
+    for (int i = 0; i < results->count; i++)
+        if (strcmp(results->rows[i].key, key) == 0)
+            return &results->rows[i];
+    if (!add || results->count == MAX_ROWS)
+        return NULL;
+    row_t *row = &results->rows[results->count++];
+    memset(row, 0, sizeof(*row));
+    snprintf(row->key, sizeof(row->key), "%s", key);
+    return row;
+}
+
+/*
+ * Splits a CSV line (without quoting) in place.
+ * Returns the number of fields.
+ */
+static int split(char *line, char **fields) {
+    int count = 0;
+    line[strcspn(line, "\r\n")] = '\0';
+    for (char *field = line; count < MAX_COLUMNS; field++) {
+        fields[count++] = field;
+        if ((field = strchr(field, ',')) == NULL)
+            break;
+        *field = '\0';
+    }
+    return count;
+}
+
+/*
+ * Joins fields back into a CSV line.
+ */
+static void join(char *out, size_t size, char **fields, int count) {
+    out[0] = '\0';
+    for (int i = 0; i < count; i++) {
+        size_t len = strlen(out);
+        snprintf(out + len, size - len, "%s%s", i > 0 ? "," : "", fields[i]);
+    }
+}
+
+/*
+ * Runs the command once, adding the metric of each of its rows.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int run_once(char const *command) {
+    char line[MAX_LINE];
+    char *fields[MAX_COLUMNS];
+    FILE *out = popen(command, "r");
+    if (out == NULL || fgets(line, sizeof(line), out) == NULL) {
+        if (out != NULL)
+            pclose(out);
+        fprintf(stderr, "%s: no output\n", command);
+        return -1;
+    }
+
+    int columns = split(line, fields), keys = -1, value = -1;
+    for (int i = 0; i < columns; i++) {
+        if (keys == -1 && strcmp(fields[i], "ops") == 0)
+            keys = i;
+        if (strcmp(fields[i], metric) == 0)
+            value = i;
+    }
+    if (keys < 1 || value == -1) {
+        pclose(out);
+        fprintf(stderr, "%s: no ops or %s column\n", command, metric);
+        return -1;
+    }
+    join(current.key_header, sizeof(current.key_header), fields, keys);
+
+    while (fgets(line, sizeof(line), out) != NULL) {
+        char key[MAX_LINE];
+        if (split(line, fields) <= value)
+            continue;
+        join(key, sizeof(key), fields, keys);
+        row_t *row = find_row(&current, key, 1);
+        if (row != NULL)
+            add_sample(row, strtod(fields[value], NULL));
+    }
+    int status = pclose(out);
+    if (status != 0) {
+        fprintf(stderr, "%s: failed (status %d)\n", command, status);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Writes the results as a baseline: the command and metric, then the mean
+ * of each workload, its standard deviation and the runs they come from.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int save_baseline(char const *path, char const *command) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        perror(path);
+        return -1;
+    }
+    fprintf(out, "# command: %s\n# metric: %s\n%s,runs,mean,stddev\n", command, metric, current.key_header);
+    for (int i = 0; i < current.count; i++) {
+        row_t const *row = &current.rows[i];
+        fprintf(out, "%s,%d,%.6g,%.6g\n", row->key, row->runs, row->mean, stddev(row));
+    }
+    return fclose(out) == 0 ? 0 : -1;
+}
+
+/*
+ * Reads a baseline, and the command it was saved with.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int load_baseline(char const *path, char *command, size_t size) {
+    char line[MAX_LINE];
+    char *fields[MAX_COLUMNS];
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        perror(path);
+        return -1;
+    }
+    command[0] = '\0';
+    int header = 1;
+    while (fgets(line, sizeof(line), in) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (strncmp(line, "# command: ", 11) == 0) {
+            snprintf(command, size, "%s", line + 11);
+            continue;
+        }
+        if (strncmp(line, "# metric: ", 10) == 0) {
+            snprintf(metric, sizeof(metric), "%s", line + 10);
+            continue;
+        }
+        if (line[0] == '#' || line[0] == '\0')
+            continue;
+        int count = split(line, fields);
+        // the key, then runs, mean and standard deviation
+        if (count < 4)
+            continue;
+        if (header) {
+            join(baseline.key_header, sizeof(baseline.key_header), fields, count - 3);
+            header = 0;
+            continue;
+        }
+        char key[MAX_LINE];
+        join(key, sizeof(key), fields, count - 3);
+        row_t *row = find_row(&baseline, key, 1);
+        if (row == NULL)
+            break;
+        row->runs = atoi(fields[count - 3]);
+        row->mean = strtod(fields[count - 2], NULL);
+        double sd = strtod(fields[count - 1], NULL);
+        row->m2 = sd * sd * (row->runs - 1);
+    }
+    fclose(in);
+    return 0;
+}
+
+/*
+ * Continued fraction of the regularized incomplete beta function
+ * (modified Lentz's method).
+ */
+static double beta_fraction(double a, double b, double x) {
+    double const tiny = 1e-300;
+    double c = 1.0, d = 1.0 - (a + b) * x / (a + 1.0);
+    if (fabs(d) < tiny)
+        d = tiny;
+    d = 1.0 / d;
+    double h = d;
+    for (int m = 1; m <= 200; m++) {
+        for (int odd = 0; odd < 2; odd++) {
+            double num = odd ? -(a + m) * (a + b + m) * x / ((a + 2 * m) * (a + 2 * m + 1))
+                             : m * (b - m) * x / ((a + 2 * m - 1) * (a + 2 * m));
+            d = 1.0 + num * d;
+            if (fabs(d) < tiny)
+                d = tiny;
+            c = 1.0 + num / c;
+            if (fabs(c) < tiny)
+                c = tiny;
+            d = 1.0 / d;
+            h *= d * c;
+        }
+        if (fabs(d * c - 1.0) < 1e-12)
+            break;
+    }
+    return h;
+}
+
+static double incomplete_beta(double a, double b, double x) {
+    if (x <= 0.0)
+        return 0.0;
+    if (x >= 1.0)
+        return 1.0;
+    double front = exp(lgamma(a + b) - lgamma(a) - lgamma(b) + a * log(x) + b * log(1.0 - x));
+    if (x < (a + 1.0) / (a + b + 2.0))
+        return front * beta_fraction(a, b, x) / a;
+    return 1.0 - front * beta_fraction(b, a, 1.0 - x) / b;
+}
+
+/*
+ * Welch's t-test: the probability that the current mean is at least as far
+ * from the baseline's as it is, in the direction it went, if both had the
+ * same distribution. Returns -1 if there aren't runs enough to tell.
+ */
+static double p_value(row_t const *base, row_t const *now) {
+    if (base->runs < 2 || now->runs < 2)
+        return -1;
+    double vb = stddev(base) * stddev(base) / base->runs, vn = stddev(now) * stddev(now) / now->runs;
+    if (vb + vn <= 0.0)
+        return now->mean < base->mean || now->mean > base->mean ? 0.0 : 1.0;
+    double t = fabs(now->mean - base->mean) / sqrt(vb + vn);
+    double df = (vb + vn) * (vb + vn) / (vb * vb / (base->runs - 1) + vn * vn / (now->runs - 1));
+    return 0.5 * incomplete_beta(df / 2.0, 0.5, df / (df + t * t));
+}
+
+static double relative_sd(row_t const *row) {
+    return fabs(row->mean) > 0.0 ? 100.0 * stddev(row) / row->mean : 0.0;
+}
+
+/*
+ * Prints how each workload did against the baseline.
+ * Returns how many regressed.
+ */
+static int compare() {
+    // latencies and times are better lower
+    size_t len = strlen(metric);
+    int lower_better = strcmp(metric, "seconds") == 0 || (len > 3 && strcmp(metric + len - 3, "_us") == 0);
+    int regressions = 0, improvements = 0;
+
+    printf("%-32s %14s %7s %14s %7s %9s %8s  %s\n", current.key_header, "baseline", "sd", "current", "sd",
+           "change", "p", "verdict");
+    for (int i = 0; i < current.count; i++) {
+        row_t const *now = &current.rows[i];
+        row_t const *base = find_row(&baseline, now->key, 0);
+        if (base == NULL) {
+            printf("%-32s %14s %7s %14.1f %6.1f%% %9s %8s  new\n", now->key, "-", "-", now->mean, relative_sd(now),
+                   "-", "-");
+            continue;
+        }
+        double change = fabs(base->mean) > 0.0 ? 100.0 * (now->mean - base->mean) / base->mean : 0.0;
+        double p = p_value(base, now);
+        int worse = lower_better ? change > 0 : change < 0;
+        // without the runs for a test, only the threshold tells
+        int significant = fabs(change) > threshold && (p < 0 || p < alpha);
+        char const *verdict = "ok";
+        if (significant && worse) {
+            verdict = "REGRESSION";
+            regressions++;
+        } else if (significant) {
+            verdict = "better";
+            improvements++;
+        }
+        char p_text[16] = "-";
+        if (p >= 0)
+            snprintf(p_text, sizeof(p_text), "%.4f", p);
+        printf("%-32s %14.1f %6.1f%% %14.1f %6.1f%% %+8.1f%% %8s  %s\n", now->key, base->mean, relative_sd(base),
+               now->mean, relative_sd(now), change, p_text, verdict);
+    }
+    for (int i = 0; i < baseline.count; i++)
+        if (find_row(&current, baseline.rows[i].key, 0) == NULL)
+            printf("%-32s %14.1f %6.1f%% %14s %7s %9s %8s  missing\n", baseline.rows[i].key, baseline.rows[i].mean,
+                   relative_sd(&baseline.rows[i]), "-", "-", "-", "-");
+    printf("%d workloads, %d regressed, %d got better (%s, threshold %.1f%%, alpha %g, %d runs)\n", current.count,
+           regressions, improvements, metric, threshold, alpha, repeats);
+    return regressions;
+}
+
+int main(int argc, char **argv) {
+
+    int save = 0, opt;
+    char command[MAX_LINE] = "";
+
+    while ((opt = getopt(argc, argv, "sr:t:a:m:")) != -1) {
+        switch (opt) {
+            case 's':
+                save = 1;
+                break;
+            case 'r':
+                repeats = atoi(optarg);
+                break;
+            case 't':
+                threshold = atof(optarg);
+                break;
+            case 'a':
+                alpha = atof(optarg);
+                break;
+            case 'm':
+                snprintf(metric, sizeof(metric), "%s", optarg);
+                break;
+            default:
+                optind = argc + 1;
+                break;
+        }
+    }
+    if (optind >= argc || (save && optind + 1 >= argc) || repeats < 1 || threshold < 0 || alpha <= 0 ||
+        alpha >= 1) {
+        printf("Usage: %s [-s] [-r repeats] [-t percent] [-a alpha] [-m metric] baseline_file [command...]\n",
+               argv[0]);
+        return 1;
+    }
+    char const *path = argv[optind];
+    if (!save && load_baseline(path, command, sizeof(command)) != 0)
+        return 1;
+    if (optind + 1 < argc) {
+        command[0] = '\0';
+        for (int i = optind + 1; i < argc; i++) {
+            size_t len = strlen(command);
+            snprintf(command + len, sizeof(command) - len, "%s%s", i > optind + 1 ? " " : "", argv[i]);
+        }
+    }
+    if (command[0] == '\0') {
+        fprintf(stderr, "%s: no command to run\n", path);
+        return 1;
+    }
+
+    for (int run = 0; run < repeats; run++)
+        if (run_once(command) != 0)
+            return 1;
+    if (save)
+        return save_baseline(path, command) == 0 ? 0 : 1;
+    return compare() > 0 ? 1 : 0;
+}
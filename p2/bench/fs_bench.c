@@ -0,0 +1,262 @@
+#include "fs/operations.h"
+#include "fs/state.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*  Measures the file system's core, used as a library, under workloads run
+    by 1 up to max_threads threads (doubling each time):
+    - seq_write, seq_read: each thread writes or reads its own file from
+      start to end, over and over, size bytes at a time
+    - rand_write, rand_read: the same, each time at a random offset (the
+      lseek is part of the operation)
+    - create: each operation creates a new file and closes it, as many
+      times as the directory has room for
+    - open_close: each operation opens an existing file and closes it
+    - mixed_R: each operation reads (R% of the time) or writes size bytes at
+      a random offset of a file all threads share
+    Every workload runs on a freshly initialized file system. Results go to
+    the standard output as CSV, one row per workload, size and thread count,
+    with throughput, latency percentiles (of single operations) and the
+    simulated storage accesses an operation made on average, to metadata
+    and to data. */
+
+#define DEFAULT_MAX_THREADS (4)
+#define DEFAULT_OPS_PER_THREAD (2000)
+// every thread has a file of its own, in a directory with room for a few more
+#define MAX_THREADS (16)
+_Static_assert(MAX_THREADS < MAX_DIR_ENTRIES, "every thread needs a file of its own");
+
+typedef enum { SEQ_WRITE, SEQ_READ, RAND_WRITE, RAND_READ, CREATE, OPEN_CLOSE, MIXED } workload_kind;
+
+typedef struct {
+    char const *name;
+    workload_kind kind;
+    int read_percent; // of a mixed workload
+    int sized; // runs once for each size
+} workload_t;
+
+static workload_t const workloads[] = {
+    {"seq_write", SEQ_WRITE, 0, 1},  {"seq_read", SEQ_READ, 0, 1},     {"rand_write", RAND_WRITE, 0, 1},
+    {"rand_read", RAND_READ, 0, 1},  {"create", CREATE, 0, 0},         {"open_close", OPEN_CLOSE, 0, 0},
+    {"mixed_90", MIXED, 90, 1},      {"mixed_50", MIXED, 50, 1},       {"mixed_10", MIXED, 10, 1},
+};
+
+// from a single byte up to the largest file
+static size_t const sizes[] = {1, 16, 256, BLOCK_SIZE};
+
+typedef struct {
+    workload_t const *workload;
+    size_t size;
+    int id;
+    size_t ops;
+    long *ns; // latency of each operation
+    size_t bytes;
+    uint64_t metadata_ios, data_ios; // made by the operations
+    int failed;
+    pthread_barrier_t *start;
+} thread_args_t;
+
+static long elapsed_ns(struct timespec const *start, struct timespec const *end) {
+    return (end->tv_sec - start->tv_sec) * 1000000000L + (end->tv_nsec - start->tv_nsec);
+}
+
+static int compare_ns(void const *a, void const *b) {
+    long x = *(long const *)a, y = *(long const *)b;
+    return (x > y) - (x < y);
+}
+
+static void file_name(char *name, int id) {
+    snprintf(name, MAX_FILE_NAME, "/bench%d", id);
+}
+
+/*
+ * Runs a single operation of the workload.
+ * Returns the bytes it moved, or -1 if it failed.
+ */
+static ssize_t run_op(thread_args_t *args, int fhandle, size_t i, unsigned *seed, char *buffer) {
+    size_t size = args->size;
+    off_t offset;
+    ssize_t moved;
+    char name[MAX_FILE_NAME];
+    switch (args->workload->kind) {
+        case SEQ_WRITE:
+        case SEQ_READ:
+            // back to the start once the file is over (every size fits a
+            // whole number of times in it)
+            if (i > 0 && (i * size) % BLOCK_SIZE == 0 && tfs_lseek(fhandle, 0, TFS_SEEK_SET) != 0)
+                return -1;
+            if (args->workload->kind == SEQ_WRITE)
+                moved = tfs_write(fhandle, buffer, size);
+            else
+                moved = tfs_read(fhandle, buffer, size);
+            // anything less, and the operation ran past the end of the file
+            return moved == (ssize_t)size ? moved : -1;
+        case RAND_WRITE:
+        case RAND_READ:
+        case MIXED:
+            offset = (off_t)((size_t)rand_r(seed) % (BLOCK_SIZE - size + 1));
+            if (tfs_lseek(fhandle, offset, TFS_SEEK_SET) != offset)
+                return -1;
+            if (args->workload->kind == RAND_WRITE ||
+                (args->workload->kind == MIXED && rand_r(seed) % 100 >= args->workload->read_percent))
+                return tfs_write(fhandle, buffer, size);
+            return tfs_read(fhandle, buffer, size);
+        case CREATE:
+            // a name no other thread uses
+            snprintf(name, sizeof(name), "/c%d_%zu", args->id, i);
+            fhandle = tfs_open(name, TFS_O_CREAT);
+            return fhandle == -1 ? -1 : tfs_close(fhandle);
+        case OPEN_CLOSE:
+            file_name(name, args->id);
+            fhandle = tfs_open(name, 0);
+            return fhandle == -1 ? -1 : tfs_close(fhandle);
+        default:
+            return -1;
+    }
+}
+
+static void *bench_thread(void *arg) {
+    thread_args_t *args = arg;
+    char buffer[BLOCK_SIZE];
+    char name[MAX_FILE_NAME];
+    unsigned seed = (unsigned)args->id + 1;
+    struct timespec start, end;
+
+    memset(buffer, 'a' + args->id % 26, sizeof(buffer));
+    // the mixed workloads share the first thread's file
+    file_name(name, args->workload->kind == MIXED ? 0 : args->id);
+    int fhandle = -1;
+    if (args->workload->kind != CREATE && args->workload->kind != OPEN_CLOSE)
+        fhandle = tfs_open(name, 0);
+
+    pthread_barrier_wait(args->start);
+    uint64_t metadata_ios, data_ios;
+    tfs_ios(&metadata_ios, &data_ios);
+    for (size_t i = 0; i < args->ops; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ssize_t moved = run_op(args, fhandle, i, &seed, buffer);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (moved < 0)
+            args->failed = 1;
+        else
+            args->bytes += (size_t)moved;
+        args->ns[i] = elapsed_ns(&start, &end);
+    }
+    tfs_ios(&args->metadata_ios, &args->data_ios);
+    args->metadata_ios -= metadata_ios;
+    args->data_ios -= data_ios;
+    if (fhandle != -1)
+        tfs_close(fhandle);
+    return NULL;
+}
+
+/*
+ * Runs a workload on a fresh file system and prints its row.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int run(workload_t const *workload, size_t size, int threads, size_t ops_per_thread) {
+    pthread_t tid[MAX_THREADS];
+    thread_args_t args[MAX_THREADS];
+    pthread_barrier_t start_barrier;
+    struct timespec start, end;
+    char name[MAX_FILE_NAME];
+    char block[BLOCK_SIZE];
+
+    // the directory only has room for so many files, besides the threads'
+    if (workload->kind == CREATE) {
+        size_t room = (MAX_DIR_ENTRIES < INODE_TABLE_SIZE - 1 ? MAX_DIR_ENTRIES : INODE_TABLE_SIZE - 1) -
+                      (size_t)threads;
+        if (ops_per_thread > room / (size_t)threads)
+            ops_per_thread = room / (size_t)threads;
+    }
+    size_t total_ops = ops_per_thread * (size_t)threads;
+    long *ns = malloc((total_ops > 0 ? total_ops : 1) * sizeof(long));
+    if (ns == NULL || tfs_init() != 0)
+        return -1;
+
+    // Every thread's file is full, so that reads always find something
+    memset(block, 'x', sizeof(block));
+    for (int t = 0; t < threads; t++) {
+        file_name(name, t);
+        int f = tfs_open(name, TFS_O_CREAT);
+        if (f == -1 || tfs_write(f, block, sizeof(block)) != sizeof(block) || tfs_close(f) != 0)
+            return -1;
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, (unsigned)threads + 1);
+    for (int t = 0; t < threads; t++) {
+        args[t] = (thread_args_t){.workload = workload,
+                                  .size = size,
+                                  .id = t,
+                                  .ops = ops_per_thread,
+                                  .ns = ns + (size_t)t * ops_per_thread,
+                                  .start = &start_barrier};
+        if (pthread_create(&tid[t], NULL, bench_thread, &args[t]) != 0)
+            return -1;
+    }
+    // before letting them go, as they may be done before this thread runs again
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_barrier_wait(&start_barrier);
+    size_t bytes = 0;
+    uint64_t metadata_ios = 0, data_ios = 0;
+    int failed = 0;
+    for (int t = 0; t < threads; t++) {
+        pthread_join(tid[t], NULL);
+        bytes += args[t].bytes;
+        metadata_ios += args[t].metadata_ios;
+        data_ios += args[t].data_ios;
+        failed |= args[t].failed;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_barrier_destroy(&start_barrier);
+    tfs_destroy();
+
+    double seconds = (double)elapsed_ns(&start, &end) / 1e9;
+    qsort(ns, total_ops, sizeof(long), compare_ns);
+    printf("%s,%zu,%d,%zu,%.6f,%.1f,%.3f,%.2f,%.2f,%.2f,%.2f,%.2f\n", workload->name, workload->sized ? size : 0, threads,
+           total_ops, seconds, (double)total_ops / seconds, (double)bytes / seconds / 1e6,
+           total_ops > 0 ? (double)ns[total_ops / 2] / 1000.0 : 0.0,
+           total_ops > 0 ? (double)ns[total_ops * 99 / 100] / 1000.0 : 0.0,
+           total_ops > 0 ? (double)ns[total_ops * 999 / 1000] / 1000.0 : 0.0,
+           total_ops > 0 ? (double)metadata_ios / (double)total_ops : 0.0,
+           total_ops > 0 ? (double)data_ios / (double)total_ops : 0.0);
+    free(ns);
+    if (failed)
+        fprintf(stderr, "%s: some operations failed\n", workload->name);
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char **argv) {
+
+    int max_threads = argc > 1 ? atoi(argv[1]) : DEFAULT_MAX_THREADS;
+    long ops = argc > 2 ? atol(argv[2]) : DEFAULT_OPS_PER_THREAD;
+    // only the workloads whose name starts with it
+    char const *only = argc > 3 ? argv[3] : "";
+    if (max_threads < 1 || max_threads > MAX_THREADS || ops < 1) {
+        printf("Usage: %s [max_threads (1 to %d)] [ops_per_thread] [workload]\n", argv[0], MAX_THREADS);
+        return 1;
+    }
+
+    printf("workload,size,threads,ops,seconds,ops_per_s,mb_per_s,p50_us,p99_us,p999_us,meta_ios_per_op,data_ios_per_op\n");
+    int result = 0;
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        workload_t const *workload = &workloads[w];
+        if (strncmp(workload->name, only, strlen(only)) != 0)
+            continue;
+        size_t size_count = workload->sized ? sizeof(sizes) / sizeof(sizes[0]) : 1;
+        for (size_t s = 0; s < size_count; s++) {
+            // doubling, with max_threads itself as the last step
+            for (int threads = 1;; threads = threads * 2 < max_threads ? threads * 2 : max_threads) {
+                if (run(workload, sizes[s], threads, (size_t)ops) != 0)
+                    result = 1;
+                if (threads == max_threads)
+                    break;
+            }
+        }
+        fflush(stdout);
+    }
+    return result;
+}
@@ -0,0 +1,341 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+#include "../client/tecnicofs_client_api.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*  Loads running servers with many clients at once: forks K processes, each
+    a client with its own pipes, which run a mix of operations on a set of
+    files for a fixed time or number of operations each. Then prints, as
+    CSV, the throughput and latency percentiles of each kind of operation
+    (and of all of them), over every client.
+    Latencies are counted in the same log-linear buckets as the server's
+    (see TFS_STATS_BUCKETS), so percentiles are within a quarter of a power
+    of two of the real ones.
+
+    Usage: load_gen [options] client_pipe_path server_pipe_path...
+      -c clients      clients at once (default 8)
+      -d seconds      how long each client runs (default 5)
+      -n ops          or how many operations each one runs
+      -m mix          kinds of operation and their weights, e.g. get:70,put:30
+                      (get, put, stat, open, read, write; default
+                      get:50,put:20,stat:20,read:5,write:5)
+      -s sizes        bytes per get, put, read or write and their weights,
+                      e.g. 64:80,1024:20 (default 1024:1)
+      -f files        files the clients share (default 8)
+    With several servers, each client spreads the files over them as
+    tfs_mount_sharded does. open opens and closes a file; read and write
+    go through a handle each client keeps open on one of the files. */
+
+#define MAX_CLIENTS (256)
+#define MAX_CHOICES (16)
+
+typedef enum { OP_GET, OP_PUT, OP_STAT, OP_OPEN, OP_READ, OP_WRITE, OP_KINDS } op_kind;
+
+static char const *const op_names[OP_KINDS] = {"get", "put", "stat", "open", "read", "write"};
+
+// something picked at random, with a weight
+typedef struct {
+    long value;
+    long weight;
+} choice_t;
+
+typedef struct {
+    choice_t choices[MAX_CHOICES];
+    int count;
+    long total_weight;
+} distribution_t;
+
+static int clients = 8;
+static double seconds = 5;
+static long ops_per_client = 0; // runs for seconds instead
+static int files = 8;
+static distribution_t mix, sizes;
+static char const *client_pipe;
+static char const *const *servers;
+static int server_count;
+
+/*
+ * Parses "name:weight,..." (or "number:weight,..." without names).
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int parse_distribution(char const *spec, char const *const *names, int name_count, distribution_t *d) {
+    char copy[256];
+    snprintf(copy, sizeof(copy), "%s", spec);
+    d->count = 0;
+    d->total_weight = 0;
+    for (char *item = strtok(copy, ","); item != NULL; item = strtok(NULL, ",")) {
+        char *colon = strchr(item, ':');
+        if (colon == NULL || d->count == MAX_CHOICES)
+            return -1;
+        *colon = '\0';
+        choice_t *c = &d->choices[d->count];
+        c->value = -1;
+        if (names == NULL)
+            c->value = atol(item);
+        for (int i = 0; names != NULL && i < name_count; i++)
+            if (strcmp(item, names[i]) == 0)
+                c->value = i;
+        c->weight = atol(colon + 1);
+        if (c->value < 0 || c->weight < 0)
+            return -1;
+        d->total_weight += c->weight;
+        d->count++;
+    }
+    return d->total_weight > 0 ? 0 : -1;
+}
+
+static long pick(distribution_t const *d, unsigned *seed) {
+    long r = rand_r(seed) % d->total_weight;
+    int i = 0;
+    while (r >= d->choices[i].weight)
+        r -= d->choices[i++].weight;
+    return d->choices[i].value;
+}
+
+static uint64_t elapsed_ns(struct timespec const *start, struct timespec const *end) {
+    return (uint64_t)((end->tv_sec - start->tv_sec) * 1000000000L + (end->tv_nsec - start->tv_nsec));
+}
+
+// the server's bucket for a latency (see TFS_STATS_BUCKETS)
+static int latency_bucket(uint64_t ns) {
+    if (ns < TFS_STATS_SUB_BUCKETS)
+        return (int)ns;
+    int e = 63 - __builtin_clzll(ns);
+    int bucket = (e - 1) * TFS_STATS_SUB_BUCKETS + (int)((ns >> (e - 2)) & 3);
+    return bucket < TFS_STATS_BUCKETS ? bucket : TFS_STATS_BUCKETS - 1;
+}
+
+static void file_name(char *name, long file) {
+    snprintf(name, MAX_FILE_NAME, "/load%ld", file);
+}
+
+/*
+ * Runs a single operation.
+ * Returns the bytes it moved, or -1 if it failed.
+ */
+static ssize_t run_op(op_kind kind, int fhandle, unsigned *seed, char *buffer) {
+    char name[MAX_FILE_NAME];
+    size_t size = (size_t)pick(&sizes, seed);
+    file_name(name, rand_r(seed) % files);
+    switch (kind) {
+        case OP_GET:
+            return tfs_get(name, buffer, size);
+        case OP_PUT:
+            return tfs_put(name, buffer, size, TFS_O_TRUNC);
+        case OP_STAT: {
+            tfs_stat_t st;
+            return tfs_stat(name, &st);
+        }
+        case OP_OPEN: {
+            int f = tfs_open(name, 0);
+            return f == -1 ? -1 : tfs_close(f);
+        }
+        case OP_READ:
+        case OP_WRITE:
+            if (tfs_lseek(fhandle, 0, TFS_SEEK_SET) != 0)
+                return -1;
+            return kind == OP_READ ? tfs_read(fhandle, buffer, size) : tfs_write(fhandle, buffer, size);
+        case OP_KINDS:
+        default:
+            return -1;
+    }
+}
+
+/*
+ * Runs a client, once start_fd reaches EOF, counting what it does in stats.
+ * Returns 0 if successful, 1 otherwise (as the process' exit status).
+ */
+static int run_client(int id, int start_fd, tfs_op_stats_t *stats) {
+    char pipe_path[MAX_PATH_NAME + 1];
+    char buffer[BLOCK_SIZE];
+    char name[MAX_FILE_NAME];
+    unsigned seed = (unsigned)id * 7919 + 1;
+    struct timespec start, end, deadline;
+
+    snprintf(pipe_path, sizeof(pipe_path), "%s.%d", client_pipe, id);
+    if (tfs_mount_sharded(pipe_path, servers, server_count) != 0)
+        return 1;
+    memset(buffer, 'a' + id % 26, sizeof(buffer));
+    // only with reads or writes in the mix, as the server has few handles
+    int fhandle = -1;
+    for (int i = 0; i < mix.count; i++) {
+        if ((mix.choices[i].value == OP_READ || mix.choices[i].value == OP_WRITE) && mix.choices[i].weight > 0 &&
+            fhandle == -1) {
+            file_name(name, id % files);
+            if ((fhandle = tfs_open(name, 0)) == -1)
+                return 1;
+        }
+    }
+
+    // All clients start at once
+    char c;
+    while (read(start_fd, &c, 1) > 0)
+        ;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += (time_t)seconds;
+    deadline.tv_nsec += (long)((seconds - (double)(time_t)seconds) * 1e9);
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    for (long i = 0; ops_per_client > 0 ? i < ops_per_client : 1; i++) {
+        op_kind kind = (op_kind)pick(&mix, &seed);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ssize_t moved = run_op(kind, fhandle, &seed, buffer);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        tfs_op_stats_t *s = &stats[kind];
+        uint64_t ns = elapsed_ns(&start, &end);
+        s->count++;
+        s->latency_ns += ns;
+        s->latency[latency_bucket(ns)]++;
+        if (moved < 0)
+            s->errors++;
+        else if (kind == OP_PUT || kind == OP_WRITE)
+            s->bytes_in += (uint64_t)moved;
+        else if (kind != OP_STAT && kind != OP_OPEN)
+            s->bytes_out += (uint64_t)moved;
+        if (ops_per_client == 0 && (end.tv_sec > deadline.tv_sec ||
+                                    (end.tv_sec == deadline.tv_sec && end.tv_nsec >= deadline.tv_nsec)))
+            break;
+    }
+    if (fhandle != -1)
+        tfs_close(fhandle);
+    return tfs_unmount() == 0 ? 0 : 1;
+}
+
+static void print_row(char const *name, tfs_op_stats_t const *s, double wall) {
+    printf("%s,%d,%lu,%lu,%.3f,%.1f,%.3f,%.2f,%.2f,%.2f,%.2f\n", name, clients, (unsigned long)s->count,
+           (unsigned long)s->errors, wall, (double)s->count / wall,
+           (double)(s->bytes_in + s->bytes_out) / wall / 1e6,
+           s->count > 0 ? (double)s->latency_ns / (double)s->count / 1000.0 : 0.0,
+           (double)tfs_stats_percentile(s, 50) / 1000.0, (double)tfs_stats_percentile(s, 99) / 1000.0,
+           (double)tfs_stats_percentile(s, 99.9) / 1000.0);
+}
+
+static void add_stats(tfs_op_stats_t *to, tfs_op_stats_t const *from) {
+    to->count += from->count;
+    to->errors += from->errors;
+    to->bytes_in += from->bytes_in;
+    to->bytes_out += from->bytes_out;
+    to->latency_ns += from->latency_ns;
+    for (int b = 0; b < TFS_STATS_BUCKETS; b++)
+        to->latency[b] += from->latency[b];
+}
+
+int main(int argc, char **argv) {
+
+    char const *mix_spec = "get:50,put:20,stat:20,read:5,write:5";
+    char const *size_spec = "1024:1";
+    int opt;
+    while ((opt = getopt(argc, argv, "c:d:n:m:s:f:")) != -1) {
+        switch (opt) {
+            case 'c':
+                clients = atoi(optarg);
+                break;
+            case 'd':
+                seconds = atof(optarg);
+                break;
+            case 'n':
+                ops_per_client = atol(optarg);
+                break;
+            case 'm':
+                mix_spec = optarg;
+                break;
+            case 's':
+                size_spec = optarg;
+                break;
+            case 'f':
+                files = atoi(optarg);
+                break;
+            default:
+                return 1;
+        }
+    }
+    if (argc - optind < 2 || clients < 1 || clients > MAX_CLIENTS || files < 1 || seconds <= 0 ||
+        ops_per_client < 0 || parse_distribution(mix_spec, op_names, OP_KINDS, &mix) != 0 ||
+        parse_distribution(size_spec, NULL, 0, &sizes) != 0) {
+        printf("Usage: %s [-c clients] [-d seconds | -n ops] [-m mix] [-s sizes] [-f files] "
+               "client_pipe_path server_pipe_path...\n",
+               argv[0]);
+        return 1;
+    }
+    for (int i = 0; i < sizes.count; i++)
+        if (sizes.choices[i].value > BLOCK_SIZE)
+            sizes.choices[i].value = BLOCK_SIZE;
+    client_pipe = argv[optind];
+    servers = (char const *const *)argv + optind + 1;
+    server_count = argc - optind - 1;
+
+    // Every file exists, full, before the clients start
+    char block[BLOCK_SIZE], name[MAX_FILE_NAME];
+    memset(block, 'x', sizeof(block));
+    if (tfs_mount_sharded(client_pipe, servers, server_count) != 0) {
+        fprintf(stderr, "could not mount %s\n", servers[0]);
+        return 1;
+    }
+    for (int f = 0; f < files; f++) {
+        file_name(name, f);
+        if (tfs_put(name, block, sizeof(block), TFS_O_CREAT | TFS_O_TRUNC) != sizeof(block)) {
+            fprintf(stderr, "could not create %s\n", name);
+            tfs_unmount();
+            return 1;
+        }
+    }
+    if (tfs_unmount() != 0)
+        return 1;
+
+    // what each client did, by kind of operation, where the parent sees it
+    size_t stats_size = (size_t)clients * OP_KINDS * sizeof(tfs_op_stats_t);
+    tfs_op_stats_t *stats = mmap(NULL, stats_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    int start_pipe[2];
+    if (stats == MAP_FAILED || pipe(start_pipe) != 0)
+        return 1;
+    memset(stats, 0, stats_size);
+
+    for (int c = 0; c < clients; c++) {
+        pid_t pid = fork();
+        if (pid == -1)
+            return 1;
+        if (pid == 0) {
+            close(start_pipe[1]);
+            _exit(run_client(c, start_pipe[0], stats + (size_t)c * OP_KINDS));
+        }
+    }
+    close(start_pipe[0]);
+    // give them time to mount, then let them all go
+    struct timespec nap = {.tv_nsec = 200000000}, start, end;
+    nanosleep(&nap, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    close(start_pipe[1]);
+    int result = 0;
+    for (int c = 0; c < clients; c++) {
+        int status;
+        if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            result = 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double wall = (double)elapsed_ns(&start, &end) / 1e9;
+
+    printf("op,clients,ops,errors,seconds,ops_per_s,mb_per_s,mean_us,p50_us,p99_us,p999_us\n");
+    tfs_op_stats_t all, op;
+    memset(&all, 0, sizeof(all));
+    for (int k = 0; k < OP_KINDS; k++) {
+        memset(&op, 0, sizeof(op));
+        for (int c = 0; c < clients; c++)
+            add_stats(&op, &stats[(size_t)c * OP_KINDS + (size_t)k]);
+        if (op.count == 0)
+            continue;
+        print_row(op_names[k], &op, wall);
+        add_stats(&all, &op);
+    }
+    print_row("all", &all, wall);
+    if (result != 0)
+        fprintf(stderr, "some clients failed\n");
+    munmap(stats, stats_size);
+    return result;
+}
@@ -0,0 +1,83 @@
+#include "../client/tecnicofs_client_api.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*  Measures the round-trip latency of requests to a running server, over
+    its named pipe, over its Unix socket and over shared memory.
+    Each request seeks an invalid file handle, which the server answers
+    without going to the file system's storage, so the timings are mostly
+    transport. */
+
+#define DEFAULT_ROUND_TRIPS (20000)
+#define WARMUP_ROUND_TRIPS (1000)
+
+static int compare_ns(void const *a, void const *b) {
+    long x = *(long const *)a, y = *(long const *)b;
+    return (x > y) - (x < y);
+}
+
+static long elapsed_ns(struct timespec const *start, struct timespec const *end) {
+    return (end->tv_sec - start->tv_sec) * 1000000000L + (end->tv_nsec - start->tv_nsec);
+}
+
+static int measure(char const *name, int (*mount)(char const *, char const *), char const *client_path,
+                   char const *server_path, long *ns, size_t round_trips) {
+    if (mount(client_path, server_path) != 0) {
+        fprintf(stderr, "%s: could not mount %s\n", name, server_path);
+        return -1;
+    }
+    for (size_t i = 0; i < WARMUP_ROUND_TRIPS; i++)
+        tfs_lseek(-1, 0, TFS_SEEK_SET);
+
+    struct timespec start, end;
+    for (size_t i = 0; i < round_trips; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        tfs_lseek(-1, 0, TFS_SEEK_SET);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ns[i] = elapsed_ns(&start, &end);
+    }
+    if (tfs_unmount() != 0)
+        return -1;
+
+    double sum = 0;
+    for (size_t i = 0; i < round_trips; i++)
+        sum += (double)ns[i];
+    qsort(ns, round_trips, sizeof(long), compare_ns);
+    printf("%-8s %10.2f %10.2f %10.2f %10.2f\n", name, sum / (double)round_trips / 1000.0,
+           (double)ns[round_trips / 2] / 1000.0, (double)ns[round_trips * 99 / 100] / 1000.0,
+           (double)ns[round_trips - 1] / 1000.0);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path [round_trips]'\n");
+        return 1;
+    }
+    size_t round_trips = argc > 3 ? strtoul(argv[3], NULL, 10) : DEFAULT_ROUND_TRIPS;
+    if (round_trips == 0)
+        return 1;
+
+    char socket_path[MAX_PATH_NAME + 1];
+    snprintf(socket_path, sizeof(socket_path), "%s.sock", argv[2]);
+    long *ns = malloc(round_trips * sizeof(long));
+    if (ns == NULL)
+        return 1;
+
+    printf("%-8s %10s %10s %10s %10s\n", "", "mean(us)", "p50(us)", "p99(us)", "max(us)");
+    int result = 0;
+    if (measure("fifo", tfs_mount, argv[1], argv[2], ns, round_trips) != 0)
+        result = 1;
+    if (measure("socket", tfs_mount, argv[1], socket_path, ns, round_trips) != 0)
+        result = 1;
+    // the client path names the ring's file instead
+    if (measure("shm", tfs_mount_shm, argv[1], argv[2], ns, round_trips) != 0)
+        result = 1;
+
+    free(ns);
+    return result;
+}
@@ -1,127 +1,1334 @@
 #include "tecnicofs_client_api.h"
+#include "../common/ring.h"
+#include <errno.h>
 #include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
 
-int session_id;
-int fcli, fserv;
-size_t c_size, r_size;
-char* pipename;
+// the session's own pipe for requests is named after the client's pipe
+#define REQUEST_PIPE_SUFFIX ".req"
+// a server's Unix socket is named after its pipe
+#define SOCKET_SUFFIX ".sock"
+// how long to wait for the server to map a ring and answer the mount
+#define RING_MOUNT_TIMEOUT_MS (5000)
 
-int num_digits(int n);
+/* Requests carry a tag, which their response echoes: the server may answer
+ * the requests of a session out of order. A response that arrives while
+ * another one is awaited is kept here until its turn. */
+typedef struct {
+    int used;
+    uint32_t tag;
+    int64_t result;
+    size_t payload_len;
+    int in_place; // the payload went straight to the awaiting caller's buffer
+    char payload[MAX_PAYLOAD_SIZE];
+} early_response_t;
+
+/* Asynchronous requests, completed by the I/O thread as their responses
+ * arrive. Once it runs, the I/O thread receives every response of the
+ * session, and keeps the ones awaited by synchronous calls in early for them
+ * to take. */
+typedef struct {
+    int used;
+    int done;
+    uint32_t tag;
+    int fhandle; // the file handle it is on, -1 for an open
+    void *buffer;
+    size_t max_len;
+    int64_t result;
+    tfs_callback_t callback;
+    void *arg;
+} async_request_t;
+
+/* Contents got with tfs_get, kept for as long as the server's lease on them
+ * holds: until it runs out, or until the server revokes it, through the
+ * session's pipe. Only synchronous sessions over pipes or a socket cache
+ * anything, as then nothing else is in flight when a get is served from the
+ * cache, and the pipe can only hold revocations. */
+typedef struct {
+    int used;
+    int inumber;
+    struct timespec expires;
+    size_t size;
+    char name[MAX_FILE_NAME + 1];
+    char contents[BLOCK_SIZE];
+} cache_entry_t;
+
+/* A session with one of the servers. */
+typedef struct {
+    int session_id;
+    int fcli, freq;
+    int is_socket; // over a Unix socket, fcli == freq
+    tfs_ring_t *ring; // over shared memory, NULL otherwise
+
+    uint32_t next_tag;
+    early_response_t early[MAX_IN_FLIGHT];
+    char pipename[MAX_PATH_NAME + 1];
+    char request_pipename[MAX_PATH_NAME + 1];
+    // where to resume a parked ring
+    char server_pipename[MAX_PATH_NAME + 1];
+
+    async_request_t async_requests[MAX_ASYNC_REQUESTS];
+    pthread_t io_thread;
+    int io_running;
+    int io_failed; // the session broke, so no more responses will come
+    int io_stopping; // after the response to the unmount, with io_last_tag
+    uint32_t io_last_tag;
+    // Requests sent and not answered yet, by tag: a request waits for the one
+    // MAX_IN_FLIGHT tags older, which also keeps it from reusing a ring slot
+    // that is still taken
+    int unanswered[MAX_IN_FLIGHT];
+    int io_initialized; // io_lock and io_cond
+    pthread_mutex_t io_lock;
+    pthread_cond_t io_cond;
+
+    cache_entry_t cache[CACHE_ENTRIES];
+    size_t cache_victim; // replaced next, unless an entry is free or stale
+    unsigned revocations; // received so far, whichever files they were for
+} connection_t;
+
+connection_t connections[MAX_SERVERS];
+int server_count;
+/* The connection the calls below go through, which each call of the API
+ * picks by path name or file handle. Every I/O thread has its own. */
+_Thread_local connection_t *conn = &connections[0];
+
+/* Path names go to servers by consistent hashing: each server takes
+ * SERVER_POINTS points on a circle of 32-bit hashes, placed by hashing its
+ * pipe's path name, and a path name goes to the server of the first point at
+ * or after its own hash. Adding a server to the list only moves the names
+ * that land on its points, and clients agree on where each file is as long
+ * as they name the servers the same way. */
+typedef struct {
+    uint32_t hash;
+    int server;
+} point_t;
+
+point_t points[MAX_SERVERS * SERVER_POINTS];
+
+int send_request(int fd, tfs_request_t *request, void const *payload, size_t payload_len);
+int send_request_iov(int fd, tfs_request_t *request, struct iovec const *payload, int count);
+int write_request(int fd, tfs_request_t *request, struct iovec const *payload, int count);
+int on_file_handle(tfs_request_t const *request);
+int handle_busy(tfs_request_t const *request, uint32_t tag);
+int submit_async(tfs_request_t *request, struct iovec const *payload, int count, void *buffer,
+                 size_t max_len, tfs_callback_t callback, void *arg);
+int start_io_thread();
+void *io_thread_main(void *arg);
+void complete_async(async_request_t *async, early_response_t const *response);
+int take_response(uint32_t tag, int64_t *result, void *payload, size_t max_len);
+ssize_t get_cached(char const *name, void *buffer, size_t len);
+cache_entry_t *find_cached(char const *name, struct timespec const *now);
+int ran_out(struct timespec const *expires, struct timespec const *now);
+void drop_cached(int64_t inumber);
+int drain_revocations();
+int receive_message(early_response_t *response, uint32_t tag, void *payload, size_t max_len, int timeout_ms);
+int read_response(uint32_t tag, int64_t *result, void *payload, size_t max_len);
+int wait_response(uint32_t tag, int64_t *result, void *payload, size_t max_len, int timeout_ms);
+int receive_response(early_response_t *response, uint32_t tag, void *payload, size_t max_len, int timeout_ms);
+int read_full(int fd, void *buffer, size_t size);
+int mount_session(char const *client_pipe_path, char const *server_pipe_path);
+int mount_socket(char const *server_socket_path);
+int unmount_session();
+int stat_many_session(char const *const *names, size_t count, tfs_stat_t *stats, int *results);
+void place_servers(char const *const *server_pipe_paths, int count);
+int compare_points(void const *a, void const *b);
+uint32_t hash_name(char const *name, uint32_t seed);
+int server_of(char const *name);
+void route_name(char const *name);
+int route_handle(int handle);
+int tag_handle(int handle);
+int resume_ring();
+void reset_session();
 
 int tfs_mount(char const *client_pipe_path, char const *server_pipe_path) {
-    pipename = (char*)malloc(strlen(client_pipe_path));
-    strcpy(pipename, client_pipe_path);
-    unlink(client_pipe_path);
-    if (mkfifo(client_pipe_path, 0777) < 0) return -1;
-
-    c_size = 2 + MAX_SESSION_ID_LEN + 1 + MAX_PATH_NAME;
-    char command[c_size];
-    int result; // session_id || -1
-
-    sprintf(command, "%d %s", TFS_OP_CODE_MOUNT, client_pipe_path);
-    if ((fserv = open(server_pipe_path, O_WRONLY)) < 0) return -1;
-    if (write(fserv, command, c_size) < 0) return -1;
-    if ((fcli = open(client_pipe_path, O_RDONLY)) < 0) return -1;
-    if (read(fcli, &result, sizeof(int)) < 0) return -1;
-    if ((session_id = result) < 0) return -1;
+    return tfs_mount_sharded(client_pipe_path, &server_pipe_path, 1);
+}
+
+int tfs_mount_sharded(char const *client_pipe_path, char const *const *server_pipe_paths, int count) {
+    char pipe_path[MAX_PATH_NAME + 1];
+    if (count < 1 || count > MAX_SERVERS) return -1;
+    server_count = 0;
+    for (int i = 0; i < count; i++) {
+        // Each session has pipes of its own, named after the client's
+        int len = count == 1 ? snprintf(pipe_path, sizeof(pipe_path), "%s", client_pipe_path)
+                             : snprintf(pipe_path, sizeof(pipe_path), "%s.%d", client_pipe_path, i);
+        conn = &connections[i];
+        if (len < 0 || (size_t)len >= sizeof(pipe_path) || mount_session(pipe_path, server_pipe_paths[i]) < 0) {
+            // all of them or none
+            while (i-- > 0) {
+                conn = &connections[i];
+                unmount_session();
+            }
+            return -1;
+        }
+    }
+    server_count = count;
+    place_servers(server_pipe_paths, count);
     return 0;
 }
 
-int tfs_unmount() {
-    c_size = 2 + MAX_SESSION_ID_LEN + 1;
-    char command[c_size];
-    int result; // 0 || -1
+/*
+ * Mounts the connection to a single server.
+ */
+int mount_session(char const *client_pipe_path, char const *server_pipe_path) {
+    struct stat st;
+    reset_session();
+    if (stat(server_pipe_path, &st) == 0 && S_ISSOCK(st.st_mode))
+        return mount_socket(server_pipe_path);
+    conn->is_socket = 0;
 
-    sprintf(command, "%d %d", TFS_OP_CODE_UNMOUNT, session_id);
-    if (write(fserv, command, c_size) < 0) return -1;
-    if (read(fcli, &result, sizeof(int)) < 0) return -1;
+    size_t path_len = strlen(client_pipe_path);
+    if (path_len + strlen(REQUEST_PIPE_SUFFIX) > MAX_PATH_NAME) return -1;
+    strcpy(conn->pipename, client_pipe_path);
+    strcpy(conn->request_pipename, client_pipe_path);
+    strcat(conn->request_pipename, REQUEST_PIPE_SUFFIX);
+    unlink(conn->pipename);
+    unlink(conn->request_pipename);
+    if (mkfifo(conn->pipename, 0777) < 0) return -1;
+    if (mkfifo(conn->request_pipename, 0777) < 0) {
+        unlink(conn->pipename);
+        return -1;
+    }
+
+    // both path names, each with its '\0'
+    char payload[2 * (MAX_PATH_NAME + 1)];
+    size_t payload_len = path_len + 1 + strlen(conn->request_pipename);
+    memcpy(payload, conn->pipename, path_len + 1);
+    strcpy(payload + path_len + 1, conn->request_pipename);
+
+    tfs_request_t request = {.op_code = TFS_OP_CODE_MOUNT};
+    int64_t result; // session_id || -1
+
+    int fserv = open(server_pipe_path, O_WRONLY);
+    if (fserv < 0) return -1;
+    int sent = send_request(fserv, &request, payload, payload_len);
+    // the server's pipe is only needed to mount
+    close(fserv);
+    if (sent < 0) return -1;
+    if ((conn->fcli = open(conn->pipename, O_RDONLY)) < 0) return -1;
+    if (read_response(request.tag, &result, NULL, 0) < 0) return -1;
     if (result < 0) return -1;
+    conn->session_id = (int)result;
+    if ((conn->freq = open(conn->request_pipename, O_WRONLY)) < 0) return -1;
+    return 0;
+}
 
-    if (close(fcli) < 0) return -1;
-    if (close(fserv) < 0) return -1;
-    unlink(pipename);
-    free(pipename);
+int tfs_mount_shm(char const *client_ring_path, char const *server_pipe_path) {
+    size_t path_len = strlen(client_ring_path);
+    if (path_len > MAX_PATH_NAME || strlen(server_pipe_path) > MAX_PATH_NAME) return -1;
+    server_count = 0;
+    conn = &connections[0];
+    reset_session();
+    strcpy(conn->server_pipename, server_pipe_path);
+
+    int fd = open(client_ring_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) return -1;
+    tfs_ring_t *new_ring = MAP_FAILED;
+    if (ftruncate(fd, sizeof(tfs_ring_t)) == 0)
+        new_ring = mmap(NULL, sizeof(tfs_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (new_ring == MAP_FAILED) {
+        unlink(client_ring_path);
+        return -1;
+    }
+    // the file starts zeroed, so only these need setting
+    new_ring->magic = TFS_RING_MAGIC;
+    new_ring->client_pid = (int32_t)getpid();
+
+    tfs_request_t request = {.op_code = TFS_OP_CODE_MOUNT, .flags = TFS_MOUNT_SHARED_MEMORY};
+    int64_t result = -1; // session_id || -1
+
+    int fserv = open(server_pipe_path, O_WRONLY);
+    if (fserv >= 0) {
+        int sent = send_request(fserv, &request, client_ring_path, path_len);
+        close(fserv);
+        // the answer comes through the ring
+        conn->ring = new_ring;
+        if (sent < 0 || wait_response(request.tag, &result, NULL, 0, RING_MOUNT_TIMEOUT_MS) < 0)
+            result = -1;
+    }
+    // mapped by both, if at all, so the name is no longer needed
+    unlink(client_ring_path);
+    if (result < 0) {
+        munmap(new_ring, sizeof(tfs_ring_t));
+        conn->ring = NULL;
+        return -1;
+    }
+    conn->session_id = (int)result;
+    server_count = 1;
+    return 0;
+}
+
+int tfs_unmount() {
+    int result = 0; // 0 || -1
+    for (int i = 0; i < server_count; i++) {
+        conn = &connections[i];
+        if (unmount_session() < 0)
+            result = -1;
+    }
+    if (result == 0)
+        server_count = 0;
+    return result;
+}
+
+/*
+ * Unmounts the current connection.
+ */
+int unmount_session() {
+    tfs_request_t request = {.op_code = TFS_OP_CODE_UNMOUNT};
+    int64_t result; // 0 || -1
+
+    if (conn->io_running) {
+        // No response comes after this one, so the I/O thread ends with it
+        pthread_mutex_lock(&conn->io_lock);
+        conn->io_stopping = 1;
+        conn->io_last_tag = conn->next_tag;
+        pthread_mutex_unlock(&conn->io_lock);
+    }
+    int answered = send_request(conn->freq, &request, NULL, 0) == 0 && read_response(request.tag, &result, NULL, 0) == 0;
+    if (conn->io_running) {
+        // it ends with the response, or as soon as the session breaks
+        pthread_mutex_lock(&conn->io_lock);
+        int ended = answered || conn->io_failed;
+        pthread_mutex_unlock(&conn->io_lock);
+        if (ended) {
+            pthread_join(conn->io_thread, NULL);
+            conn->io_running = 0;
+        }
+    }
+    if (!answered || result < 0) return -1;
+
+    if (conn->ring != NULL) {
+        munmap(conn->ring, sizeof(tfs_ring_t));
+        conn->ring = NULL;
+        return 0;
+    }
+
+    if (close(conn->fcli) < 0) return -1;
+    if (conn->is_socket) return 0;
+    if (close(conn->freq) < 0) return -1;
+    unlink(conn->pipename);
+    unlink(conn->request_pipename);
+    return 0;
+}
+
+/*
+ * Connects to the server's socket instead, which needs no pipes: the
+ * connection is the session, and its session_id comes as soon as it is
+ * accepted.
+ */
+int mount_socket(char const *server_socket_path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(server_socket_path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, server_socket_path);
+
+    int64_t result; // session_id || -1
+
+    if ((conn->fcli = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0) return -1;
+    conn->freq = conn->fcli;
+    conn->is_socket = 1;
+    if (connect(conn->fcli, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        read_response(0, &result, NULL, 0) < 0 || result < 0) {
+        close(conn->fcli);
+        return -1;
+    }
+    conn->session_id = (int)result;
     return 0;
 }
 
 int tfs_open(char const *name, int flags) {
-    c_size = 2 + MAX_SESSION_ID_LEN + 1 + MAX_FILE_NAME + 4;
-    char command[c_size];
-    int result; // fhandle || -1
+    tfs_request_t request = {.op_code = TFS_OP_CODE_OPEN, .flags = flags};
+    int64_t result; // fhandle || -1
 
-    sprintf(command, "%d %d %s %d", TFS_OP_CODE_OPEN, session_id, name, flags);
-    if (write(fserv, command, c_size) < 0) return -1;
-    if (read(fcli, &result, sizeof(int)) < 0) return -1;
-    return result;
+    size_t name_len = strlen(name);
+    if (name_len > MAX_FILE_NAME) return -1;
+    route_name(name);
+    if (send_request(conn->freq, &request, name, name_len) < 0) return -1;
+    if (read_response(request.tag, &result, NULL, 0) < 0) return -1;
+    return tag_handle((int)result);
 }
 
 int tfs_close(int fhandle) {
-    c_size = 2 + MAX_SESSION_ID_LEN + 1 + MAX_FHANDLE_LEN + 1;
-    char command[c_size];
-    int result; // 0 || -1
+    fhandle = route_handle(fhandle);
+    tfs_request_t request = {.op_code = TFS_OP_CODE_CLOSE, .fhandle = fhandle};
+    int64_t result; // 0 || -1
 
-    sprintf(command, "%d %d %d", TFS_OP_CODE_CLOSE, session_id, fhandle);
-    if (write(fserv, command, c_size) < 0) return -1;
-    if (read(fcli, &result, sizeof(int)) < 0) return -1;
-    return result;
+    if (send_request(conn->freq, &request, NULL, 0) < 0) return -1;
+    if (read_response(request.tag, &result, NULL, 0) < 0) return -1;
+    return (int)result;
 }
 
 ssize_t tfs_write(int fhandle, void const *buffer, size_t len) {
-    c_size = (size_t)(2 + MAX_SESSION_ID_LEN + 1 + MAX_FHANDLE_LEN + 1 + num_digits((int)len) + 1);
-    char* command = (char*)malloc(c_size);
-    int result; // bytes || -1
-    char ack;
-
-    sprintf(command, "%d %d %d %lu", TFS_OP_CODE_WRITE, session_id, fhandle, len);
-    if (write(fserv, command, c_size) < 0) {
-        free(command);
-        return -1;
-    }
-    free(command);
-    if (read(fcli, &ack, sizeof(char)) < 0 ) return -1;
-    if (write(fserv, buffer, len) < 0) return -1;
-    if (read(fcli, &result, sizeof(int)) < 0) return -1;
-    return result;
+    fhandle = route_handle(fhandle);
+    tfs_request_t request = {.op_code = TFS_OP_CODE_WRITE, .fhandle = fhandle};
+    int64_t result; // bytes || -1
+
+    // no file holds more than a block, so the rest would never be written
+    if (len > BLOCK_SIZE)
+        len = BLOCK_SIZE;
+    if (send_request(conn->freq, &request, buffer, len) < 0) return -1;
+    if (read_response(request.tag, &result, NULL, 0) < 0) return -1;
+    return (ssize_t)result;
 }
 
 ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
-    c_size = (size_t)(2 + MAX_SESSION_ID_LEN + 1 + MAX_FHANDLE_LEN + 1 + num_digits((int)len) + 1);
-    char* command = (char*)malloc(c_size);
-    int result; // bytes || -1
+    fhandle = route_handle(fhandle);
+    tfs_request_t request = {.op_code = TFS_OP_CODE_READ, .fhandle = fhandle, .len = len};
+    int64_t result; // bytes || -1
+
+    if (send_request(conn->freq, &request, NULL, 0) < 0) return -1;
+    if (read_response(request.tag, &result, buffer, len) < 0) return -1;
+    return (ssize_t)result;
+}
+
+ssize_t tfs_put(char const *name, void const *buffer, size_t len, int flags) {
+    tfs_request_t request = {.op_code = TFS_OP_CODE_PUT, .flags = flags};
+    int64_t result; // bytes || -1
+
+    size_t name_len = strlen(name);
+    if (name_len > MAX_FILE_NAME) return -1;
+    if (len > BLOCK_SIZE)
+        len = BLOCK_SIZE;
+    route_name(name);
+    // the path name, then a '\0' and the contents
+    struct iovec payload[2] = {
+        {.iov_base = (void*)name, .iov_len = name_len + 1},
+        {.iov_base = (void*)buffer, .iov_len = len},
+    };
+    if (send_request_iov(conn->freq, &request, payload, 2) < 0) return -1;
+    if (read_response(request.tag, &result, NULL, 0) < 0) return -1;
+    return (ssize_t)result;
+}
+
+ssize_t tfs_get(char const *name, void *buffer, size_t len) {
+    tfs_request_t request = {.op_code = TFS_OP_CODE_GET, .len = len};
+    int64_t result; // bytes || -1
+
+    size_t name_len = strlen(name);
+    if (name_len > MAX_FILE_NAME) return -1;
+    route_name(name);
+    if (conn->ring == NULL && !conn->io_running)
+        return get_cached(name, buffer, len);
+    if (send_request(conn->freq, &request, name, name_len) < 0) return -1;
+    if (read_response(request.tag, &result, buffer, len) < 0) return -1;
+    return (ssize_t)result;
+}
+
+/*
+ * tfs_get through the cache: served from it while the lease on the file
+ * holds, or else got whole from the server, under a new lease.
+ */
+ssize_t get_cached(char const *name, void *buffer, size_t len) {
+    struct timespec now;
+    if (drain_revocations() < 0) return -1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    cache_entry_t *entry = find_cached(name, &now);
+    if (entry != NULL) {
+        size_t size = entry->size < len ? entry->size : len;
+        memcpy(buffer, entry->contents, size);
+        return (ssize_t)size;
+    }
+
+    tfs_request_t request = {.op_code = TFS_OP_CODE_GET, .flags = TFS_GET_LEASE, .len = BLOCK_SIZE};
+    int64_t result; // bytes || -1
+    struct {
+        tfs_lease_t lease;
+        char contents[BLOCK_SIZE];
+    } reply;
+
+    unsigned seen = conn->revocations;
+    if (send_request(conn->freq, &request, name, strlen(name)) < 0) return -1;
+    if (read_response(request.tag, &result, &reply, sizeof(reply)) < 0) return -1;
+    if (result < 0) return -1;
+    size_t size = (size_t)result < len ? (size_t)result : len;
+    memcpy(buffer, reply.contents, size);
+    // a revocation that came meanwhile may have been for these very contents
+    if (reply.lease.inumber == -1 || conn->revocations != seen)
+        return (ssize_t)size;
+
+    // The lease counts from before the request was sent, as the server's does
+    // from after it arrived
+    for (size_t i = 0; i < CACHE_ENTRIES && entry == NULL; i++)
+        if (!conn->cache[i].used || ran_out(&conn->cache[i].expires, &now))
+            entry = &conn->cache[i];
+    if (entry == NULL)
+        entry = &conn->cache[conn->cache_victim++ % CACHE_ENTRIES];
+    entry->used = 1;
+    entry->inumber = reply.lease.inumber;
+    entry->expires.tv_sec = now.tv_sec + reply.lease.term_ms / 1000;
+    entry->expires.tv_nsec = now.tv_nsec + (long)(reply.lease.term_ms % 1000) * 1000000L;
+    if (entry->expires.tv_nsec >= 1000000000L) {
+        entry->expires.tv_sec++;
+        entry->expires.tv_nsec -= 1000000000L;
+    }
+    entry->size = (size_t)result;
+    strcpy(entry->name, name);
+    memcpy(entry->contents, reply.contents, entry->size);
+    return (ssize_t)size;
+}
+
+/*
+ * Looks for a file's contents in the cache, under a lease that still holds
+ * (stale entries are dropped on the way).
+ */
+cache_entry_t *find_cached(char const *name, struct timespec const *now) {
+    for (size_t i = 0; i < CACHE_ENTRIES; i++) {
+        cache_entry_t *entry = &conn->cache[i];
+        if (!entry->used || strcmp(entry->name, name) != 0)
+            continue;
+        if (ran_out(&entry->expires, now)) {
+            entry->used = 0;
+            return NULL;
+        }
+        return entry;
+    }
+    return NULL;
+}
+
+int ran_out(struct timespec const *expires, struct timespec const *now) {
+    return expires->tv_sec < now->tv_sec || (expires->tv_sec == now->tv_sec && expires->tv_nsec <= now->tv_nsec);
+}
+
+void drop_cached(int64_t inumber) {
+    conn->revocations++;
+    for (size_t i = 0; i < CACHE_ENTRIES; i++)
+        if (conn->cache[i].used && conn->cache[i].inumber == inumber)
+            conn->cache[i].used = 0;
+}
+
+/*
+ * Takes whatever revocations are waiting in the session's pipe, without
+ * waiting for any.
+ * Returns 0 if successful, -1 otherwise.
+ */
+int drain_revocations() {
+    struct pollfd pending = {.fd = conn->fcli, .events = POLLIN};
+    int ready;
+    while ((ready = poll(&pending, 1, 0)) != 0) {
+        tfs_response_t header;
+        if (ready == -1 && errno == EINTR)
+            continue;
+        if (ready == -1 || !(pending.revents & POLLIN)) return -1;
+        // a revocation has no payload, and is a single message on a socket
+        if (read_full(conn->fcli, &header, sizeof(header)) < 0) return -1;
+        if (header.tag != TFS_REVOKE_TAG || header.payload_len != 0) return -1;
+        drop_cached(header.result);
+    }
+    return 0;
+}
+
+off_t tfs_lseek(int fhandle, off_t offset, int whence) {
+    fhandle = route_handle(fhandle);
+    tfs_request_t request = {.op_code = TFS_OP_CODE_LSEEK, .fhandle = fhandle, .offset = offset, .flags = whence};
+    int64_t result; // offset || -1
+
+    if (send_request(conn->freq, &request, NULL, 0) < 0) return -1;
+    if (read_response(request.tag, &result, NULL, 0) < 0) return -1;
+    return (off_t)result;
+}
+
+int tfs_truncate(int fhandle, size_t length) {
+    fhandle = route_handle(fhandle);
+    tfs_request_t request = {.op_code = TFS_OP_CODE_TRUNCATE, .fhandle = fhandle, .len = length};
+    int64_t result; // 0 || -1
+
+    if (send_request(conn->freq, &request, NULL, 0) < 0) return -1;
+    if (read_response(request.tag, &result, NULL, 0) < 0) return -1;
+    return (int)result;
+}
+
+int tfs_fallocate(int fhandle, size_t offset, size_t len) {
+    fhandle = route_handle(fhandle);
+    tfs_request_t request = {.op_code = TFS_OP_CODE_FALLOCATE, .fhandle = fhandle, .offset = (int64_t)offset, .len = len};
+    int64_t result; // 0 || -1
+
+    if (send_request(conn->freq, &request, NULL, 0) < 0) return -1;
+    if (read_response(request.tag, &result, NULL, 0) < 0) return -1;
+    return (int)result;
+}
+
+int tfs_stat(char const *name, tfs_stat_t *st) {
+    tfs_request_t request = {.op_code = TFS_OP_CODE_STAT};
+    int64_t result; // 0 || -1
+
+    size_t name_len = strlen(name);
+    if (name_len > MAX_FILE_NAME) return -1;
+    route_name(name);
+    if (send_request(conn->freq, &request, name, name_len) < 0) return -1;
+    if (read_response(request.tag, &result, st, sizeof(tfs_stat_t)) < 0) return -1;
+    return (int)result;
+}
+
+int tfs_fstat(int fhandle, tfs_stat_t *st) {
+    fhandle = route_handle(fhandle);
+    tfs_request_t request = {.op_code = TFS_OP_CODE_FSTAT, .fhandle = fhandle};
+    int64_t result; // 0 || -1
+
+    if (send_request(conn->freq, &request, NULL, 0) < 0) return -1;
+    if (read_response(request.tag, &result, st, sizeof(tfs_stat_t)) < 0) return -1;
+    return (int)result;
+}
+
+int tfs_stat_many(char const *const *names, size_t count, tfs_stat_t *stats, int *results) {
+    if (server_count <= 1) {
+        conn = &connections[0];
+        return stat_many_session(names, count, stats, results);
+    }
+
+    // The names of each server are gathered, in order, and stat'ed together
+    int *server = malloc(count * sizeof(int));
+    size_t *order = malloc(count * sizeof(size_t));
+    char const **subset = malloc(count * sizeof(char const *));
+    tfs_stat_t *subset_stats = malloc(count * sizeof(tfs_stat_t));
+    int *subset_results = malloc(count * sizeof(int));
+    int failed = server == NULL || order == NULL || subset == NULL || subset_stats == NULL || subset_results == NULL;
+    for (size_t i = 0; i < count && !failed; i++)
+        server[i] = server_of(names[i]);
+    for (int s = 0; s < server_count && !failed; s++) {
+        size_t n = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (server[i] == s) {
+                order[n] = i;
+                subset[n++] = names[i];
+            }
+        }
+        if (n == 0)
+            continue;
+        conn = &connections[s];
+        if (stat_many_session(subset, n, subset_stats, subset_results) < 0)
+            failed = 1;
+        for (size_t k = 0; k < n; k++) {
+            results[order[k]] = subset_results[k];
+            stats[order[k]] = subset_stats[k];
+        }
+    }
+    free(server);
+    free(order);
+    free(subset);
+    free(subset_stats);
+    free(subset_results);
+    return failed ? -1 : 0;
+}
+
+/*
+ * tfs_stat_many over the current connection.
+ */
+int stat_many_session(char const *const *names, size_t count, tfs_stat_t *stats, int *results) {
+    char payload[MAX_PAYLOAD_SIZE];
+    struct {
+        int results[MAX_STAT_PATHS];
+        tfs_stat_t stats[MAX_STAT_PATHS];
+    } reply;
+    // tags of the chunks sent but not answered yet, oldest first
+    uint32_t tags[MAX_IN_FLIGHT];
+    size_t sent = 0, received = 0, chunks_sent = 0, chunks_received = 0;
+    int failed = 0;
+
+    // Keeps up to MAX_IN_FLIGHT chunks in the server's pipeline
+    while (received < count) {
+        if (sent < count && chunks_sent - chunks_received < MAX_IN_FLIGHT) {
+            size_t n = count - sent;
+            if (n > MAX_STAT_PATHS)
+                n = MAX_STAT_PATHS;
+            // path names are sent one after the other, each with its '\0'
+            size_t pos = 0;
+            for (size_t i = 0; i < n; i++) {
+                size_t name_len = strnlen(names[sent + i], MAX_FILE_NAME);
+                memcpy(payload + pos, names[sent + i], name_len);
+                payload[pos + name_len] = '\0';
+                pos += name_len + 1;
+            }
+            tfs_request_t request = {.op_code = TFS_OP_CODE_STAT_MANY, .len = n};
+            if (send_request(conn->freq, &request, payload, pos) < 0) return -1;
+            tags[chunks_sent++ % MAX_IN_FLIGHT] = request.tag;
+            sent += n;
+            continue;
+        }
+
+        size_t n = count - received;
+        if (n > MAX_STAT_PATHS)
+            n = MAX_STAT_PATHS;
+        int64_t result; // 0 || -1
+        // all results, then all the stats
+        if (read_response(tags[chunks_received++ % MAX_IN_FLIGHT], &result, &reply, sizeof(reply)) < 0)
+            return -1;
+        if (result < 0)
+            failed = 1;
+        else {
+            memcpy(results + received, &reply, n * sizeof(int));
+            memcpy(stats + received, (char*)&reply + n * sizeof(int), n * sizeof(tfs_stat_t));
+        }
+        received += n;
+    }
+    return failed ? -1 : 0;
+}
+
+int tfs_set_qos(int weight, int depth) {
+    int64_t result = 0; // 0 || -1
+
+    if (weight < 1 || depth < 1 || server_count == 0) return -1;
+    // the session with each server
+    for (int i = 0; i < server_count && result == 0; i++) {
+        tfs_request_t request = {.op_code = TFS_OP_CODE_SET_QOS, .flags = depth, .len = (uint64_t)weight};
+        conn = &connections[i];
+        if (send_request(conn->freq, &request, NULL, 0) < 0) return -1;
+        if (read_response(request.tag, &result, NULL, 0) < 0) return -1;
+    }
+    return (int)result;
+}
+
+int tfs_stats(int op_code, tfs_op_stats_t *stats) {
+    tfs_op_stats_t server_stats;
+
+    if (server_count == 0) return -1;
+    memset(stats, 0, sizeof(*stats));
+    // added up over every server
+    for (int i = 0; i < server_count; i++) {
+        tfs_request_t request = {.op_code = TFS_OP_CODE_STATS, .flags = op_code};
+        int64_t result; // 0 || -1
+        conn = &connections[i];
+        if (send_request(conn->freq, &request, NULL, 0) < 0) return -1;
+        if (read_response(request.tag, &result, &server_stats, sizeof(server_stats)) < 0) return -1;
+        if (result < 0) return -1;
+        stats->count += server_stats.count;
+        stats->errors += server_stats.errors;
+        stats->bytes_in += server_stats.bytes_in;
+        stats->bytes_out += server_stats.bytes_out;
+        stats->queue_wait_ns += server_stats.queue_wait_ns;
+        stats->lock_wait_ns += server_stats.lock_wait_ns;
+        stats->metadata_ios += server_stats.metadata_ios;
+        stats->data_ios += server_stats.data_ios;
+        stats->latency_ns += server_stats.latency_ns;
+        for (int b = 0; b < TFS_STATS_BUCKETS; b++)
+            stats->latency[b] += server_stats.latency[b];
+    }
+    return 0;
+}
+
+uint64_t tfs_stats_percentile(tfs_op_stats_t const *stats, double percentile) {
+    uint64_t total = 0, seen = 0;
+    for (int b = 0; b < TFS_STATS_BUCKETS; b++)
+        total += stats->latency[b];
+    if (total == 0) return 0;
+    // the rank of the request the percentile falls on, counting from 1
+    double rank = percentile / 100 * (double)total;
+    int b;
+    for (b = 0; b < TFS_STATS_BUCKETS - 1; b++) {
+        seen += stats->latency[b];
+        if (seen > 0 && (double)seen >= rank)
+            break;
+    }
+    if (b < TFS_STATS_SUB_BUCKETS)
+        return (uint64_t)b;
+    // the buckets of [2^e, 2^(e+1)) are 2^(e-2) wide
+    int e = b / TFS_STATS_SUB_BUCKETS + 1;
+    return (uint64_t)(TFS_STATS_SUB_BUCKETS + b % TFS_STATS_SUB_BUCKETS) << (e - 2);
+}
+
+int tfs_open_async(char const *name, int flags, tfs_callback_t callback, void *arg) {
+    tfs_request_t request = {.op_code = TFS_OP_CODE_OPEN, .flags = flags};
+
+    size_t name_len = strlen(name);
+    if (name_len > MAX_FILE_NAME) return -1;
+    struct iovec payload = {.iov_base = (void*)name, .iov_len = name_len};
+    route_name(name);
+    return tag_handle(submit_async(&request, &payload, 1, NULL, 0, callback, arg));
+}
+
+int tfs_write_async(int fhandle, void const *buffer, size_t len, tfs_callback_t callback, void *arg) {
+    fhandle = route_handle(fhandle);
+    tfs_request_t request = {.op_code = TFS_OP_CODE_WRITE, .fhandle = fhandle};
 
-    sprintf(command, "%d %d %d %lu", TFS_OP_CODE_READ, session_id, fhandle, len);
-    if (write(fserv, command, c_size) < 0) {
-        free(command);
+    if (len > BLOCK_SIZE)
+        len = BLOCK_SIZE;
+    struct iovec payload = {.iov_base = (void*)buffer, .iov_len = len};
+    return tag_handle(submit_async(&request, &payload, len > 0 ? 1 : 0, NULL, 0, callback, arg));
+}
+
+int tfs_read_async(int fhandle, void *buffer, size_t len, tfs_callback_t callback, void *arg) {
+    fhandle = route_handle(fhandle);
+    tfs_request_t request = {.op_code = TFS_OP_CODE_READ, .fhandle = fhandle, .len = len};
+
+    return tag_handle(submit_async(&request, NULL, 0, buffer, len, callback, arg));
+}
+
+int tfs_poll(int handle, ssize_t *result) {
+    int done = -1; // 1 || 0 || -1
+
+    handle = route_handle(handle);
+    if (handle < 0 || handle >= MAX_ASYNC_REQUESTS) return -1;
+    pthread_mutex_lock(&conn->io_lock);
+    async_request_t *async = &conn->async_requests[handle];
+    if (async->used && async->callback == NULL) {
+        done = async->done;
+        if (done) {
+            *result = (ssize_t)async->result;
+            async->used = 0;
+        }
+    }
+    pthread_mutex_unlock(&conn->io_lock);
+    return done;
+}
+
+int tfs_wait(int handle, ssize_t *result) {
+    handle = route_handle(handle);
+    if (handle < 0 || handle >= MAX_ASYNC_REQUESTS) return -1;
+    pthread_mutex_lock(&conn->io_lock);
+    async_request_t *async = &conn->async_requests[handle];
+    if (!async->used || async->callback != NULL) {
+        pthread_mutex_unlock(&conn->io_lock);
         return -1;
     }
-    free(command);
-    if (read(fcli, buffer, len) < 0) return -1;
-    if (read(fcli, &result, sizeof(int)) < 0) return -1;
-    return result;
+    // a broken session completes whatever was in flight
+    while (!async->done)
+        pthread_cond_wait(&conn->io_cond, &conn->io_lock);
+    *result = (ssize_t)async->result;
+    async->used = 0;
+    pthread_mutex_unlock(&conn->io_lock);
+    return 0;
 }
 
 int tfs_shutdown_after_all_closed() {
-    c_size = 2 + MAX_SESSION_ID_LEN + 1;
-    char command[c_size];
-    int result; // 0 || -1
+    int64_t result = 0; // 0 || -1
 
-    sprintf(command, "%d %d", TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED, session_id);
-    if (write(fserv, command, c_size) < 0) return -1;
-    if (read(fcli, &result, sizeof(int)) < 0) return -1;
-    return result;
+    if (server_count == 0) return -1;
+    // every server, each waiting for its own files to be closed
+    for (int i = 0; i < server_count; i++) {
+        tfs_request_t request = {.op_code = TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED};
+        int64_t shut; // 0 || -1
+        conn = &connections[i];
+        if (send_request(conn->freq, &request, NULL, 0) < 0) return -1;
+        if (read_response(request.tag, &shut, NULL, 0) < 0) return -1;
+        if (shut < 0)
+            result = -1;
+    }
+    return (int)result;
+}
+
+/*
+ * Fills in the header fields common to every request and sends it, followed
+ * by its payload, in a single write (so that mounts from different clients
+ * are never interleaved in the server's pipe, and the server finds the whole
+ * request in the session's pipe once it is readable).
+ */
+int send_request(int fd, tfs_request_t *request, void const *payload, size_t payload_len) {
+    struct iovec iov = {.iov_base = (void*)payload, .iov_len = payload_len};
+    return send_request_iov(fd, request, &iov, payload_len > 0 ? 1 : 0);
+}
+
+/*
+ * As send_request, with a payload made of several pieces, each sent from
+ * where it is rather than gathered in a buffer first.
+ */
+int send_request_iov(int fd, tfs_request_t *request, struct iovec const *payload, int count) {
+    if (!conn->io_running)
+        return write_request(fd, request, payload, count);
+
+    // The request gets the next tag, once the request MAX_IN_FLIGHT tags
+    // older is answered. The server runs a session's requests in any order,
+    // so one on a file handle also waits for the asynchronous requests still
+    // in flight on that handle, to run after them.
+    uint32_t tag = conn->next_tag;
+    pthread_mutex_lock(&conn->io_lock);
+    while ((conn->unanswered[tag % MAX_IN_FLIGHT] || handle_busy(request, tag)) && !conn->io_failed)
+        pthread_cond_wait(&conn->io_cond, &conn->io_lock);
+    int failed = conn->io_failed;
+    conn->unanswered[tag % MAX_IN_FLIGHT] = !failed;
+    pthread_mutex_unlock(&conn->io_lock);
+    if (failed) return -1;
+
+    if (write_request(fd, request, payload, count) == 0) return 0;
+    pthread_mutex_lock(&conn->io_lock);
+    conn->unanswered[tag % MAX_IN_FLIGHT] = 0;
+    pthread_mutex_unlock(&conn->io_lock);
+    return -1;
+}
+
+/*
+ * Whether the request is on a file handle, which the server moves the offset
+ * of or closes.
+ */
+int on_file_handle(tfs_request_t const *request) {
+    return request->op_code == TFS_OP_CODE_CLOSE || request->op_code == TFS_OP_CODE_WRITE ||
+           request->op_code == TFS_OP_CODE_READ || request->op_code == TFS_OP_CODE_LSEEK ||
+           request->op_code == TFS_OP_CODE_TRUNCATE || request->op_code == TFS_OP_CODE_FALLOCATE ||
+           request->op_code == TFS_OP_CODE_FSTAT;
+}
+
+/*
+ * Whether an asynchronous request other than the one with the given tag is
+ * still in flight on the request's file handle. Called with io_lock held.
+ */
+int handle_busy(tfs_request_t const *request, uint32_t tag) {
+    if (!on_file_handle(request)) return 0;
+    for (size_t i = 0; i < MAX_ASYNC_REQUESTS; i++) {
+        async_request_t const *async = &conn->async_requests[i];
+        if (async->used && !async->done && async->tag != tag && async->fhandle == request->fhandle)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Does the sending for send_request_iov.
+ */
+int write_request(int fd, tfs_request_t *request, struct iovec const *payload, int count) {
+    struct iovec iov[1 + 2];
+    if (count > 2) return -1;
+    size_t payload_len = 0;
+    iov[0].iov_base = request;
+    iov[0].iov_len = sizeof(tfs_request_t);
+    for (int i = 0; i < count; i++) {
+        iov[1 + i] = payload[i];
+        payload_len += payload[i].iov_len;
+    }
+
+    request->version = TFS_PROTOCOL_VERSION;
+    request->session_id = conn->session_id;
+    request->tag = conn->next_tag++;
+    request->payload_len = (uint32_t)payload_len;
+    if (conn->ring != NULL) {
+        // At most MAX_IN_FLIGHT requests in flight, all older ones answered
+        // before this slot comes around again
+        uint32_t tail = atomic_load(&conn->ring->sq_tail);
+        if (payload_len > TFS_RING_SLOT_SIZE) return -1;
+        char *slot = conn->ring->data[tail % TFS_RING_ENTRIES];
+        for (int i = 0; i < count; i++) {
+            memcpy(slot, payload[i].iov_base, payload[i].iov_len);
+            slot += payload[i].iov_len;
+        }
+        conn->ring->sq[tail % TFS_RING_ENTRIES] = *request;
+        atomic_store(&conn->ring->sq_tail, tail + 1);
+        ring_wake(&conn->ring->sq_tail, &conn->ring->sq_waiting);
+        // nobody is watching the ring until the server is told
+        if (atomic_exchange(&conn->ring->sq_parked, 0))
+            return resume_ring();
+        return 0;
+    }
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = (size_t)(1 + count)};
+    ssize_t w;
+    do {
+        // a closed socket fails the call, rather than raising SIGPIPE
+        if (conn->is_socket)
+            w = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        else
+            w = writev(fd, iov, 1 + count);
+    } while (w == -1 && errno == EINTR);
+    return w == (ssize_t)(sizeof(tfs_request_t) + payload_len) ? 0 : -1;
+}
+
+/*
+ * Asks the server to watch the ring again, through its pipe, as the ring was
+ * parked for being idle.
+ */
+int resume_ring() {
+    tfs_request_t request = {
+        .version = TFS_PROTOCOL_VERSION,
+        .op_code = TFS_OP_CODE_RESUME,
+        .session_id = conn->session_id,
+    };
+    int fserv = open(conn->server_pipename, O_WRONLY);
+    if (fserv < 0) return -1;
+    ssize_t w;
+    do {
+        w = write(fserv, &request, sizeof(request));
+    } while (w == -1 && errno == EINTR);
+    close(fserv);
+    return w == (ssize_t)sizeof(request) ? 0 : -1;
+}
+
+/*
+ * Waits for the response to the request with the given tag, and keeps at
+ * most max_len bytes of its payload.
+ */
+int read_response(uint32_t tag, int64_t *result, void *payload, size_t max_len) {
+    if (conn->io_running)
+        return take_response(tag, result, payload, max_len);
+    return wait_response(tag, result, payload, max_len, -1);
+}
+
+/*
+ * Sends an asynchronous request, to be completed by the I/O thread (which is
+ * started if need be), and returns its handle.
+ */
+int submit_async(tfs_request_t *request, struct iovec const *payload, int count, void *buffer,
+                 size_t max_len, tfs_callback_t callback, void *arg) {
+    if (!conn->io_running && start_io_thread() < 0) return -1;
+
+    pthread_mutex_lock(&conn->io_lock);
+    int handle = -1;
+    for (int i = 0; i < MAX_ASYNC_REQUESTS && handle < 0; i++)
+        if (!conn->async_requests[i].used)
+            handle = i;
+    if (handle < 0) {
+        pthread_mutex_unlock(&conn->io_lock);
+        return -1;
+    }
+    // known by its tag before it is sent, so its response always finds it
+    conn->async_requests[handle] = (async_request_t){
+        .used = 1,
+        .tag = conn->next_tag,
+        .fhandle = on_file_handle(request) ? request->fhandle : -1,
+        .buffer = buffer,
+        .max_len = max_len,
+        .callback = callback,
+        .arg = arg,
+    };
+    pthread_mutex_unlock(&conn->io_lock);
+
+    if (send_request_iov(conn->freq, request, payload, count) < 0) {
+        pthread_mutex_lock(&conn->io_lock);
+        conn->async_requests[handle].used = 0;
+        pthread_mutex_unlock(&conn->io_lock);
+        return -1;
+    }
+    return handle;
+}
+
+int start_io_thread() {
+    // nothing is in flight, as synchronous calls wait for their responses
+    for (size_t i = 0; i < MAX_IN_FLIGHT; i++)
+        conn->unanswered[i] = 0;
+    conn->io_failed = 0;
+    conn->io_stopping = 0;
+    conn->io_running = 1;
+    if (pthread_create(&conn->io_thread, NULL, io_thread_main, conn) != 0) {
+        conn->io_running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Receives the session's responses one after the other, completing
+ * asynchronous requests and keeping the rest for take_response, until the
+ * response to the unmount or until the session breaks.
+ */
+void *io_thread_main(void *arg) {
+    conn = arg;
+    early_response_t response;
+    int stop = 0;
+
+    while (!stop) {
+        // no buffer of its own: the payload lands in the response
+        int failed = receive_response(&response, 0, NULL, 0, -1) < 0;
+        pthread_mutex_lock(&conn->io_lock);
+        if (!failed) {
+            conn->unanswered[response.tag % MAX_IN_FLIGHT] = 0;
+            stop = conn->io_stopping && response.tag == conn->io_last_tag;
+
+            async_request_t *async = NULL;
+            for (size_t i = 0; i < MAX_ASYNC_REQUESTS && async == NULL; i++)
+                if (conn->async_requests[i].used && !conn->async_requests[i].done && conn->async_requests[i].tag == response.tag)
+                    async = &conn->async_requests[i];
+            early_response_t *spare = NULL;
+            for (size_t i = 0; i < MAX_IN_FLIGHT && spare == NULL && async == NULL; i++)
+                if (!conn->early[i].used)
+                    spare = &conn->early[i];
+
+            if (async != NULL)
+                complete_async(async, &response);
+            else if (spare != NULL) {
+                spare->tag = response.tag;
+                spare->result = response.result;
+                spare->payload_len = response.payload_len;
+                spare->in_place = 0;
+                memcpy(spare->payload, response.payload, response.payload_len);
+                spare->used = 1;
+            } else
+                // more synchronous requests in flight than MAX_IN_FLIGHT
+                failed = 1;
+        }
+        if (failed) {
+            // whatever is in flight is never answered
+            conn->io_failed = 1;
+            stop = 1;
+            response.result = -1;
+            response.payload_len = 0;
+            for (size_t i = 0; i < MAX_ASYNC_REQUESTS; i++)
+                if (conn->async_requests[i].used && !conn->async_requests[i].done)
+                    complete_async(&conn->async_requests[i], &response);
+        }
+        pthread_cond_broadcast(&conn->io_cond);
+        pthread_mutex_unlock(&conn->io_lock);
+    }
+    return NULL;
+}
+
+/*
+ * Hands an asynchronous request its response, calling its callback if it
+ * has one. Called with io_lock held, which is released around the callback.
+ */
+void complete_async(async_request_t *async, early_response_t const *response) {
+    async->result = response->result;
+    if (response->payload_len > async->max_len)
+        async->result = -1;
+    else if (response->payload_len > 0)
+        memcpy(async->buffer, response->payload, response->payload_len);
+    async->done = 1;
+    if (async->callback == NULL) return;
+
+    pthread_mutex_unlock(&conn->io_lock);
+    async->callback(tag_handle((int)(async - conn->async_requests)), (ssize_t)async->result, async->arg);
+    pthread_mutex_lock(&conn->io_lock);
+    async->used = 0;
+}
+
+/*
+ * As read_response, once the I/O thread receives the responses: waits for it
+ * to keep the one with the given tag.
+ */
+int take_response(uint32_t tag, int64_t *result, void *payload, size_t max_len) {
+    early_response_t *response = NULL;
+    pthread_mutex_lock(&conn->io_lock);
+    while (1) {
+        for (size_t i = 0; i < MAX_IN_FLIGHT && response == NULL; i++)
+            if (conn->early[i].used && conn->early[i].tag == tag)
+                response = &conn->early[i];
+        if (response != NULL || conn->io_failed)
+            break;
+        pthread_cond_wait(&conn->io_cond, &conn->io_lock);
+    }
+    int ok = response != NULL && response->payload_len <= max_len;
+    if (ok) {
+        *result = response->result;
+        if (payload != NULL && response->payload_len > 0)
+            memcpy(payload, response->payload, response->payload_len);
+    }
+    if (response != NULL)
+        response->used = 0;
+    pthread_mutex_unlock(&conn->io_lock);
+    return ok ? 0 : -1;
+}
+
+/*
+ * As read_response, but waiting for at most timeout_ms for each response
+ * (or for as long as it takes, if -1), which only rings can tell.
+ */
+int wait_response(uint32_t tag, int64_t *result, void *payload, size_t max_len, int timeout_ms) {
+    early_response_t *response = NULL;
+    for (size_t i = 0; i < MAX_IN_FLIGHT && response == NULL; i++)
+        if (conn->early[i].used && conn->early[i].tag == tag)
+            response = &conn->early[i];
+
+    while (response == NULL) {
+        early_response_t *spare = NULL;
+        for (size_t i = 0; i < MAX_IN_FLIGHT && spare == NULL; i++)
+            if (!conn->early[i].used)
+                spare = &conn->early[i];
+        // more requests in flight than MAX_IN_FLIGHT
+        if (spare == NULL) return -1;
+        if (receive_response(spare, tag, payload, max_len, timeout_ms) < 0) return -1;
+        spare->used = 1;
+        if (spare->tag == tag)
+            response = spare;
+    }
+
+    response->used = 0;
+    *result = response->result;
+    if (response->payload_len > max_len) return -1;
+    if (payload != NULL && response->payload_len > 0 && !response->in_place)
+        memcpy(payload, response->payload, response->payload_len);
+    return 0;
+}
+
+/*
+ * Receives the next response of the session, whichever request it answers.
+ * If it answers the request with the given tag, and its payload fits in
+ * max_len bytes, the payload goes to the given buffer; otherwise it
+ * is kept in the response. Revocations of leases on the way are applied to
+ * the cache.
+ */
+int receive_response(early_response_t *response, uint32_t tag, void *payload, size_t max_len, int timeout_ms) {
+    while (1) {
+        if (receive_message(response, tag, payload, max_len, timeout_ms) < 0) return -1;
+        if (conn->ring != NULL || response->tag != TFS_REVOKE_TAG)
+            return 0;
+        drop_cached(response->result);
+    }
 }
 
-int num_digits(int n) {
-    int count = 0;
-    while (n != 0) {  
-       n = n/10;
-       count++;
+/*
+ * Does the receiving for receive_response, one message at a time.
+ */
+int receive_message(early_response_t *response, uint32_t tag, void *payload, size_t max_len, int timeout_ms) {
+    tfs_response_t header;
+    response->in_place = 0;
+    if (conn->ring != NULL) {
+        uint32_t head = atomic_load(&conn->ring->cq_head);
+        if (ring_wait(&conn->ring->cq_tail, head, &conn->ring->cq_waiting, timeout_ms) < 0) return -1;
+        tfs_ring_cqe_t *cqe = &conn->ring->cq[head % TFS_RING_ENTRIES];
+        header = cqe->response;
+        int fits = header.payload_len <= MAX_PAYLOAD_SIZE && cqe->slot < TFS_RING_ENTRIES;
+        response->in_place = header.tag == tag && header.payload_len <= max_len;
+        if (fits && header.payload_len > 0)
+            memcpy(response->in_place ? payload : response->payload, conn->ring->data[cqe->slot], header.payload_len);
+        atomic_store(&conn->ring->cq_head, head + 1);
+        if (!fits) return -1;
+    } else if (conn->is_socket) {
+        /* A single message, so a single call. Its tag is only known once it
+         * is received, so the payload lands in the response, and is copied to
+         * the caller's buffer if it answers the caller's request. */
+        struct iovec iov[2] = {
+            {.iov_base = &header, .iov_len = sizeof(header)},
+            {.iov_base = response->payload, .iov_len = MAX_PAYLOAD_SIZE},
+        };
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+        ssize_t r;
+        do {
+            r = recvmsg(conn->fcli, &msg, 0);
+        } while (r == -1 && errno == EINTR);
+        if (r < (ssize_t)sizeof(header) || (msg.msg_flags & MSG_TRUNC)) return -1;
+        if ((size_t)r - sizeof(header) != header.payload_len) return -1;
+        if (header.payload_len > MAX_PAYLOAD_SIZE) return -1;
+        response->in_place = header.tag == tag && header.payload_len <= max_len;
+        if (response->in_place && header.payload_len > 0)
+            memcpy(payload, response->payload, header.payload_len);
+    } else {
+        if (read_full(conn->fcli, &header, sizeof(header)) < 0) return -1;
+        if (header.payload_len > MAX_PAYLOAD_SIZE) return -1;
+        response->in_place = header.tag == tag && header.payload_len <= max_len;
+        if (read_full(conn->fcli, response->in_place ? payload : response->payload, header.payload_len) < 0)
+            return -1;
     }
-    return count;
-}
\ No newline at end of file
+    response->tag = header.tag;
+    response->result = header.result;
+    response->payload_len = header.payload_len;
+    return 0;
+}
+
+/*
+ * Places each server's points on the circle that path names are hashed to.
+ */
+void place_servers(char const *const *server_pipe_paths, int count) {
+    char name[MAX_PATH_NAME + 1];
+    for (int i = 0; i < count; i++) {
+        // a server is known by its pipe, whether it is reached through it or its socket
+        snprintf(name, sizeof(name), "%s", server_pipe_paths[i]);
+        size_t len = strlen(name), suffix_len = strlen(SOCKET_SUFFIX);
+        if (len > suffix_len && strcmp(name + len - suffix_len, SOCKET_SUFFIX) == 0)
+            name[len - suffix_len] = '\0';
+        for (int j = 0; j < SERVER_POINTS; j++) {
+            points[i * SERVER_POINTS + j].hash = hash_name(name, (uint32_t)j + 1);
+            points[i * SERVER_POINTS + j].server = i;
+        }
+    }
+    qsort(points, (size_t)(count * SERVER_POINTS), sizeof(point_t), compare_points);
+}
+
+int compare_points(void const *a, void const *b) {
+    point_t const *p = a, *q = b;
+    if (p->hash != q->hash)
+        return p->hash < q->hash ? -1 : 1;
+    return p->server - q->server;
+}
+
+/*
+ * FNV-1a, with a final mix, as it spreads short path names poorly on its own.
+ */
+uint32_t hash_name(char const *name, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (; *name != '\0'; name++) {
+        hash ^= (uint8_t)*name;
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+/*
+ * Finds the server a path name belongs to: the first point at or after its
+ * hash, going round to the first one past the last.
+ */
+int server_of(char const *name) {
+    uint32_t hash = hash_name(name, 0);
+    size_t low = 0, high = (size_t)(server_count * SERVER_POINTS);
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (points[mid].hash < hash)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return points[low == (size_t)(server_count * SERVER_POINTS) ? 0 : low].server;
+}
+
+/*
+ * Makes the calls that follow go to the server a path name belongs to.
+ */
+void route_name(char const *name) {
+    conn = &connections[server_count > 1 ? server_of(name) : 0];
+}
+
+/*
+ * Makes the calls that follow go to the server a file handle (or the handle
+ * of an asynchronous request) belongs to, which handles carry in their
+ * remainder by the number of servers.
+ * Returns the server's own handle.
+ */
+int route_handle(int handle) {
+    if (server_count <= 1 || handle < 0) {
+        conn = &connections[0];
+        return handle;
+    }
+    conn = &connections[handle % server_count];
+    return handle / server_count;
+}
+
+/*
+ * Turns a handle of the current connection's server into one that leads
+ * back to it (so, with a single server, handles are the server's own).
+ */
+int tag_handle(int handle) {
+    if (handle < 0 || server_count <= 1)
+        return handle;
+    return handle * server_count + (int)(conn - connections);
+}
+
+/*
+ * Forgets whatever was left of a previous session.
+ */
+void reset_session() {
+    if (!conn->io_initialized) {
+        pthread_mutex_init(&conn->io_lock, NULL);
+        pthread_cond_init(&conn->io_cond, NULL);
+        conn->io_initialized = 1;
+    }
+    conn->ring = NULL;
+    conn->is_socket = 0;
+    conn->io_running = 0;
+    for (size_t i = 0; i < MAX_ASYNC_REQUESTS; i++)
+        conn->async_requests[i].used = 0;
+    // the leases were the previous session's
+    for (size_t i = 0; i < CACHE_ENTRIES; i++)
+        conn->cache[i].used = 0;
+    for (size_t i = 0; i < MAX_IN_FLIGHT; i++)
+        conn->early[i].used = 0;
+}
+
+int read_full(int fd, void *buffer, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t r = read(fd, (char*)buffer + done, size - done);
+        if (r == 0 || (r == -1 && errno != EINTR)) return -1;
+        if (r > 0)
+            done += (size_t)r;
+    }
+    return 0;
+}
@@ -12,20 +12,63 @@
  *   the client to receive responses. This named pipe will be created (via
  * 	 mkfifo) inside tfs_mount.
  * - server_pipe_path: pathname of the named pipe where the server is listening
- *   for client requests
+ *   for client requests; if it names the server's Unix socket instead (the
+ *   pipe's pathname followed by ".sock"), the session runs over the socket
+ *   and no named pipes are created
+ * A second named pipe, client_pipe_path followed by ".req", is created as
+ * well, for this session's requests; the server's pipe only takes mounts.
  * When successful, the new session's identifier (session_id) was
  * saved internally by the client; also, the client process has
- * successfully opened both named pipes (one for reading, the other one for
- * writing, respectively).
+ * successfully opened the client pipe for reading and the request pipe for
+ * writing.
  *
  * Returns 0 if successful, -1 otherwise.
  */
 int tfs_mount(char const *client_pipe_path, char const *server_pipe_path);
 
+/*
+ * Establishes a session with a TecnicoFS server over shared memory, for
+ * clients on the same machine: requests and responses go through a ring
+ * mapped by both, and the server is only woken up when it is idle.
+ * Input:
+ * - client_ring_path: pathname of a file that will hold the ring. It is
+ *   created inside tfs_mount_shm and deleted once the server has mapped it.
+ * - server_pipe_path: pathname of the named pipe where the server is listening
+ *   for client requests (it only takes the mount)
+ * Every other call then works as with tfs_mount.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_mount_shm(char const *client_ring_path, char const *server_pipe_path);
+
+/*
+ * Establishes a session with each of several TecnicoFS servers, spreading
+ * the client's files over them.
+ * Input:
+ * - client_pipe_path: pathname the client's named pipes are derived from;
+ *   the session with the i-th server uses client_pipe_path followed by
+ *   ".i" as its client pipe
+ * - server_pipe_paths: pathnames of each server's named pipe (or socket),
+ *   as in tfs_mount
+ * - server_count: number of servers, at most MAX_SERVERS
+ * Each path name belongs to a single server, found by consistent hashing of
+ * the name onto the servers' pipe pathnames, so the same servers (in any
+ * order, and through their pipes or their sockets) always hold the same
+ * files, and adding one moves only the files it takes.
+ * File handles lead back to the server that opened them; tfs_set_qos and
+ * tfs_shutdown_after_all_closed go to every server, and tfs_unmount ends
+ * every session.
+ * With a single server, it is the same as tfs_mount.
+ *
+ * Returns 0 if successful (with every server), -1 otherwise.
+ */
+int tfs_mount_sharded(char const *client_pipe_path, char const *const *server_pipe_paths,
+                      int server_count);
+
 /*
  * Ends the currently active session.
  * After notifying the server, both named pipes are closed by the client,
- * the client named pipe is deleted (via unlink) and the client's session_id is
+ * the client's named pipes are deleted (via unlink) and the client's session_id is
  * set to none.
  *
  * Returns 0 if successful, -1 otherwise.
@@ -73,6 +116,184 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/* Writes a whole file with a single request, which the server runs as an
+ * open, a write and a close, atomically
+ * Input:
+ *  - name: absolute path name
+ *  - buffer containing the contents to write
+ *  - length of the contents (in bytes)
+ *  - flags: open flags, as in tfs_open
+ *
+ * Returns the number of bytes that were written, or -1 in case of error
+ */
+ssize_t tfs_put(char const *name, void const *buffer, size_t len, int flags);
+
+/* Reads a whole file with a single request, which the server runs as an
+ * open, a read from its start and a close, atomically
+ * Over pipes or a socket, and unless asynchronous calls were made, the
+ * contents are cached under a lease from the server: getting the file again
+ * takes no request until the lease runs out (after LEASE_TERM_MS), or until
+ * any session writes to, truncates or puts the file, which revokes it.
+ * Input:
+ *  - name: absolute path name
+ *  - destination buffer
+ *  - length of the buffer
+ *
+ * Returns the number of bytes that were copied from the file to the buffer,
+ * or -1 in case of error
+ */
+ssize_t tfs_get(char const *name, void *buffer, size_t len);
+
+/* Repositions the offset of an open file
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- offset, relative to the position given by whence
+ * 	- whence: TFS_SEEK_SET, TFS_SEEK_CUR or TFS_SEEK_END
+ *
+ * Returns the resulting offset from the start of the file, or -1 in case of
+ * error.
+ */
+off_t tfs_lseek(int fhandle, off_t offset, int whence);
+
+/* Sets the size of an open file, freeing only the blocks past the new end
+ * of file
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- new length of the file (in bytes)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_truncate(int fhandle, size_t length);
+
+/* Reserves the blocks of a range of an open file ahead of writing it,
+ * without changing the file size
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- offset where the range starts
+ * 	- length of the range (in bytes)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_fallocate(int fhandle, size_t offset, size_t len);
+
+/* Gets the metadata (type, size and number of blocks) of a file
+ * Input:
+ *  - name: absolute path name
+ *  - st: where the metadata is stored
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_stat(char const *name, tfs_stat_t *st);
+
+/* Gets the metadata of an open file
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- st: where the metadata is stored
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_fstat(int fhandle, tfs_stat_t *st);
+
+/* Gets the metadata of several files, with one request per MAX_STAT_PATHS
+ * files instead of one per file, and up to MAX_IN_FLIGHT of those requests
+ * in flight at once
+ * Input:
+ *  - names: absolute path names
+ *  - count: number of path names
+ *  - stats: where the metadata of each file is stored
+ *  - results: where the result of each lookup is stored (0 if successful,
+ *    -1 otherwise)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_stat_many(char const *const *names, size_t count, tfs_stat_t *stats, int *results);
+
+/* Sets the session's share of the server against other sessions'
+ * Input:
+ *  - weight: how many bytes the session's requests can move for each byte
+ *    moved by a session of weight 1 (at least 1, and the server's maximum
+ *    at most)
+ *  - depth: how many requests of the session the server handles at once (at
+ *    least 1; it can only be lowered below the server's own depth)
+ * Sessions over shared memory are served by a thread of their own, so
+ * neither applies to them.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_set_qos(int weight, int depth);
+
+/* Gets what the server did for one kind of request since it started, over
+ * every session (with several servers, what all of them did)
+ * Input:
+ *  - op_code: the kind of request (a TFS_OP_CODE_*)
+ *  - stats: where the statistics are stored
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_stats(int op_code, tfs_op_stats_t *stats);
+
+/* Gets a percentile of the latencies counted in stats
+ * Input:
+ *  - stats: as got with tfs_stats
+ *  - percentile: between 0 and 100
+ * The latencies are only known up to the width of their bucket, so the
+ * result is the smallest latency of the bucket the percentile falls in,
+ * which no request counted in that bucket took less than.
+ *
+ * Returns the latency (in nanoseconds), 0 if no request was counted.
+ */
+uint64_t tfs_stats_percentile(tfs_op_stats_t const *stats, double percentile);
+
+/* Called by the client's I/O thread when an asynchronous request completes,
+ * with the request's handle, the result the synchronous call would have
+ * returned and the argument given along with the request. It must not call
+ * into this API, as no other response arrives until it returns.
+ */
+typedef void (*tfs_callback_t)(int handle, ssize_t result, void *arg);
+
+/* Asynchronous versions of tfs_open, tfs_write and tfs_read: each sends its
+ * request and returns without waiting for the response, which a thread of
+ * the client receives instead. The first of them starts that thread, which
+ * then receives the responses of the synchronous calls too.
+ * Input, besides the synchronous call's:
+ *  - callback: called once the request completes, after which its handle is
+ *    no longer valid; if NULL, the result is kept until tfs_poll or tfs_wait
+ *    collects it
+ *  - arg: passed on to the callback
+ * The contents to write are sent before returning, while the destination
+ * buffer of a read must stay valid until the request completes. Only
+ * MAX_IN_FLIGHT requests are sent at once, so a call may wait for an older
+ * one to be answered; they are all meant to be made from a single thread.
+ * Requests on a file handle, synchronous ones included, run in the order
+ * they are made: each waits to be sent until the asynchronous requests still
+ * in flight on the same handle complete. Requests on different handles may
+ * run in any order, even when the handles are of the same file.
+ *
+ * Returns the request's handle, or -1 in case of error (including having
+ * MAX_ASYNC_REQUESTS uncollected requests already).
+ */
+int tfs_open_async(char const *name, int flags, tfs_callback_t callback, void *arg);
+int tfs_write_async(int fhandle, void const *buffer, size_t len, tfs_callback_t callback, void *arg);
+int tfs_read_async(int fhandle, void *buffer, size_t len, tfs_callback_t callback, void *arg);
+
+/* Checks whether an asynchronous request sent without a callback has
+ * completed, and if so collects its result, after which its handle is no
+ * longer valid
+ * Input:
+ *  - handle: the request's (obtained from a previous asynchronous call)
+ *  - result: where the request's result is stored
+ *
+ * Returns 1 if the request completed, 0 if it is still in flight, or -1 in
+ * case of error.
+ */
+int tfs_poll(int handle, ssize_t *result);
+
+/* As tfs_poll, but waiting for the request to complete
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_wait(int handle, ssize_t *result);
+
 /*
  * Orders TecnicoFS server to wait until no file is open and then shutdown
  * Returns 0 if successful, -1 otherwise.
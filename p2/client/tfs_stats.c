@@ -0,0 +1,79 @@
+#include "tecnicofs_client_api.h"
+#include <stdio.h>
+
+/*  Prints what one or more running servers did since they started, for
+    each kind of request they answered: how many, how many failed, the bytes
+    they moved, their latency percentiles and the time they spent waiting,
+    in the workers' queue and for the file system's lock, and the simulated
+    storage accesses they made, to metadata and to data. Latencies are in
+    microseconds, as averages or percentiles, and accesses are per request. */
+
+static char const *const op_names[TFS_OP_CODES] = {
+    [TFS_OP_CODE_MOUNT] = "mount",
+    [TFS_OP_CODE_UNMOUNT] = "unmount",
+    [TFS_OP_CODE_OPEN] = "open",
+    [TFS_OP_CODE_CLOSE] = "close",
+    [TFS_OP_CODE_WRITE] = "write",
+    [TFS_OP_CODE_READ] = "read",
+    [TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED] = "shutdown",
+    [TFS_OP_CODE_LSEEK] = "lseek",
+    [TFS_OP_CODE_TRUNCATE] = "truncate",
+    [TFS_OP_CODE_FALLOCATE] = "fallocate",
+    [TFS_OP_CODE_STAT] = "stat",
+    [TFS_OP_CODE_FSTAT] = "fstat",
+    [TFS_OP_CODE_STAT_MANY] = "stat_many",
+    [TFS_OP_CODE_PUT] = "put",
+    [TFS_OP_CODE_GET] = "get",
+    [TFS_OP_CODE_RESUME] = "resume",
+    [TFS_OP_CODE_SET_QOS] = "set_qos",
+    [TFS_OP_CODE_STATS] = "stats",
+};
+
+static double per_request_us(uint64_t ns, uint64_t count) {
+    return (double)ns / (double)count / 1000.0;
+}
+
+static double percentile_us(tfs_op_stats_t const *stats, double percentile) {
+    return (double)tfs_stats_percentile(stats, percentile) / 1000.0;
+}
+
+int main(int argc, char **argv) {
+
+    tfs_op_stats_t stats;
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path [server_pipe_path...]'\n");
+        return 1;
+    }
+    int server_count = argc - 2;
+    if (server_count > MAX_SERVERS || tfs_mount_sharded(argv[1], (char const *const *)argv + 2, server_count) != 0) {
+        fprintf(stderr, "could not mount %s\n", argv[2]);
+        return 1;
+    }
+
+    printf("%-10s %10s %8s %12s %12s %9s %9s %9s %9s %9s %9s %9s %8s %8s\n", "op", "count", "errors", "bytes_in",
+           "bytes_out", "mean(us)", "p50(us)", "p90(us)", "p99(us)", "p999(us)", "queue(us)", "lock(us)", "meta_io",
+           "data_io");
+    int result = 0;
+    for (int op_code = 1; op_code < TFS_OP_CODES; op_code++) {
+        if (tfs_stats(op_code, &stats) != 0) {
+            fprintf(stderr, "could not get the statistics of %s\n", op_names[op_code]);
+            result = 1;
+            break;
+        }
+        if (stats.count == 0)
+            continue;
+        printf("%-10s %10lu %8lu %12lu %12lu %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f %8.2f %8.2f\n", op_names[op_code],
+               (unsigned long)stats.count, (unsigned long)stats.errors, (unsigned long)stats.bytes_in,
+               (unsigned long)stats.bytes_out, per_request_us(stats.latency_ns, stats.count),
+               percentile_us(&stats, 50), percentile_us(&stats, 90), percentile_us(&stats, 99),
+               percentile_us(&stats, 99.9), per_request_us(stats.queue_wait_ns, stats.count),
+               per_request_us(stats.lock_wait_ns, stats.count), (double)stats.metadata_ios / (double)stats.count,
+               (double)stats.data_ios / (double)stats.count);
+    }
+
+    if (tfs_unmount() != 0)
+        result = 1;
+    return result;
+}
@@ -1,6 +1,9 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 /* tfs_open flags */
 enum {
     TFS_O_CREAT = 0b001,
@@ -8,6 +11,13 @@ enum {
     TFS_O_APPEND = 0b100,
 };
 
+/* tfs_lseek whence values */
+enum {
+    TFS_SEEK_SET = 0,
+    TFS_SEEK_CUR = 1,
+    TFS_SEEK_END = 2,
+};
+
 /* operation codes (for client-server requests) */
 enum {
     TFS_OP_CODE_MOUNT = 1,
@@ -17,6 +27,105 @@ enum {
     TFS_OP_CODE_WRITE = 5,
     TFS_OP_CODE_READ = 6,
     TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED = 7,
+    TFS_OP_CODE_LSEEK = 8,
+    TFS_OP_CODE_TRUNCATE = 9,
+    TFS_OP_CODE_FALLOCATE = 10,
+    TFS_OP_CODE_STAT = 11,
+    TFS_OP_CODE_FSTAT = 12,
+    TFS_OP_CODE_STAT_MANY = 13,
+    TFS_OP_CODE_PUT = 14,
+    TFS_OP_CODE_GET = 15,
+    TFS_OP_CODE_RESUME = 16, // server's pipe only: a parked ring has requests
+    TFS_OP_CODE_SET_QOS = 17,
+    TFS_OP_CODE_STATS = 18,
+};
+
+// one past the last operation code
+#define TFS_OP_CODES (TFS_OP_CODE_STATS + 1)
+
+/* mount flags (in the flags of a TFS_OP_CODE_MOUNT request) */
+enum {
+    TFS_MOUNT_SHARED_MEMORY = 0b1, // the session runs over a tfs_ring_t
+};
+
+/* get flags (in the flags of a TFS_OP_CODE_GET request) */
+enum {
+    /* The client caches the contents under a lease: the response's payload
+     * starts with a tfs_lease_t, followed by the contents. */
+    TFS_GET_LEASE = 0b1,
 };
 
+/* file types (in tfs_stat_t) */
+enum {
+    TFS_T_FILE = 0,
+    TFS_T_DIRECTORY = 1,
+};
+
+/* file metadata, as returned by tfs_stat and tfs_fstat */
+typedef struct {
+    int st_type;
+    size_t st_size;
+    size_t st_blocks; // data blocks in use (holes take none)
+} tfs_stat_t;
+
+/* client-server wire protocol (binary, in host byte order, as both ends
+ * share the same machine) */
+#define TFS_PROTOCOL_VERSION (2)
+
+/* Request header; payload_len bytes of payload follow it (path names,
+ * without their '\0', or the data to write) */
+typedef struct __attribute__((packed)) {
+    uint8_t version;
+    uint8_t op_code;
+    int32_t session_id;
+    int32_t fhandle;
+    int32_t flags; // open flags, lseek whence or mount flags
+    int64_t offset;
+    uint64_t len; // bytes to read, new length or number of path names
+    uint32_t tag; // echoed in the response, as responses may come out of order
+    uint32_t payload_len;
+} tfs_request_t;
+
+/* Response header; payload_len bytes of payload follow it (data read or
+ * file metadata) */
+typedef struct __attribute__((packed)) {
+    int64_t result;
+    uint32_t tag; // of the request this answers
+    uint32_t payload_len;
+} tfs_response_t;
+
+/* Lease on a file's contents, granted by a get with TFS_GET_LEASE (unless
+ * inumber is -1). The lease holds for term_ms from when the get was sent,
+ * or until the server revokes it, with a response that answers no request:
+ * its tag is TFS_REVOKE_TAG and its result the file's inumber. A revocation
+ * is sent before the write that causes it is answered. */
+typedef struct __attribute__((packed)) {
+    int32_t inumber;
+    uint32_t term_ms;
+} tfs_lease_t;
+
+#define TFS_REVOKE_TAG (UINT32_MAX)
+
+/* Latencies, in nanoseconds, are counted in log-linear buckets: the first
+ * TFS_STATS_SUB_BUCKETS hold 0 to 3 ns, and then each power of two is split
+ * into TFS_STATS_SUB_BUCKETS buckets of equal width. The last one also
+ * takes anything past 2^37 ns (over two minutes). */
+#define TFS_STATS_SUB_BUCKETS (4)
+#define TFS_STATS_BUCKETS (37 * TFS_STATS_SUB_BUCKETS)
+
+/* What the server did for one kind of request since it started, as
+ * returned by a TFS_OP_CODE_STATS request (whose flags carry the op code) */
+typedef struct __attribute__((packed)) {
+    uint64_t count;
+    uint64_t errors; // answered with a negative result (or malformed)
+    uint64_t bytes_in; // request payloads
+    uint64_t bytes_out; // response payloads
+    uint64_t queue_wait_ns; // from being read to being taken by a worker
+    uint64_t lock_wait_ns; // waiting for the file system's global lock
+    uint64_t metadata_ios; // simulated storage accesses to i-nodes, bitmaps and directories
+    uint64_t data_ios; // and to the contents of files
+    uint64_t latency_ns; // from being read to being answered
+    uint64_t latency[TFS_STATS_BUCKETS]; // how many took each latency
+} tfs_op_stats_t;
+
 #endif /* COMMON_H */
\ No newline at end of file
@@ -0,0 +1,38 @@
+#define _GNU_SOURCE // syscall()
+#include "ring.h"
+#include <errno.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// busy checks before sleeping: a round trip is usually over sooner than that
+#define RING_SPINS (2000)
+
+int ring_wait(_Atomic uint32_t *counter, uint32_t seen, _Atomic uint32_t *waiting, int timeout_ms) {
+    for (int i = 0; i < RING_SPINS; i++)
+        if (atomic_load(counter) != seen)
+            return 0;
+
+    struct timespec timeout = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (long)(timeout_ms % 1000) * 1000000L,
+    };
+    while (atomic_load(counter) == seen) {
+        // set before the last check, so a wake can't slip in between
+        atomic_store(waiting, 1);
+        if (atomic_load(counter) != seen)
+            break;
+        // the ring is shared between processes, so no FUTEX_PRIVATE_FLAG
+        long r = syscall(SYS_futex, (uint32_t *)counter, FUTEX_WAIT, seen,
+                         timeout_ms < 0 ? NULL : &timeout, NULL, 0);
+        if (r == -1 && errno == ETIMEDOUT && atomic_load(counter) == seen)
+            return -1;
+    }
+    return 0;
+}
+
+void ring_wake(_Atomic uint32_t *counter, _Atomic uint32_t *waiting) {
+    if (atomic_exchange(waiting, 0))
+        syscall(SYS_futex, (uint32_t *)counter, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
@@ -0,0 +1,61 @@
+#ifndef RING_H
+#define RING_H
+
+#include "common.h"
+#include <stdatomic.h>
+#include <stdint.h>
+
+/* Shared-memory transport: a client maps a file holding a tfs_ring_t, and so
+ * does the server once the client mounts with TFS_MOUNT_SHARED_MEMORY.
+ * Requests go into the submission queue (sq) and responses come back in the
+ * completion queue (cq). The payload of the i-th request lives in data slot
+ * i % TFS_RING_ENTRIES, and the payload of its response in the slot the
+ * completion names, so neither is ever copied through the kernel.
+ * A ring left idle is parked by the server, which stops watching it: the
+ * client that finds sq_parked set after submitting a request sends a
+ * TFS_OP_CODE_RESUME through the server's pipe to have it watched again. */
+
+#define TFS_RING_MAGIC (0x74667372u) // "tfsr"
+#define TFS_RING_ENTRIES (8)
+// the largest payload either way, plus the '\0' the server puts after paths
+#define TFS_RING_SLOT_SIZE (2048)
+
+typedef struct {
+    tfs_response_t response;
+    uint32_t slot; // data slot holding the response's payload
+} tfs_ring_cqe_t;
+
+typedef struct {
+    uint32_t magic;
+    int32_t client_pid; // lets the server notice the client is gone
+    // each counter is only advanced by one side, so they go on their own lines
+    _Alignas(64) _Atomic uint32_t sq_head; // server
+    _Atomic uint32_t sq_waiting;           // server
+    _Atomic uint32_t sq_parked;            // set by the server, taken by the client
+    _Alignas(64) _Atomic uint32_t sq_tail; // client
+    _Alignas(64) _Atomic uint32_t cq_head; // client
+    _Atomic uint32_t cq_waiting;           // client
+    _Alignas(64) _Atomic uint32_t cq_tail; // server
+    tfs_request_t sq[TFS_RING_ENTRIES];
+    tfs_ring_cqe_t cq[TFS_RING_ENTRIES];
+    _Alignas(64) char data[TFS_RING_ENTRIES][TFS_RING_SLOT_SIZE];
+} tfs_ring_t;
+
+/*
+ * Waits until a ring counter moves past the value seen, spinning for a
+ * while before sleeping on it.
+ * Input:
+ *  - counter: sq_tail or cq_tail
+ *  - seen: the value it had when last checked
+ *  - waiting: the flag the other side checks to know it has to wake us up
+ *  - timeout_ms: how long to sleep for at most, or -1 to sleep until woken
+ * Returns 0 once the counter moved, -1 if the timeout expired first.
+ */
+int ring_wait(_Atomic uint32_t *counter, uint32_t seen, _Atomic uint32_t *waiting, int timeout_ms);
+
+/*
+ * Wakes up whoever is waiting on a counter that was just advanced, if anyone.
+ */
+void ring_wake(_Atomic uint32_t *counter, _Atomic uint32_t *waiting);
+
+#endif // RING_H
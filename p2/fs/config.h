@@ -8,12 +8,42 @@
 #define DATA_BLOCKS (1024)
 #define INODE_TABLE_SIZE (50)
 #define MAX_OPEN_FILES (20)
-#define MAX_FHANDLE_LEN (2) // TODO talvez mudar isto para client api
 #define MAX_FILE_NAME (40)
 #define MAX_PATH_NAME (100) //
-#define MAX_SESSIONS (10) //
-#define MAX_SESSION_ID_LEN (1) //
-#define MAX_REQUEST_SIZE (2000) //
+/* sessions are allocated as clients mount, up to MAX_SESSIONS, with the
+ * table growing SESSION_CHUNK ids at a time */
+#define MAX_SESSIONS (1 << 16)
+#define SESSION_CHUNK (64)
+#define MAX_STAT_PATHS (40)
+#define MAX_WORKERS (64)
+/* requests of a session the server handles at once, unless told otherwise */
+#define DEFAULT_SESSION_DEPTH (8)
+#define MAX_SESSION_DEPTH (64)
+/* share of the workers a session gets, unless it asks for another one, and
+ * bytes it can move per turn for each unit of weight */
+#define DEFAULT_SESSION_WEIGHT (1)
+#define MAX_SESSION_WEIGHT (64)
+#define DRR_QUANTUM (BLOCK_SIZE)
+/* requests a client keeps in flight at once */
+#define MAX_IN_FLIGHT (8)
+/* how long a lease on a file's contents lasts, how many sessions can hold
+ * one on the same file, and how many files a client caches */
+#define LEASE_TERM_MS (1000)
+#define MAX_LEASE_HOLDERS (16)
+#define CACHE_ENTRIES (16)
+/* servers a client can spread its files over, and points each of them
+ * takes on the circle that path names are hashed to */
+#define MAX_SERVERS (16)
+#define SERVER_POINTS (64)
+/* asynchronous requests a client has sent or not yet collected */
+#define MAX_ASYNC_REQUESTS (64)
+/* largest request payload: a block of data or MAX_STAT_PATHS path names */
+#define MAX_PAYLOAD_SIZE (MAX_STAT_PATHS * (MAX_FILE_NAME + 1))
+
+/* events each thread's trace keeps, and threads that can be traced, when
+ * built with TRACE */
+#define TRACE_EVENTS (1 << 13)
+#define MAX_TRACE_THREADS (256)
 
 #define DELAY (5000)
 
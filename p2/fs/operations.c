@@ -1,17 +1,99 @@
 #include "operations.h"
+#include "lock_profile.h"
 #include "state.h"
+#include "trace.h"
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 static pthread_mutex_t single_global_lock;
 pthread_cond_t cond_open_files;
+// time this thread spent waiting for single_global_lock
+static _Thread_local uint64_t lock_wait_ns;
+/* the calls to each operation this thread made, with their simulated
+ * storage accesses; and the operation it is in, with the accesses it had
+ * made before */
+static _Thread_local tfs_io_stats_t io_stats[TFS_OP_CODES];
+static _Thread_local int io_op = 0;
+static _Thread_local uint64_t io_marks[IO_KINDS];
+
+/*
+ * Takes single_global_lock, timing the wait only if it is held by someone
+ * else, so that taking it uncontended costs nothing more.
+ */
+static int lock_global() {
+    if (profiled_mutex_trylock(&single_global_lock, LOCK_SINGLE_GLOBAL) == 0) {
+        TRACE_BEGIN("single_global_lock");
+        return 0;
+    }
+    TRACE_START(wait_start);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int ret = profiled_mutex_lock(&single_global_lock, LOCK_SINGLE_GLOBAL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    lock_wait_ns += (uint64_t)((end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec));
+    TRACE_SPAN("single_global_lock wait", wait_start, 0);
+    if (ret == 0)
+        TRACE_BEGIN("single_global_lock");
+    return ret;
+}
+
+/*
+ * Lets go of single_global_lock.
+ */
+static int unlock_global() {
+    TRACE_END("single_global_lock");
+    return profiled_mutex_unlock(&single_global_lock, LOCK_SINGLE_GLOBAL);
+}
+
+uint64_t tfs_lock_wait_ns() {
+    return lock_wait_ns;
+}
+
+/*
+ * Counts the simulated storage accesses this thread made since it last
+ * started an operation as that operation's.
+ */
+static void settle_ios() {
+    uint64_t metadata = state_ios(IO_METADATA), data = state_ios(IO_DATA);
+    io_stats[io_op].metadata_ios += metadata - io_marks[IO_METADATA];
+    io_stats[io_op].data_ios += data - io_marks[IO_DATA];
+    io_marks[IO_METADATA] = metadata;
+    io_marks[IO_DATA] = data;
+}
+
+/*
+ * Starts an operation of an op code (0 for none), whose simulated storage
+ * accesses are counted from now on, until this thread starts another one.
+ */
+static void start_ios(int op_code) {
+    settle_ios();
+    io_op = op_code;
+    io_stats[op_code].calls++;
+}
+
+void tfs_ios(uint64_t *metadata_ios, uint64_t *data_ios) {
+    *metadata_ios = state_ios(IO_METADATA);
+    *data_ios = state_ios(IO_DATA);
+}
+
+int tfs_io_stats(int op_code, tfs_io_stats_t *stats) {
+    if (op_code < 0 || op_code >= TFS_OP_CODES)
+        return -1;
+    settle_ios();
+    *stats = io_stats[op_code];
+    return 0;
+}
 
 int tfs_init() {
+    start_ios(0);
     state_init();
+    lock_profile_reset();
     if (pthread_mutex_init(&single_global_lock, 0) != 0)
         return -1;
     if (pthread_cond_init(&cond_open_files, NULL) != 0)
@@ -25,7 +107,9 @@ int tfs_init() {
 }
 
 int tfs_destroy() {
+    start_ios(0);
     state_destroy();
+    lock_profile_report(stderr);
     if (pthread_mutex_destroy(&single_global_lock) != 0)
         return -1;
     return 0;
@@ -36,13 +120,15 @@ static bool valid_pathname(char const *name) {
 }
 
 int tfs_destroy_after_all_closed() {
-    if (pthread_mutex_lock(&single_global_lock) != 0)
+    start_ios(0);
+    if (lock_global() != 0)
         return -1;
     while (!no_open_files())
-        pthread_cond_wait(&cond_open_files, &single_global_lock);
+        profiled_cond_wait(&cond_open_files, &single_global_lock, LOCK_SINGLE_GLOBAL);
     state_destroy();
-    if (pthread_mutex_unlock(&single_global_lock) != 0)
+    if (unlock_global() != 0)
         return -1;
+    lock_profile_report(stderr);
     if (pthread_mutex_destroy(&single_global_lock) != 0)
         return -1;
     return 0;
@@ -59,14 +145,95 @@ int _tfs_lookup_unsynchronized(char const *name) {
 }
 
 int tfs_lookup(char const *name) {
-    if (pthread_mutex_lock(&single_global_lock) != 0)
+    start_ios(0);
+    if (lock_global() != 0)
         return -1;
     int ret = _tfs_lookup_unsynchronized(name);
-    if (pthread_mutex_unlock(&single_global_lock) != 0)
+    if (unlock_global() != 0)
         return -1;
     return ret;
 }
 
+int tfs_inumber(int fhandle) {
+    start_ios(0);
+    if (lock_global() != 0)
+        return -1;
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    int ret = file == NULL ? -1 : file->of_inumber;
+    if (unlock_global() != 0)
+        return -1;
+    return ret;
+}
+
+/*
+ * Checks whether a buffer only holds zeros. Each 64-byte chunk is OR-ed
+ * together without branching, so that the compiler vectorizes the loop.
+ */
+static bool _tfs_is_zero(void const *buffer, size_t len) {
+    unsigned char const *bytes = buffer;
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        uint64_t acc = 0, word;
+        for (size_t j = 0; j < 64; j += sizeof(word)) {
+            memcpy(&word, bytes + i + j, sizeof(word));
+            acc |= word;
+        }
+        if (acc != 0)
+            return false;
+    }
+    for (; i < len; i++)
+        if (bytes[i] != 0)
+            return false;
+    return true;
+}
+
+/*
+ * Returns the file's data block, allocating it (zero-filled) if the file
+ * has none yet. Bytes past the end of file are always kept as zeros, so that
+ * seeking past it and writing leaves a gap that reads as zeros.
+ */
+static void *_tfs_block_reserve(inode_t *inode) {
+    if (inode->i_data_block == -1) {
+        int b = data_block_alloc();
+        if (b == -1)
+            return NULL;
+        void *block = data_block_get(b);
+        if (block == NULL) {
+            data_block_free(b);
+            return NULL;
+        }
+        memset(block, 0, BLOCK_SIZE);
+        inode->i_data_block = b;
+        return block;
+    }
+    return data_block_get(inode->i_data_block);
+}
+
+static int _tfs_truncate_unsynchronized(inode_t *inode, size_t length) {
+    if (length > BLOCK_SIZE)
+        return -1;
+
+    if (length == 0) {
+        /* No data left, so the block (even if only reserved) is freed */
+        if (inode->i_data_block != -1) {
+            if (data_block_free(inode->i_data_block) == -1)
+                return -1;
+            inode->i_data_block = -1;
+        }
+        inode->i_fallocated = 0;
+    }
+    else if (length < inode->i_size && inode->i_data_block != -1) {
+        void *block = data_block_get(inode->i_data_block);
+        if (block == NULL)
+            return -1;
+        memset(block + length, 0, inode->i_size - length);
+    }
+    /* Growing a file without a block just makes its hole larger */
+    inode->i_size = length;
+    inode->i_reserved = length;
+    return 0;
+}
+
 static int _tfs_open_unsynchronized(char const *name, int flags) {
     int inum;
     size_t offset;
@@ -80,11 +247,11 @@ static int _tfs_open_unsynchronized(char const *name, int flags) {
 
         /* Trucate (if requested) */
         if (flags & TFS_O_TRUNC) {
-            if (inode->i_size > 0) {
-                if (data_block_free(inode->i_data_block) == -1)
-                    return -1;
-                inode->i_size = 0;
-            }
+            profiled_rwlock_wrlock(&inode->i_lock, LOCK_INODE);
+            int r = _tfs_truncate_unsynchronized(inode, 0);
+            profiled_rwlock_unlock(&inode->i_lock, LOCK_INODE);
+            if (r == -1)
+                return -1;
         }
         /* Determine initial offset */
         if (flags & TFS_O_APPEND)
@@ -110,7 +277,7 @@ static int _tfs_open_unsynchronized(char const *name, int flags) {
 
     /* Finally, add entry to the open file table and
      * return the corresponding handle */
-    return add_to_open_file_table(inum, offset);
+    return add_to_open_file_table(inum, offset, flags);
 
     /* Note: for simplification, if file was created with TFS_O_CREAT and there
      * is an error adding an entry to the open file table, the file is not
@@ -118,22 +285,29 @@ static int _tfs_open_unsynchronized(char const *name, int flags) {
 }
 
 int tfs_open(char const *name, int flags) {
-    if (pthread_mutex_lock(&single_global_lock) != 0)
+    start_ios(TFS_OP_CODE_OPEN);
+    if (lock_global() != 0)
         return -1;
     int ret = _tfs_open_unsynchronized(name, flags);
-    if (pthread_mutex_unlock(&single_global_lock) != 0)
+    if (unlock_global() != 0)
         return -1;
 
     return ret;
 }
 
-int tfs_close(int fhandle) {
-    if (pthread_mutex_lock(&single_global_lock) != 0)
-        return -1;
+static int _tfs_close_unsynchronized(int fhandle) {
     int r = remove_from_open_file_table(fhandle);
     if (no_open_files())
         pthread_cond_signal(&cond_open_files);
-    if (pthread_mutex_unlock(&single_global_lock) != 0)
+    return r;
+}
+
+int tfs_close(int fhandle) {
+    start_ios(TFS_OP_CODE_CLOSE);
+    if (lock_global() != 0)
+        return -1;
+    int r = _tfs_close_unsynchronized(fhandle);
+    if (unlock_global() != 0)
         return -1;
 
     return r;
@@ -149,37 +323,132 @@ static ssize_t _tfs_write_unsynchronized(int fhandle, void const *buffer, size_t
     if (inode == NULL)
         return -1;
 
+    /* Waits for appenders still copying into the file */
+    profiled_rwlock_wrlock(&inode->i_lock, LOCK_INODE);
+
+    /* With no appender left, the end of file is stable (tfs_put appends
+     * through here, under the global lock) */
+    if (file->of_flags & TFS_O_APPEND)
+        file->of_offset = inode->i_size;
+
     /* Determine how many bytes to write */
     if (to_write + file->of_offset > BLOCK_SIZE)
         to_write = BLOCK_SIZE - file->of_offset;
 
     if (to_write > 0) {
-        if (inode->i_size == 0)
-            /* If empty file, allocate new block */
-            inode->i_data_block = data_block_alloc();
+        bool zeros = _tfs_is_zero(buffer, to_write);
+        if (zeros && file->of_offset == 0 && to_write >= inode->i_size &&
+            inode->i_data_block != -1 && !inode->i_fallocated) {
+            /* The whole file content is overwritten with zeros (and the
+             * bytes past its end are kept as zeros), so the block becomes a
+             * hole, unless tfs_fallocate reserved it */
+            if (data_block_free(inode->i_data_block) == -1) {
+                profiled_rwlock_unlock(&inode->i_lock, LOCK_INODE);
+                return -1;
+            }
+            inode->i_data_block = -1;
+        }
+        else if (!zeros || inode->i_data_block != -1) {
+            /* If the file has no block yet, allocate it; zeros written to
+             * a hole don't need one */
+            void *block = _tfs_block_reserve(inode);
+            if (block == NULL) {
+                profiled_rwlock_unlock(&inode->i_lock, LOCK_INODE);
+                return -1;
+            }
 
-        void *block = data_block_get(inode->i_data_block);
-        if (block == NULL)
-            return -1;
-        
-        /* Perform the actual write */
-        memcpy(block + file->of_offset, buffer, to_write);
+            /* Perform the actual write */
+            memcpy(block + file->of_offset, buffer, to_write);
+        }
 
         /* The offset associated with the file handle is
          * incremented accordingly */
         file->of_offset += to_write;
-        if (file->of_offset > inode->i_size)
+        if (file->of_offset > inode->i_size) {
             inode->i_size = file->of_offset;
+            inode->i_reserved = file->of_offset;
+        }
     }
+    profiled_rwlock_unlock(&inode->i_lock, LOCK_INODE);
 
     return (ssize_t)to_write;
 }
 
+/*
+ * Appends to a file opened with TFS_O_APPEND, without the global lock.
+ * Each call reserves the range [i_reserved, i_reserved + len) atomically, so
+ * that concurrent appenders copy their data in parallel into disjoint
+ * ranges. Ranges are then committed to i_size in reservation order, so
+ * readers only ever see a fully written prefix of the file.
+ */
+static ssize_t _tfs_append(open_file_entry_t *file, inode_t *inode, void const *buffer, size_t len) {
+    /* Bytes past the end of file are zeros already, so appending zeros needs
+     * neither a block nor a copy */
+    bool zeros = _tfs_is_zero(buffer, len);
+    while (1) {
+        profiled_rwlock_rdlock(&inode->i_lock, LOCK_INODE);
+        if (zeros || inode->i_data_block != -1)
+            break;
+        profiled_rwlock_unlock(&inode->i_lock, LOCK_INODE);
+
+        /* The first append to an empty file allocates its block */
+        if (lock_global() != 0)
+            return -1;
+        profiled_rwlock_wrlock(&inode->i_lock, LOCK_INODE);
+        void *block = _tfs_block_reserve(inode);
+        profiled_rwlock_unlock(&inode->i_lock, LOCK_INODE);
+        if (unlock_global() != 0 || block == NULL)
+            return -1;
+    }
+
+    /* A fetch-add that stops at the maximum file size */
+    size_t start = atomic_load(&inode->i_reserved), n;
+    do {
+        n = len;
+        if (n > BLOCK_SIZE - start)
+            n = BLOCK_SIZE - start;
+    } while (!atomic_compare_exchange_weak(&inode->i_reserved, &start, start + n));
+
+    void *block = NULL;
+    if (n > 0 && !zeros) {
+        block = data_block_get(inode->i_data_block);
+        if (block != NULL)
+            memcpy(block + start, buffer, n);
+    }
+
+    /* Waits for the appenders that reserved earlier ranges to commit them
+     * (even a failed copy is committed, so that they don't wait forever).
+     * Those only have their copy left to do, which takes no lock, so the
+     * wait ends once they are scheduled. */
+    profiled_mutex_lock(&inode->i_commit_lock, LOCK_INODE_COMMIT);
+    while (atomic_load(&inode->i_size) != start)
+        profiled_cond_wait(&inode->i_committed, &inode->i_commit_lock, LOCK_INODE_COMMIT);
+    atomic_store(&inode->i_size, start + n);
+    pthread_cond_broadcast(&inode->i_committed);
+    int failed = n > 0 && !zeros && block == NULL;
+    if (!failed)
+        atomic_store(&file->of_offset, start + n);
+    profiled_mutex_unlock(&inode->i_commit_lock, LOCK_INODE_COMMIT);
+    profiled_rwlock_unlock(&inode->i_lock, LOCK_INODE);
+
+    return failed ? -1 : (ssize_t)n;
+}
+
 ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
-    if (pthread_mutex_lock(&single_global_lock) != 0)
+    start_ios(TFS_OP_CODE_WRITE);
+    if (lock_global() != 0)
         return -1;
+    /* Appends go on without the global lock, once they know the entry is
+     * open (the handle is not to be closed while being written to) */
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file != NULL && (file->of_flags & TFS_O_APPEND)) {
+        inode_t *inode = inode_get(file->of_inumber);
+        if (unlock_global() != 0 || inode == NULL)
+            return -1;
+        return _tfs_append(file, inode, buffer, to_write);
+    }
     ssize_t ret = _tfs_write_unsynchronized(fhandle, buffer, to_write);
-    if (pthread_mutex_unlock(&single_global_lock) != 0)
+    if (unlock_global() != 0)
         return -1;
 
     return ret;
@@ -195,18 +464,26 @@ static ssize_t _tfs_read_unsynchronized(int fhandle, void *buffer, size_t len) {
     if (inode == NULL)
         return -1;
 
-    /* Determine how many bytes to read */
-    size_t to_read = inode->i_size - file->of_offset;
+    /* Determine how many bytes to read (none if the offset was moved past
+     * the end of file) */
+    size_t to_read = 0;
+    if (file->of_offset < inode->i_size)
+        to_read = inode->i_size - file->of_offset;
     if (to_read > len)
         to_read = len;
 
     if (to_read > 0) {
-        void *block = data_block_get(inode->i_data_block);
-        if (block == NULL)
-            return -1;
-
-        /* Perform the actual read */
-        memcpy(buffer, block + file->of_offset, to_read);
+        if (inode->i_data_block == -1)
+            /* Holes read as zeros, without touching the data blocks */
+            memset(buffer, 0, to_read);
+        else {
+            void *block = data_block_get(inode->i_data_block);
+            if (block == NULL)
+                return -1;
+
+            /* Perform the actual read */
+            memcpy(buffer, block + file->of_offset, to_read);
+        }
         /* The offset associated with the file handle is
          * incremented accordingly */
         file->of_offset += to_read;
@@ -215,12 +492,196 @@ static ssize_t _tfs_read_unsynchronized(int fhandle, void *buffer, size_t len) {
     return (ssize_t)to_read;
 }
 
+ssize_t tfs_put(char const *name, void const *buffer, size_t len, int flags) {
+    start_ios(TFS_OP_CODE_PUT);
+    if (lock_global() != 0)
+        return -1;
+    ssize_t ret = -1;
+    int fhandle = _tfs_open_unsynchronized(name, flags);
+    if (fhandle != -1) {
+        ret = _tfs_write_unsynchronized(fhandle, buffer, len);
+        if (_tfs_close_unsynchronized(fhandle) == -1)
+            ret = -1;
+    }
+    if (unlock_global() != 0)
+        return -1;
+
+    return ret;
+}
+
+ssize_t tfs_get(char const *name, void *buffer, size_t len) {
+    start_ios(TFS_OP_CODE_GET);
+    if (lock_global() != 0)
+        return -1;
+    ssize_t ret = -1;
+    int fhandle = _tfs_open_unsynchronized(name, 0);
+    if (fhandle != -1) {
+        ret = _tfs_read_unsynchronized(fhandle, buffer, len);
+        if (_tfs_close_unsynchronized(fhandle) == -1)
+            ret = -1;
+    }
+    if (unlock_global() != 0)
+        return -1;
+
+    return ret;
+}
+
 ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
-    if (pthread_mutex_lock(&single_global_lock) != 0)
+    start_ios(TFS_OP_CODE_READ);
+    if (lock_global() != 0)
         return -1;
     ssize_t ret = _tfs_read_unsynchronized(fhandle, buffer, len);
-    if (pthread_mutex_unlock(&single_global_lock) != 0)
+    if (unlock_global() != 0)
+        return -1;
+
+    return ret;
+}
+
+static off_t _tfs_lseek_unsynchronized(int fhandle, off_t offset, int whence) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL)
+        return -1;
+
+    inode_t *inode = inode_get(file->of_inumber);
+    if (inode == NULL)
+        return -1;
+
+    off_t base;
+    switch (whence) {
+        case TFS_SEEK_SET:
+            base = 0;
+            break;
+        case TFS_SEEK_CUR:
+            base = (off_t)file->of_offset;
+            break;
+        case TFS_SEEK_END:
+            base = (off_t)inode->i_size;
+            break;
+        default:
+            return -1;
+    }
+    if (offset < -base || offset > BLOCK_SIZE - base)
+        return -1;
+
+    file->of_offset = (size_t)(base + offset);
+    return base + offset;
+}
+
+off_t tfs_lseek(int fhandle, off_t offset, int whence) {
+    start_ios(TFS_OP_CODE_LSEEK);
+    if (lock_global() != 0)
+        return -1;
+    off_t ret = _tfs_lseek_unsynchronized(fhandle, offset, whence);
+    if (unlock_global() != 0)
+        return -1;
+
+    return ret;
+}
+
+int tfs_truncate(int fhandle, size_t length) {
+    start_ios(TFS_OP_CODE_TRUNCATE);
+    if (lock_global() != 0)
+        return -1;
+    int ret = -1;
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file != NULL) {
+        inode_t *inode = inode_get(file->of_inumber);
+        if (inode != NULL) {
+            profiled_rwlock_wrlock(&inode->i_lock, LOCK_INODE);
+            ret = _tfs_truncate_unsynchronized(inode, length);
+            profiled_rwlock_unlock(&inode->i_lock, LOCK_INODE);
+        }
+    }
+    if (unlock_global() != 0)
+        return -1;
+
+    return ret;
+}
+
+static int _tfs_fallocate_unsynchronized(int fhandle, size_t offset, size_t len) {
+    if (len == 0 || offset > BLOCK_SIZE || len > BLOCK_SIZE - offset)
+        return -1;
+
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL)
+        return -1;
+
+    inode_t *inode = inode_get(file->of_inumber);
+    if (inode == NULL)
+        return -1;
+
+    /* Files span a single block, so the whole range is covered by one
+     * allocation */
+    profiled_rwlock_wrlock(&inode->i_lock, LOCK_INODE);
+    void *block = _tfs_block_reserve(inode);
+    if (block != NULL)
+        inode->i_fallocated = 1;
+    profiled_rwlock_unlock(&inode->i_lock, LOCK_INODE);
+    if (block == NULL)
+        return -1;
+    return 0;
+}
+
+int tfs_fallocate(int fhandle, size_t offset, size_t len) {
+    start_ios(TFS_OP_CODE_FALLOCATE);
+    if (lock_global() != 0)
+        return -1;
+    int ret = _tfs_fallocate_unsynchronized(fhandle, offset, len);
+    if (unlock_global() != 0)
         return -1;
 
     return ret;
-}
\ No newline at end of file
+}
+
+static int _tfs_stat_inode(int inum, tfs_stat_t *st) {
+    inode_t *inode = inode_get(inum);
+    if (inode == NULL)
+        return -1;
+
+    st->st_type = inode->i_node_type == T_DIRECTORY ? TFS_T_DIRECTORY : TFS_T_FILE;
+    st->st_size = inode->i_size;
+    st->st_blocks = inode->i_data_block == -1 ? 0 : 1;
+    return 0;
+}
+
+int tfs_fstat(int fhandle, tfs_stat_t *st) {
+    start_ios(TFS_OP_CODE_FSTAT);
+    if (lock_global() != 0)
+        return -1;
+    int ret = -1;
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file != NULL)
+        ret = _tfs_stat_inode(file->of_inumber, st);
+    if (unlock_global() != 0)
+        return -1;
+
+    return ret;
+}
+
+static int _tfs_stat_many(char const *const *names, size_t count, tfs_stat_t *stats, int *results) {
+    if (lock_global() != 0)
+        return -1;
+    int ret = 0;
+    for (size_t i = 0; i < count; i++) {
+        int inum = _tfs_lookup_unsynchronized(names[i]);
+        int r = inum == -1 ? -1 : _tfs_stat_inode(inum, &stats[i]);
+        if (results != NULL)
+            results[i] = r;
+        else if (r == -1)
+            ret = -1;
+    }
+    if (unlock_global() != 0)
+        return -1;
+
+    return ret;
+}
+
+int tfs_stat(char const *name, tfs_stat_t *st) {
+    start_ios(TFS_OP_CODE_STAT);
+    return _tfs_stat_many(&name, 1, st, NULL);
+}
+
+int tfs_stat_many(char const *const *names, size_t count, tfs_stat_t *stats, int *results) {
+    start_ios(TFS_OP_CODE_STAT_MANY);
+    return _tfs_stat_many(names, count, stats, results);
+}
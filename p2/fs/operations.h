@@ -25,6 +25,36 @@ int tfs_destroy();
  */
 int tfs_destroy_after_all_closed();
 
+/*
+ * Gets how long the calling thread has waited, in total, for the lock the
+ * operations below take (in nanoseconds)
+ */
+uint64_t tfs_lock_wait_ns();
+
+/*
+ * The calls the calling thread made to an operation below, and the
+ * simulated storage accesses they made
+ */
+typedef struct {
+    uint64_t calls;
+    uint64_t metadata_ios; // to i-nodes, allocation bitmaps and directories
+    uint64_t data_ios; // to the contents of files
+} tfs_io_stats_t;
+
+/*
+ * Gets what the calling thread's calls to the operation of an op code made
+ * (TFS_OP_CODE_OPEN for tfs_open, and so on), or, for op code 0, its calls
+ * to operations without one (tfs_init, tfs_lookup...)
+ * Returns 0 if successful, -1 if there is no such op code.
+ */
+int tfs_io_stats(int op_code, tfs_io_stats_t *stats);
+
+/*
+ * Gets how many simulated storage accesses the calling thread made in all,
+ * to metadata and to data
+ */
+void tfs_ios(uint64_t *metadata_ios, uint64_t *data_ios);
+
 /*
  * Looks for a file
  * Note: as a simplification, only a plain directory space (root directory only)
@@ -34,6 +64,14 @@ int tfs_destroy_after_all_closed();
  */
 int tfs_lookup(char const *name);
 
+/*
+ * Gets the file an open file handle refers to
+ * Input:
+ *  - file handle (obtained from a previous call to tfs_open)
+ * Returns the inumber of the file, -1 if unsuccessful
+ */
+int tfs_inumber(int fhandle);
+
 /*
  * Opens a file
  * Input:
@@ -53,6 +91,8 @@ int tfs_open(char const *name, int flags);
 int tfs_close(int fhandle);
 
 /* Writes to an open file, starting at the current offset
+ * If the file was opened in append mode, every write goes to the end of
+ * file instead, and concurrent appends never overwrite each other.
  * Input:
  * 	- file handle (obtained from a previous call to tfs_open)
  * 	- buffer containing the contents to write
@@ -73,6 +113,88 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/* Writes a whole file in one go: opens it, writes and closes it again,
+ * atomically with respect to every other operation
+ * Input:
+ *  - name: absolute path name
+ *  - buffer containing the contents to write
+ *  - length of the contents (in bytes)
+ *  - flags: open flags, as in tfs_open
+ * Returns the number of bytes that were written, or -1 in case of error
+ */
+ssize_t tfs_put(char const *name, void const *buffer, size_t len, int flags);
+
+/* Reads a whole file in one go: opens it, reads from its start and closes
+ * it again, atomically with respect to every other operation
+ * Input:
+ *  - name: absolute path name
+ *  - destination buffer
+ *  - length of the buffer
+ * Returns the number of bytes that were copied from the file to the buffer,
+ * or -1 in case of error
+ */
+ssize_t tfs_get(char const *name, void *buffer, size_t len);
+
+/* Repositions the offset of an open file
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- offset, relative to the position given by whence
+ * 	- whence: TFS_SEEK_SET (start of file), TFS_SEEK_CUR (current offset)
+ * 	  or TFS_SEEK_END (end of file)
+ * Returns the resulting offset from the start of the file, or -1 in case of
+ * error (the offset can't be negative nor exceed the maximum file size)
+ */
+off_t tfs_lseek(int fhandle, off_t offset, int whence);
+
+/* Sets the size of an open file
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- new length of the file (in bytes)
+ * If the file shrinks, only the blocks past the new end of file are freed;
+ * if it grows, the new bytes read as zeros.
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_truncate(int fhandle, size_t length);
+
+/* Reserves space for an open file without changing its size, so that later
+ * writes to the range don't have to allocate blocks. The space stays
+ * reserved, even if only zeros are written to it, until the file is
+ * truncated to nothing.
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- offset where the range starts
+ * 	- length of the range (in bytes)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_fallocate(int fhandle, size_t offset, size_t len);
+
+/* Gets the metadata of a file
+ * Input:
+ *  - name: absolute path name
+ *  - st: where the metadata is stored
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_stat(char const *name, tfs_stat_t *st);
+
+/* Gets the metadata of an open file
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- st: where the metadata is stored
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_fstat(int fhandle, tfs_stat_t *st);
+
+/* Gets the metadata of several files at once
+ * Input:
+ *  - names: absolute path names
+ *  - count: number of path names
+ *  - stats: where the metadata of each file is stored
+ *  - results: where the result of each lookup is stored (0 if successful,
+ *    -1 otherwise); if NULL, a failed lookup fails the whole call
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_stat_many(char const *const *names, size_t count, tfs_stat_t *stats, int *results);
+
 /* Copies the contents of a file that exists in TecnicoFS to the contents
  * of another file in the OS' file system tree (outside TecnicoFS).
  * Input:
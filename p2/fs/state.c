@@ -1,4 +1,5 @@
 #include "state.h"
+#include "trace.h"
 
 #include <stdbool.h>
 #include <stdio.h>
@@ -51,22 +52,34 @@ static inline bool valid_file_handle(int file_handle) {
  */
 static void touch_all_memory() { __asm volatile("" : : : "memory"); }
 
+static void *block_get(int block_number, io_kind_t kind);
+
+// simulated storage accesses of this thread, of each kind
+static _Thread_local uint64_t ios[IO_KINDS];
+
 /*
  * Auxiliary function to insert a delay.
  * Used in accesses to persistent FS state as a way of emulating access
  * latencies as if such data structures were really stored in secondary memory.
  */
-static void insert_delay() {
+static void insert_delay(io_kind_t kind) {
+    ios[kind]++;
+    TRACE_START(start);
     for (int i = 0; i < DELAY; i++)
         touch_all_memory();
+    TRACE_SPAN("storage_delay", start, 0);
 }
 
 /*
  * Initializes FS state
  */
 void state_init() {
-    for (size_t i = 0; i < INODE_TABLE_SIZE; i++)
+    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
         freeinode_ts[i] = FREE;
+        pthread_rwlock_init(&inode_table[i].i_lock, NULL);
+        pthread_mutex_init(&inode_table[i].i_commit_lock, NULL);
+        pthread_cond_init(&inode_table[i].i_committed, NULL);
+    }
 
     for (size_t i = 0; i < DATA_BLOCKS; i++)
         free_blocks[i] = FREE;
@@ -76,7 +89,12 @@ void state_init() {
     num_open_files = 0;
 }
 
-void state_destroy() { /* nothing to do */
+void state_destroy() {
+    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+        pthread_rwlock_destroy(&inode_table[i].i_lock);
+        pthread_mutex_destroy(&inode_table[i].i_commit_lock);
+        pthread_cond_destroy(&inode_table[i].i_committed);
+    }
 }
 
 /*
@@ -89,13 +107,13 @@ void state_destroy() { /* nothing to do */
 int inode_create(inode_type n_type) {
     for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
         if ((inumber * (int)sizeof(allocation_state_t) % BLOCK_SIZE) == 0)
-            insert_delay(); // simulate storage access delay (to freeinode_ts)
+            insert_delay(IO_METADATA); // simulate storage access delay (to freeinode_ts)
 
         /* Finds first free entry in i-node table */
         if (freeinode_ts[inumber] == FREE) {
             /* Found a free entry, so takes it for the new i-node*/
             freeinode_ts[inumber] = TAKEN;
-            insert_delay(); // simulate storage access delay (to i-node)
+            insert_delay(IO_METADATA); // simulate storage access delay (to i-node)
             inode_table[inumber].i_node_type = n_type;
 
             if (n_type == T_DIRECTORY) {
@@ -108,9 +126,10 @@ int inode_create(inode_type n_type) {
                 }
 
                 inode_table[inumber].i_size = BLOCK_SIZE;
+                inode_table[inumber].i_reserved = BLOCK_SIZE;
                 inode_table[inumber].i_data_block = b;
 
-                dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
+                dir_entry_t *dir_entry = (dir_entry_t *)block_get(b, IO_METADATA);
                 if (dir_entry == NULL) {
                     freeinode_ts[inumber] = FREE;
                     return -1;
@@ -122,7 +141,9 @@ int inode_create(inode_type n_type) {
             else {
                 /* In case of a new file, simply sets its size to 0 */
                 inode_table[inumber].i_size = 0;
+                inode_table[inumber].i_reserved = 0;
                 inode_table[inumber].i_data_block = -1;
+                inode_table[inumber].i_fallocated = 0;
             }
             return inumber;
         }
@@ -138,15 +159,15 @@ int inode_create(inode_type n_type) {
  */
 int inode_delete(int inumber) {
     // simulate storage access delay (to i-node and freeinode_ts)
-    insert_delay();
-    insert_delay();
+    insert_delay(IO_METADATA);
+    insert_delay(IO_METADATA);
 
     if (!valid_inumber(inumber) || freeinode_ts[inumber] == FREE)
         return -1;
 
     freeinode_ts[inumber] = FREE;
 
-    if (inode_table[inumber].i_size > 0) {
+    if (inode_table[inumber].i_data_block != -1) {
         if (data_block_free(inode_table[inumber].i_data_block) == -1)
             return -1;
     }
@@ -164,7 +185,7 @@ inode_t *inode_get(int inumber) {
     if (!valid_inumber(inumber))
         return NULL;
 
-    insert_delay(); // simulate storage access delay to i-node
+    insert_delay(IO_METADATA); // simulate storage access delay to i-node
     return &inode_table[inumber];
 }
 
@@ -180,7 +201,7 @@ int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
     if (!valid_inumber(inumber) || !valid_inumber(sub_inumber))
         return -1;
 
-    insert_delay(); // simulate storage access delay to i-node with inumber
+    insert_delay(IO_METADATA); // simulate storage access delay to i-node with inumber
     if (inode_table[inumber].i_node_type != T_DIRECTORY)
         return -1;
 
@@ -189,7 +210,7 @@ int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
 
     /* Locates the block containing the directory's entries */
     dir_entry_t *dir_entry =
-        (dir_entry_t *)data_block_get(inode_table[inumber].i_data_block);
+        (dir_entry_t *)block_get(inode_table[inumber].i_data_block, IO_METADATA);
     if (dir_entry == NULL)
         return -1;
 
@@ -212,13 +233,13 @@ int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
  * 	Returns i-number linked to the target name, -1 if not found
  */
 int find_in_dir(int inumber, char const *sub_name) {
-    insert_delay(); // simulate storage access delay to i-node with inumber
+    insert_delay(IO_METADATA); // simulate storage access delay to i-node with inumber
     if (!valid_inumber(inumber) || inode_table[inumber].i_node_type != T_DIRECTORY)
         return -1;
 
     /* Locates the block containing the directory's entries */
     dir_entry_t *dir_entry =
-        (dir_entry_t *)data_block_get(inode_table[inumber].i_data_block);
+        (dir_entry_t *)block_get(inode_table[inumber].i_data_block, IO_METADATA);
     if (dir_entry == NULL)
         return -1;
 
@@ -236,16 +257,20 @@ int find_in_dir(int inumber, char const *sub_name) {
  * Returns: block index if successful, -1 otherwise
  */
 int data_block_alloc() {
+    TRACE_START(start);
+    int block = -1;
     for (int i = 0; i < DATA_BLOCKS; i++) {
         if (i * (int)sizeof(allocation_state_t) % BLOCK_SIZE == 0)
-            insert_delay(); // simulate storage access delay to free_blocks
+            insert_delay(IO_METADATA); // simulate storage access delay to free_blocks
 
         if (free_blocks[i] == FREE) {
             free_blocks[i] = TAKEN;
-            return i;
+            block = i;
+            break;
         }
     }
-    return -1;
+    TRACE_SPAN("data_block_alloc", start, block);
+    return block;
 }
 
 /* Frees a data block
@@ -257,8 +282,10 @@ int data_block_free(int block_number) {
     if (!valid_block_number(block_number))
         return -1;
 
-    insert_delay(); // simulate storage access delay to free_blocks
+    TRACE_START(start);
+    insert_delay(IO_METADATA); // simulate storage access delay to free_blocks
     free_blocks[block_number] = FREE;
+    TRACE_SPAN("data_block_free", start, block_number);
     return 0;
 }
 
@@ -268,25 +295,39 @@ int data_block_free(int block_number) {
  * Returns: pointer to the first byte of the block, NULL otherwise
  */
 void *data_block_get(int block_number) {
+    return block_get(block_number, IO_DATA);
+}
+
+/*
+ * Gets a block, counting the access as one to a file's data or, for a
+ * directory's entries, to metadata.
+ */
+static void *block_get(int block_number, io_kind_t kind) {
     if (!valid_block_number(block_number))
         return NULL;
 
-    insert_delay(); // simulate storage access delay to block
+    insert_delay(kind); // simulate storage access delay to block
     return &fs_data[block_number * BLOCK_SIZE];
 }
 
+uint64_t state_ios(io_kind_t kind) {
+    return ios[kind];
+}
+
 /* Add new entry to the open file table
  * Inputs:
  * 	- I-node number of the file to open
  * 	- Initial offset
+ * 	- Flags the file was opened with
  * Returns: file handle if successful, -1 otherwise
  */
-int add_to_open_file_table(int inumber, size_t offset) {
+int add_to_open_file_table(int inumber, size_t offset, int flags) {
     for (int i = 0; i < MAX_OPEN_FILES; i++) {
         if (free_open_file_entries[i] == FREE) {
             free_open_file_entries[i] = TAKEN;
             open_file_table[i].of_inumber = inumber;
             open_file_table[i].of_offset = offset;
+            open_file_table[i].of_flags = flags;
             num_open_files++;
             // printf("num_open_files: %d", num_open_files); // DBG
             return i;
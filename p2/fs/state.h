@@ -3,6 +3,9 @@
 
 #include "config.h"
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -22,19 +25,37 @@ typedef enum { T_FILE, T_DIRECTORY } inode_type;
  */
 typedef struct {
     inode_type i_node_type;
-    size_t i_size;
-    int i_data_block;
+    _Atomic size_t i_size; // committed size, the one readers see
+    _Atomic size_t i_reserved; // end of the ranges reserved by appenders
+    int i_data_block; // -1 while the file is empty or a hole
+    int i_fallocated; // reserved by tfs_fallocate, so zeros don't free the block
+    /* appenders hold it shared; any other change to the size or block
+     * holds it exclusively */
+    pthread_rwlock_t i_lock;
+    /* appenders wait on i_committed, under i_commit_lock, for the ranges
+     * reserved before theirs to be committed to i_size */
+    pthread_mutex_t i_commit_lock;
+    pthread_cond_t i_committed;
     /* in a real FS, more fields would exist here */
 } inode_t;
 
 typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t;
 
+/*
+ * Kinds of simulated storage access: to i-nodes, allocation bitmaps and
+ * directories, or to the contents of files
+ */
+typedef enum { IO_METADATA, IO_DATA, IO_KINDS } io_kind_t;
+
 /*
  * Open file entry (in open file table)
  */
 typedef struct {
     int of_inumber;
-    size_t of_offset;
+    /* appends move it without the global lock, that the other operations
+     * on the handle move it with */
+    _Atomic size_t of_offset;
+    int of_flags;
 } open_file_entry_t;
 
 #define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
@@ -55,7 +76,13 @@ int data_block_alloc();
 int data_block_free(int block_number);
 void *data_block_get(int block_number);
 
-int add_to_open_file_table(int inumber, size_t offset);
+/*
+ * Gets how many simulated storage accesses of a kind the calling thread has
+ * made, in total
+ */
+uint64_t state_ios(io_kind_t kind);
+
+int add_to_open_file_table(int inumber, size_t offset, int flags);
 int no_open_files();
 int remove_from_open_file_table(int fhandle);
 open_file_entry_t *get_open_file_entry(int fhandle);
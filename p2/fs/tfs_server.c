@@ -1,337 +1,1515 @@
 #include "operations.h"
+#include "lock_profile.h"
+#include "trace.h"
+#include "common/ring.h"
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <stdlib.h>
 #include <pthread.h>
 #include <signal.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
 
-pthread_t tasks[MAX_SESSIONS];
-pthread_mutex_t locks[MAX_SESSIONS];
-pthread_mutex_t command_lock;
-pthread_cond_t mayWork[MAX_SESSIONS], maySend[MAX_SESSIONS];
+pthread_t workers[MAX_WORKERS];
+int num_workers;
+pthread_mutex_t queue_lock;
+pthread_cond_t work_ready, session_drained;
+int stopping; // set, under queue_lock, for the workers to exit once idle
 
-typedef struct {
+/* A decoded request. The header fields are copied as they are; the payload
+ * (path names, data to write) is read straight into the command's buffer, or
+ * left where it is in a shared-memory session's ring. */
+typedef struct parsed_command {
     int op_code;
     int session_id;
-    char *txt_info; 
     int fhandle;
     int flags;
     size_t len;
+    off_t offset;
+    size_t payload_len;
+    uint32_t tag;
+    char *payload;
+    char *reply_buffer; // where a response's payload can be built in place
+    uint32_t slot; // the request's data slot, in a shared-memory session
+    int malformed; // answered with -1 instead of handled
+    size_t cost; // bytes the request moves, either way
+    struct timespec received; // when it was read
+    struct timespec started; // when it started to be handled
+    uint64_t lock_wait_ns; // the handling thread's, when it started
+    uint64_t metadata_ios, data_ios; // the handling thread's, when it started
+    int failed; // answered with a negative result
+    size_t reply_len; // bytes of its response's payload
+    struct parsed_command *next; // in its session's queue, or the free pool
+    char buffer[MAX_PAYLOAD_SIZE + 1]; // + 1 for the '\0' after path names
 } parsed_command;
 
-parsed_command *command_buffer[MAX_SESSIONS];
-int busy[MAX_SESSIONS];
+/* Commands read from a session's pipe, but not handled yet. Kept in a pool
+ * once handled, so that reading requests doesn't allocate anything. */
+parsed_command *free_commands;
+
+// marks the end of a session whose client went away without unmounting
+#define SESSION_GONE (-1)
+
+// a request and its payload must fit in a single atomic write to the pipe
+_Static_assert(sizeof(tfs_request_t) + MAX_PAYLOAD_SIZE <= PIPE_BUF, "requests must fit in PIPE_BUF");
+// and so must a response, as workers answer a session's requests at once
+_Static_assert(sizeof(tfs_response_t) + MAX_PAYLOAD_SIZE <= PIPE_BUF, "responses must fit in PIPE_BUF");
+// a ring has room for every request a client keeps in flight
+_Static_assert(MAX_IN_FLIGHT <= TFS_RING_ENTRIES, "clients can't have more requests in flight than ring entries");
+// payloads either way, and the '\0' after path names, fit in the ring's slots
+_Static_assert(MAX_PAYLOAD_SIZE + 1 <= TFS_RING_SLOT_SIZE, "payloads must fit in a ring slot");
+_Static_assert(BLOCK_SIZE <= MAX_PAYLOAD_SIZE, "reads are built in the command's buffer");
+_Static_assert(sizeof(tfs_lease_t) + BLOCK_SIZE <= MAX_PAYLOAD_SIZE, "leased gets are built in the command's buffer");
+_Static_assert(sizeof(tfs_op_stats_t) <= MAX_PAYLOAD_SIZE, "statistics must fit in a response");
+
+/* A client's session, only in use while it is mounted: all the server keeps
+ * for an idle client is this and its pipes. */
+typedef struct session {
+    int id;
+    int fcli;
+    int freq; // the session's own request pipe
+    /* Sessions can also come over a Unix socket, which carries both
+     * requests and responses (fcli == freq), one message each. */
+    int is_socket;
+    /* Or over shared memory, with no file descriptors at all: such a session
+     * has a thread of its own, waiting on the ring for the client's
+     * requests, while it is active. Once idle, the thread goes away until
+     * the client resumes the ring. */
+    tfs_ring_t *ring; // NULL unless over shared memory
+    int ring_active; // a thread serves the ring
+    int resume_pending; // resumed while its thread was parking
+    int in_flight; // requests read and not answered yet
+    int stalled;
+    int depth; // how many requests can be in flight at once
+    int weight; // its share of the workers, against other sessions'
+    size_t deficit; // bytes the session can still move in this round
+    parsed_command *queue_head, *queue_tail;
+    struct session *next_ready;
+    struct session *next_active;
+} session_t;
+
+/* Sessions by id, in chunks of SESSION_CHUNK that are only allocated once
+ * every id before them is taken, and never moved or freed, so that a
+ * session's id leads to it without a lock. Each chunk carries the sessions
+ * of its ids, so mounts and unmounts reuse them instead of allocating any.
+ * Free ids are kept in a list, most recently freed first. */
+typedef struct {
+    session_t *sessions[SESSION_CHUNK]; // NULL if the id is free
+    int next_free[SESSION_CHUNK];
+    session_t slab[SESSION_CHUNK];
+} session_chunk_t;
+
+_Static_assert(MAX_SESSIONS % SESSION_CHUNK == 0, "the session table is made of whole chunks");
+session_chunk_t *session_table[MAX_SESSIONS / SESSION_CHUNK];
+int session_chunks;
+int free_sessions; // -1 if every id in the table is taken
+
+/* Sessions with a request waiting in their pipe. A session's pipe reports
+ * a single event, so a session is queued at most once and its requests are
+ * read one at a time, in order, by any worker. The pipe is rearmed as soon
+ * as a request is read, so that other workers can read the next ones while
+ * it is handled, until the session's depth of requests is in flight; then
+ * it stalls until one of them is answered. */
+session_t *ready_head, *ready_tail;
+int session_depth;
+
+/* Sessions with requests read and waiting to be handled, which workers take
+ * in deficit round robin: on its turn, a session gets DRR_QUANTUM bytes
+ * times its weight added to its deficit, and its requests are handled while
+ * the deficit covers what they cost; then it goes to the back. A session
+ * moving many bytes per request gets as many bytes through as one sending
+ * small requests, instead of as many requests. Shared-memory sessions are
+ * served by their own thread, and don't take part. */
+session_t *active_head, *active_tail;
+
+/* Leases on files' contents, by inumber, held by the sessions caching what
+ * they got with tfs_get. Writing to a file, truncating it or putting it
+ * revokes its leases: each holder is told through its pipe before the write
+ * is answered, so that it never serves contents older than a write that
+ * completed. A lease runs out after LEASE_TERM_MS regardless, and is then
+ * forgotten. Only sessions over pipes or a socket get leases, as any worker
+ * can send to those. */
+typedef struct {
+    pthread_mutex_t lock;
+    int holders;
+    struct {
+        int session_id;
+        struct timespec expires;
+    } holder[MAX_LEASE_HOLDERS];
+} lease_t;
 
-int numbers[MAX_SESSIONS];
-char *session[MAX_SESSIONS];
-int fcli[MAX_SESSIONS];
-int fserv;
+lease_t leases[INODE_TABLE_SIZE];
+// over every file, so that writes only look for leases while there are any
+_Atomic int leases_held;
+
+/* What the server did, by kind of request. Each worker counts what it
+ * handles in a block of its own, so that workers never write to the same
+ * counters; the other threads (the main one, for mounts, and those of
+ * shared-memory sessions) share the last block. A TFS_OP_CODE_STATS request
+ * adds the blocks up. */
+typedef struct {
+    _Atomic uint64_t count, errors, bytes_in, bytes_out, queue_wait_ns, lock_wait_ns, latency_ns;
+    _Atomic uint64_t metadata_ios, data_ios;
+    _Atomic uint64_t latency[TFS_STATS_BUCKETS];
+} op_stats_t;
+
+op_stats_t op_stats[MAX_WORKERS + 1][TFS_OP_CODES];
+_Thread_local int stats_block = MAX_WORKERS;
+
+int fserv, fserv_writer, fsock;
+/* Kept open for when the server runs out of file descriptors: given up for
+ * as long as it takes to turn a client away, instead of leaving it to wait */
+int spare_fd = -1;
+int epoll_fd;
 char *pipename;
+char socket_path[MAX_PATH_NAME + 1];
+
+// tag the server's pipe and socket in the epoll set, where sessions go by id
+#define SERVER_PIPE (-1)
+#define SERVER_SOCKET (-2)
+// the server's socket is named after its pipe
+#define SOCKET_SUFFIX ".sock"
+// how long a shared-memory session waits for a request before parking, and
+// how often the clients of parked ones are checked to be alive
+#define RING_IDLE_CHECK_MS (1000)
+// events taken from the epoll set at once
+#define EPOLL_BATCH (64)
+// how often the main thread retries to open the pipes of pending mounts, how
+// long it keeps trying, and how many mounts can be pending at once
+#define MOUNT_RETRY_MS (1)
+#define MOUNT_TIMEOUT_MS (1000)
+#define MAX_PENDING_MOUNTS (64)
+
+/* Mounts over pipes whose client has not opened its own pipe for reading
+ * yet. Opening a pipe for writing waits for a reader, which would hold up
+ * the main thread, and with it every session, behind a client that stalls
+ * or dies after asking to mount. So the main thread opens the client's pipe
+ * without waiting, and retries every MOUNT_RETRY_MS; a client that hasn't
+ * opened it after MOUNT_TIMEOUT_MS loses its session. Only the main thread
+ * uses them. */
+typedef struct {
+    int session_id; // -1 for a mount that failed, only to be answered
+    uint32_t tag;
+    struct timespec since;
+    char client_pipe_path[MAX_PATH_NAME + 1];
+} pending_mount_t;
+
+pending_mount_t pending_mounts[MAX_PENDING_MOUNTS];
+int pending_count;
+
+int parse_command(tfs_request_t *request, parsed_command *command);
+
+// Request Queue
+void make_ready(int session_id);
+int dequeue_session();
+void queue_command(session_t *s, parsed_command *command);
+parsed_command *next_command();
+parsed_command *take_command();
+void drop_command(parsed_command *command);
+size_t request_cost(parsed_command *command);
+void end_request(int session_id);
+void drain_session(int session_id);
 
-parsed_command* parse_command(char* buffer);
+// Statistics
+void start_request(parsed_command *command);
+void record_request(parsed_command *command);
+int latency_bucket(uint64_t ns);
+uint64_t elapsed_ns(struct timespec const *from, struct timespec const *to);
 
 // Handle Commands
-void *handle_request(void *session_id);
+void *worker_thread(void *arg);
+int read_session(int session_id);
+int execute_command(parsed_command *command);
+int accept_mount();
+int accept_socket();
+int answer_mount(char const *client_pipe_path, int session_id, uint32_t tag);
+int finish_mount(pending_mount_t *mount, int can_wait);
+void retry_mounts();
+int read_request(int session_id, tfs_request_t *request, parsed_command *command);
+void *ring_thread(void *session_id);
+int park_ring(session_t *s, uint32_t head);
+void resume_ring(int session_id);
+void reap_sessions();
+int respond(parsed_command *command, int64_t result, void const *payload, size_t payload_len);
+void ring_complete(tfs_ring_t *ring, uint32_t slot, uint32_t tag, int64_t result, void const *payload, size_t payload_len);
+int handle_request(parsed_command *command);
 int handle_tfs_mount(parsed_command* command);
 int handle_tfs_unmount(parsed_command* command);
 int handle_tfs_open(parsed_command* command);
 int handle_tfs_close(parsed_command* command);
 int handle_tfs_read(parsed_command* command);
 int handle_tfs_write(parsed_command* command);
+int handle_tfs_lseek(parsed_command* command);
+int handle_tfs_truncate(parsed_command* command);
+int handle_tfs_fallocate(parsed_command* command);
+int handle_tfs_stat(parsed_command* command);
+int handle_tfs_fstat(parsed_command* command);
+int handle_tfs_stat_many(parsed_command* command);
+int handle_tfs_put(parsed_command* command);
+int handle_tfs_get(parsed_command* command);
+int handle_tfs_set_qos(parsed_command* command);
+int handle_tfs_stats(parsed_command* command);
 int handle_tfs_shutdown_after_all_closed(parsed_command* command);
 
 // Auxiliary Functions
-int init_server();
+int init_server(int worker_count, int depth);
 int destroy_server();
 int try_open(void *pipename, int flags);
 int try_close(int fserv);
-int try_read(int fserver, void *buffer, size_t size);
-int try_write(int fclient, void *result, size_t size);
-int try_session();
-int open_session(char* client_pipe_path);
+int transient_error(int error);
+void release_spare();
+void restore_spare();
+int clear_nonblock(int fd);
+int watch(int fd, int tag, int op);
+int try_read(int fd, void *buffer, size_t size);
+int discard_payload(int fd, size_t size);
+int send_response(int fclient, uint32_t tag, int64_t result, void const *payload, size_t payload_len);
+int init_socket();
+session_t *session_get(int session_id);
+int alloc_session();
+int grow_sessions();
+void free_session(int session_id);
+int open_session(char* request_pipe_path);
+int open_socket_session(int fd);
+int open_ring_session(char *ring_path, uint32_t tag);
 int close_session(int session_id);
+int grant_lease(int session_id, int inumber);
+void revoke_leases(int inumber);
+int leased_file(int fhandle);
+void drop_leases(int session_id);
+
+#ifdef LOCK_PROFILE
+/* Set by SIGUSR1, which asks for the profile of the file system's locks;
+ * the main thread prints it to stderr, as a handler can't. */
+static volatile sig_atomic_t lock_report_requested = 0;
+
+static void request_lock_report(int signum) {
+    (void)signum;
+    lock_report_requested = 1;
+}
+#endif
+
+#ifdef TRACE
+/* Set by SIGUSR2, which asks for the threads' traces; the main thread
+ * writes them next to the server's pipe, as a handler can't. */
+static volatile sig_atomic_t trace_requested = 0;
+
+static void request_trace(int signum) {
+    (void)signum;
+    trace_requested = 1;
+}
+
+/*
+ * Writes the threads' traces to <pipename>.trace.json
+ */
+static void dump_trace() {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s.trace.json", pipename);
+    if (trace_dump(path) != 0)
+        perror("trace_dump");
+}
+#endif
 
 int main(int argc, char **argv) {
 
-    char buffer[MAX_REQUEST_SIZE];
     if (argc < 2) {
         printf("Please specify the pathname of the server's pipe.\n");
         exit(1);
     }
     pipename = argv[1];
-    printf("Starting TecnicoFS server with pipe called %s\n", pipename);
+    // as many workers as cores, unless told otherwise
+    long worker_count = argc > 2 ? strtol(argv[2], NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    // a shutdown holds a worker until all files are closed, by another one
+    if (worker_count < 2)
+        worker_count = 2;
+    if (worker_count > MAX_WORKERS)
+        worker_count = MAX_WORKERS;
+    // requests of a session handled at once
+    long depth = argc > 3 ? strtol(argv[3], NULL, 10) : DEFAULT_SESSION_DEPTH;
+    if (depth < 1)
+        depth = 1;
+    if (depth > MAX_SESSION_DEPTH)
+        depth = MAX_SESSION_DEPTH;
+    printf("Starting TecnicoFS server with pipe called %s, %ld workers and depth %ld\n", pipename, worker_count, depth);
     tfs_init();
     signal(SIGPIPE, SIG_IGN);
+#ifdef LOCK_PROFILE
+    signal(SIGUSR1, request_lock_report);
+#endif
+#ifdef TRACE
+    signal(SIGUSR2, request_trace);
+#endif
+    TRACE_THREAD("main");
+    // every session over pipes or a socket holds file descriptors of its own
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
     unlink(pipename);
 
-    if (init_server()) exit(1);
+    if (init_server((int)worker_count, (int)depth)) exit(1);
     if (mkfifo(pipename, 0777) < 0) exit(1);
-    if ((fserv = try_open(pipename, O_RDONLY)) < 0) exit(1);
-    
-    parsed_command *command;
-    int session_id;
+    if ((fserv = try_open(pipename, O_RDONLY | O_NONBLOCK)) < 0) exit(1);
+    // never reaches EOF as clients come and go, while the server writes to it
+    if ((fserv_writer = try_open(pipename, O_WRONLY)) < 0) exit(1);
+    if (clear_nonblock(fserv) < 0) exit(1);
+    if (watch(fserv, SERVER_PIPE, EPOLL_CTL_ADD) < 0) exit(1);
+    if (init_socket() < 0) exit(1);
+    restore_spare();
+
+    /* Only waits for requests to arrive: mounts are handled here, while the
+     * requests of a session are read and handled by the workers. */
+    struct epoll_event events[EPOLL_BATCH];
+    struct timespec now, last_reap;
+    clock_gettime(CLOCK_MONOTONIC, &last_reap);
     while (1) {
-        // Reads request, parses command
-        pthread_mutex_lock(&command_lock);
-        if (try_read(fserv, buffer, MAX_REQUEST_SIZE) < 0) break;
-        command = parse_command(buffer);
-
-        if (command == NULL) break;
-        if (command->op_code == TFS_OP_CODE_MOUNT) {
-            handle_tfs_mount(command);
-            continue;
+        int n = epoll_wait(epoll_fd, events, EPOLL_BATCH, pending_count > 0 ? MOUNT_RETRY_MS : RING_IDLE_CHECK_MS);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (pending_count > 0)
+            retry_mounts();
+        if (now.tv_sec - last_reap.tv_sec >= RING_IDLE_CHECK_MS / 1000) {
+            reap_sessions();
+            last_reap = now;
         }
-        session_id = command->session_id;
-        pthread_mutex_lock(&locks[session_id]);
-
-        while (busy[session_id])
-            pthread_cond_wait(&maySend[session_id], &locks[session_id]);
-        busy[session_id] = 1;
-
-        pthread_cond_signal(&mayWork[session_id]);
-
-        pthread_mutex_unlock(&locks[session_id]);
+#ifdef LOCK_PROFILE
+        if (lock_report_requested) {
+            lock_report_requested = 0;
+            lock_profile_report(stderr);
+        }
+#endif
+#ifdef TRACE
+        if (trace_requested) {
+            trace_requested = 0;
+            dump_trace();
+        }
+#endif
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) {
+            perror("epoll_wait");
+            break;
+        }
+        // only the server's own pipe or socket failing ends the server
+        int i;
+        for (i = 0; i < n; i++) {
+            if (events[i].data.fd == SERVER_PIPE) {
+                if (accept_mount() < 0) break;
+            } else if (events[i].data.fd == SERVER_SOCKET) {
+                if (accept_socket() < 0) break;
+            } else
+                make_ready(events[i].data.fd);
+        }
+        if (i < n) break;
     }
     if (try_close(fserv) < 0) exit(1);
+    if (try_close(fserv_writer) < 0) exit(1);
+    if (try_close(fsock) < 0) exit(1);
     if (destroy_server()) exit(1);
     unlink(pipename);
+    unlink(socket_path);
     return 0;
 }
 
-parsed_command *parse_command(char* buffer) {
-    parsed_command* command = (parsed_command*)malloc(sizeof(parsed_command));
-    int op_code;
-    sscanf(buffer, "%d ", &op_code);
-    command->op_code = op_code;
-    buffer++;
-    switch (op_code) {
+/*
+ * Decodes a request header whose payload was already read into the command.
+ * Returns 0 if successful, -1 if the request is malformed.
+ */
+int parse_command(tfs_request_t *request, parsed_command *command) {
+    if (request->version != TFS_PROTOCOL_VERSION)
+        return -1;
+
+    command->op_code = request->op_code;
+    command->session_id = request->session_id;
+    command->fhandle = request->fhandle;
+    command->flags = request->flags;
+    command->offset = (off_t)request->offset;
+    command->len = (size_t)request->len;
+    command->payload_len = request->payload_len;
+    command->tag = request->tag;
+    // path names travel without their '\0'
+    command->payload[command->payload_len] = '\0';
+
+    switch (command->op_code) {
+        case TFS_OP_CODE_MOUNT: {
+            // the client's pipe path, then a '\0' and its request pipe path
+            // (or just the path of its ring, for shared memory)
+            size_t path_len = strnlen(command->payload, command->payload_len);
+            if (path_len == 0 || path_len > MAX_PATH_NAME)
+                return -1;
+            if (command->flags & TFS_MOUNT_SHARED_MEMORY)
+                return path_len == command->payload_len ? 0 : -1;
+            if (path_len + 1 >= command->payload_len || command->payload_len - path_len - 1 > MAX_PATH_NAME)
+                return -1;
+            break;
+        }
+        case TFS_OP_CODE_OPEN:
+        case TFS_OP_CODE_STAT:
+            if (command->payload_len > MAX_FILE_NAME)
+                return -1;
+            break;
+        case TFS_OP_CODE_WRITE:
+            command->len = command->payload_len;
+            break;
+        case TFS_OP_CODE_PUT: {
+            // the path name, then a '\0' and the contents
+            size_t path_len = strnlen(command->payload, command->payload_len);
+            if (path_len == command->payload_len || path_len > MAX_FILE_NAME)
+                return -1;
+            command->len = command->payload_len - path_len - 1;
+            break;
+        }
+        case TFS_OP_CODE_GET:
+            if (command->payload_len > MAX_FILE_NAME)
+                return -1;
+            break;
+        case TFS_OP_CODE_STAT_MANY:
+            // len carries the number of path names, each followed by a '\0'
+            if (command->len > MAX_STAT_PATHS)
+                return -1;
+            break;
+        case TFS_OP_CODE_UNMOUNT:
+        case TFS_OP_CODE_SET_QOS:
+        case TFS_OP_CODE_STATS:
+        case TFS_OP_CODE_CLOSE:
+        case TFS_OP_CODE_READ:
+        case TFS_OP_CODE_LSEEK:
+        case TFS_OP_CODE_TRUNCATE:
+        case TFS_OP_CODE_FALLOCATE:
+        case TFS_OP_CODE_FSTAT:
+        case TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED:
+            break;
+        default:
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Queues a session whose pipe has a request waiting.
+ */
+void make_ready(int session_id) {
+    session_t *s = session_get(session_id);
+    pthread_mutex_lock(&queue_lock);
+    s->next_ready = NULL;
+    if (ready_tail == NULL)
+        ready_head = s;
+    else
+        ready_tail->next_ready = s;
+    ready_tail = s;
+    pthread_cond_signal(&work_ready);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/*
+ * Takes the first ready session. Called with queue_lock held, and a session
+ * ready.
+ */
+int dequeue_session() {
+    session_t *s = ready_head;
+    ready_head = s->next_ready;
+    if (ready_head == NULL)
+        ready_tail = NULL;
+    return s->id;
+}
+
+void *worker_thread(void *arg) {
+    // counts what it handles in a block of its own
+    stats_block = (int)(intptr_t)arg;
+    TRACE_THREAD("worker");
+    while (1) {
+        int result;
+        pthread_mutex_lock(&queue_lock);
+        while (ready_head == NULL && active_head == NULL && !stopping)
+            pthread_cond_wait(&work_ready, &queue_lock);
+        if (ready_head == NULL && active_head == NULL) {
+            pthread_mutex_unlock(&queue_lock);
+            break;
+        }
+        // Reading first lets the scheduler see every request it can choose from
+        if (ready_head != NULL) {
+            int session_id = dequeue_session();
+            pthread_mutex_unlock(&queue_lock);
+            result = read_session(session_id);
+        } else {
+            parsed_command *command = next_command();
+            pthread_mutex_unlock(&queue_lock);
+            result = execute_command(command);
+        }
+        if (result > 0) {
+            // the file system is gone, so is the server
+#ifdef TRACE
+            dump_trace();
+#endif
+            unlink(pipename);
+            unlink(socket_path);
+            exit(0);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Reads and parses the request waiting in a session's pipe, and queues it
+ * to be handled. The pipe is rearmed for the next one, unless the session
+ * is over or as deep as it can get.
+ * Returns 0.
+ */
+int read_session(int session_id) {
+    session_t *s = session_get(session_id);
+    TRACE_START(start);
+    parsed_command *command = take_command();
+    tfs_request_t request;
+
+    int status = read_request(session_id, &request, command);
+    clock_gettime(CLOCK_MONOTONIC, &command->received);
+    // the channel tells the session, whatever the header says
+    request.session_id = session_id;
+    command->session_id = session_id;
+    command->tag = request.tag;
+    command->op_code = request.op_code;
+    if (status < 0)
+        // the client went away without unmounting
+        command->op_code = SESSION_GONE;
+    else
+        command->malformed = status > 0 || parse_command(&request, command) < 0 ||
+                             command->op_code == TFS_OP_CODE_MOUNT;
+    int last = command->op_code == SESSION_GONE ||
+               (!command->malformed && command->op_code == TFS_OP_CODE_UNMOUNT);
+    command->cost = request_cost(command);
+    TRACE_REQUEST(session_id, command->tag);
+    TRACE_FLOW_START("request");
+
+    pthread_mutex_lock(&queue_lock);
+    int rearm = ++s->in_flight < s->depth && !last;
+    if (!rearm && !last)
+        s->stalled = 1;
+    queue_command(s, command);
+    pthread_mutex_unlock(&queue_lock);
+    if (rearm)
+        watch(s->freq, session_id, EPOLL_CTL_MOD);
+    TRACE_SPAN("read", start, command->op_code);
+    TRACE_REQUEST(0, 0);
+    return 0;
+}
+
+/*
+ * Handles a command taken off its session's queue, then lets the session go
+ * on, unless it is over.
+ * Returns the result of the handler, -1 if there was none.
+ */
+int execute_command(parsed_command *command) {
+    int session_id = command->session_id;
+    int result;
+    TRACE_REQUEST(session_id, command->tag);
+    TRACE_START(start);
+    TRACE_FLOW_END("request");
+    start_request(command);
+    if (command->op_code == SESSION_GONE) {
+        // The channel is only closed once the other requests are answered
+        drain_session(session_id);
+        close_session(session_id);
+        result = -1;
+    } else if (!command->malformed && command->op_code == TFS_OP_CODE_UNMOUNT) {
+        drain_session(session_id);
+        result = handle_request(command);
+    } else {
+        result = command->malformed ? respond(command, -1, NULL, 0) : handle_request(command);
+        end_request(session_id);
+    }
+    TRACE_SPAN("handle", start, command->op_code);
+    TRACE_REQUEST(0, 0);
+    drop_command(command);
+    return result;
+}
+
+/*
+ * Puts a command at the back of its session's queue, and the session in the
+ * round if it wasn't. Called with queue_lock held.
+ */
+void queue_command(session_t *s, parsed_command *command) {
+    command->next = NULL;
+    if (s->queue_tail == NULL) {
+        s->queue_head = command;
+        // joins the round at the back, with nothing to spend yet
+        s->deficit = 0;
+        s->next_active = NULL;
+        if (active_tail == NULL)
+            active_head = s;
+        else
+            active_tail->next_active = s;
+        active_tail = s;
+    } else
+        s->queue_tail->next = command;
+    s->queue_tail = command;
+    pthread_cond_signal(&work_ready);
+}
+
+/*
+ * Takes the next command to handle, in deficit round robin. Called with
+ * queue_lock held, and some session in the round.
+ */
+parsed_command *next_command() {
+    while (1) {
+        session_t *s = active_head;
+        parsed_command *command = s->queue_head;
+        if (s->deficit >= command->cost) {
+            s->deficit -= command->cost;
+            s->queue_head = command->next;
+            if (s->queue_head == NULL) {
+                // leaves the round, and whatever it had left to spend
+                s->queue_tail = NULL;
+                active_head = s->next_active;
+                if (active_head == NULL)
+                    active_tail = NULL;
+            }
+            return command;
+        }
+        // Its turn is over: tops up the deficit for the next one
+        s->deficit += DRR_QUANTUM * (size_t)s->weight;
+        if (s->next_active != NULL) {
+            active_head = s->next_active;
+            s->next_active = NULL;
+            active_tail->next_active = s;
+            active_tail = s;
+        }
+    }
+}
+
+/*
+ * Counts what a request costs the server: the bytes it carries in, and the
+ * bytes its response carries out.
+ */
+size_t request_cost(parsed_command *command) {
+    size_t cost = sizeof(tfs_request_t) + sizeof(tfs_response_t);
+    if (command->op_code == SESSION_GONE || command->malformed)
+        return cost;
+    cost += command->payload_len;
+    switch (command->op_code) {
+        case TFS_OP_CODE_READ:
+        case TFS_OP_CODE_GET:
+            cost += command->len < BLOCK_SIZE ? command->len : BLOCK_SIZE;
+            break;
+        case TFS_OP_CODE_STAT:
+        case TFS_OP_CODE_FSTAT:
+            cost += sizeof(tfs_stat_t);
+            break;
+        case TFS_OP_CODE_STAT_MANY:
+            cost += command->len * (sizeof(int) + sizeof(tfs_stat_t));
+            break;
+        case TFS_OP_CODE_STATS:
+            cost += sizeof(tfs_op_stats_t);
+            break;
         case TFS_OP_CODE_MOUNT:
-            command->txt_info = (char*)malloc(MAX_PATH_NAME + 1); // pipename
-            sscanf(buffer, "%s", command->txt_info);
+        case TFS_OP_CODE_UNMOUNT:
+        case TFS_OP_CODE_OPEN:
+        case TFS_OP_CODE_CLOSE:
+        case TFS_OP_CODE_WRITE:
+        case TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED:
+        case TFS_OP_CODE_LSEEK:
+        case TFS_OP_CODE_TRUNCATE:
+        case TFS_OP_CODE_FALLOCATE:
+        case TFS_OP_CODE_PUT:
+        case TFS_OP_CODE_RESUME:
+        case TFS_OP_CODE_SET_QOS:
+        default:
             break;
+    }
+    return cost;
+}
+
+/*
+ * Takes a command from the pool, allocating one only if the pool is empty.
+ */
+parsed_command *take_command() {
+    pthread_mutex_lock(&queue_lock);
+    parsed_command *command = free_commands;
+    if (command != NULL)
+        free_commands = command->next;
+    pthread_mutex_unlock(&queue_lock);
+    if (command == NULL && (command = malloc(sizeof(parsed_command))) == NULL) {
+        // Nothing else to read the request into
+        perror("malloc");
+        exit(1);
+    }
+    command->payload = command->reply_buffer = command->buffer;
+    command->malformed = 0;
+    command->payload_len = 0;
+    command->failed = 0;
+    command->reply_len = 0;
+    return command;
+}
+
+/*
+ * Gives a handled command back to the pool.
+ */
+void drop_command(parsed_command *command) {
+    pthread_mutex_lock(&queue_lock);
+    command->next = free_commands;
+    free_commands = command;
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/*
+ * Counts a request as answered, letting a stalled session go on.
+ */
+void end_request(int session_id) {
+    session_t *s = session_get(session_id);
+    pthread_mutex_lock(&queue_lock);
+    int rearm = s->stalled;
+    s->stalled = 0;
+    if (--s->in_flight <= 1)
+        pthread_cond_broadcast(&session_drained);
+    pthread_mutex_unlock(&queue_lock);
+    if (rearm)
+        watch(s->freq, session_id, EPOLL_CTL_MOD);
+}
+
+/*
+ * Waits until no other request of a session is in flight. Called by the
+ * worker handling its last request, so no more of them can start.
+ */
+void drain_session(int session_id) {
+    session_t *s = session_get(session_id);
+    pthread_mutex_lock(&queue_lock);
+    while (s->in_flight > 1)
+        pthread_cond_wait(&session_drained, &queue_lock);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/*
+ * Notes when the calling thread starts to handle a request.
+ */
+void start_request(parsed_command *command) {
+    clock_gettime(CLOCK_MONOTONIC, &command->started);
+    command->lock_wait_ns = tfs_lock_wait_ns();
+    tfs_ios(&command->metadata_ios, &command->data_ios);
+}
+
+/*
+ * Counts a request the calling thread is answering, with the time since it
+ * was read and since it started to be handled.
+ */
+void record_request(parsed_command *command) {
+    struct timespec now;
+    if (command->op_code < 1 || command->op_code >= TFS_OP_CODES)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t latency_ns = elapsed_ns(&command->received, &now);
+
+    // Only this thread writes to its block, unless it is the shared one
+    op_stats_t *s = &op_stats[stats_block][command->op_code];
+    atomic_fetch_add_explicit(&s->count, 1, memory_order_relaxed);
+    if (command->failed || command->malformed)
+        atomic_fetch_add_explicit(&s->errors, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->bytes_in, command->payload_len, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->bytes_out, command->reply_len, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->queue_wait_ns, elapsed_ns(&command->received, &command->started),
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->lock_wait_ns, tfs_lock_wait_ns() - command->lock_wait_ns, memory_order_relaxed);
+    uint64_t metadata_ios, data_ios;
+    tfs_ios(&metadata_ios, &data_ios);
+    atomic_fetch_add_explicit(&s->metadata_ios, metadata_ios - command->metadata_ios, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->data_ios, data_ios - command->data_ios, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->latency_ns, latency_ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->latency[latency_bucket(latency_ns)], 1, memory_order_relaxed);
+}
+
+/*
+ * Finds the bucket a latency is counted in (see TFS_STATS_BUCKETS).
+ */
+int latency_bucket(uint64_t ns) {
+    if (ns < TFS_STATS_SUB_BUCKETS)
+        return (int)ns;
+    // ns is in [2^e, 2^(e+1)), split in 4 by its next two bits
+    int e = 63 - __builtin_clzll(ns);
+    int bucket = (e - 1) * TFS_STATS_SUB_BUCKETS + (int)((ns >> (e - 2)) & 3);
+    return bucket < TFS_STATS_BUCKETS ? bucket : TFS_STATS_BUCKETS - 1;
+}
+
+uint64_t elapsed_ns(struct timespec const *from, struct timespec const *to) {
+    int64_t ns = (int64_t)(to->tv_sec - from->tv_sec) * 1000000000 + (to->tv_nsec - from->tv_nsec);
+    return ns > 0 ? (uint64_t)ns : 0;
+}
+
+/*
+ * Reads the request waiting in a session's pipe or socket.
+ * Returns 0 if successful, 1 if it was too large (and skipped), -1 if the
+ * client is gone.
+ */
+int read_request(int session_id, tfs_request_t *request, parsed_command *command) {
+    session_t *s = session_get(session_id);
+    int fd = s->freq;
+    if (s->is_socket) {
+        // A single message, so a single call
+        struct iovec iov[2] = {
+            {.iov_base = request, .iov_len = sizeof(tfs_request_t)},
+            {.iov_base = command->payload, .iov_len = MAX_PAYLOAD_SIZE},
+        };
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+        ssize_t r;
+        do {
+            r = recvmsg(fd, &msg, 0);
+        } while (r == -1 && errno == EINTR);
+        if (r <= 0)
+            return -1;
+        if ((msg.msg_flags & MSG_TRUNC) || (size_t)r < sizeof(tfs_request_t) ||
+            (size_t)r - sizeof(tfs_request_t) != request->payload_len)
+            return 1;
+        return 0;
+    }
+
+    // The client writes each request at once, so it is all there to be read
+    if (try_read(fd, request, sizeof(tfs_request_t)) < 0)
+        return -1;
+    if (request->payload_len > MAX_PAYLOAD_SIZE)
+        return discard_payload(fd, request->payload_len) < 0 ? -1 : 1;
+    return try_read(fd, command->payload, request->payload_len);
+}
+
+/*
+ * Reads a request from the server's pipe, which only carries mounts (and
+ * resumes of parked rings).
+ * Returns 0 unless the pipe can no longer be read.
+ */
+int accept_mount() {
+    tfs_request_t request;
+    parsed_command mount;
+    mount.payload = mount.reply_buffer = mount.buffer;
+    mount.malformed = 0;
+    mount.reply_len = 0;
+    if (try_read(fserv, &request, sizeof(request)) < 0) return -1;
+    if (request.payload_len > MAX_PAYLOAD_SIZE)
+        return discard_payload(fserv, request.payload_len);
+    if (try_read(fserv, mount.payload, request.payload_len) < 0) return -1;
+    clock_gettime(CLOCK_MONOTONIC, &mount.received);
+    start_request(&mount);
+    TRACE_START(start);
+    // Nobody to answer to, so anything else is dropped
+    if (request.op_code == TFS_OP_CODE_MOUNT && parse_command(&request, &mount) == 0) {
+        mount.failed = handle_tfs_mount(&mount) < 0;
+        record_request(&mount);
+    } else if (request.op_code == TFS_OP_CODE_RESUME && request.version == TFS_PROTOCOL_VERSION)
+        resume_ring(request.session_id);
+    TRACE_SPAN("mount", start, request.op_code);
+    return 0;
+}
+
+int handle_request(parsed_command *command) {
+    int op_code = command->op_code, result;
+    switch (op_code) {
         case TFS_OP_CODE_UNMOUNT:
-            sscanf(buffer, "%d", &(command->session_id));
-            command_buffer[command->session_id] = command;
+            result = handle_tfs_unmount(command);
             break;
         case TFS_OP_CODE_OPEN:
-            command->txt_info = (char*)malloc(MAX_FILE_NAME + 1); // filename
-            sscanf(buffer, "%d %s %d", &(command->session_id), command->txt_info, &(command->flags));
-            command_buffer[command->session_id] = command;
+            result = handle_tfs_open(command);
             break;
         case TFS_OP_CODE_CLOSE:
-            sscanf(buffer, "%d %d", &(command->session_id), &(command->fhandle));
-            command_buffer[command->session_id] = command;
+            result = handle_tfs_close(command);
             break;
         case TFS_OP_CODE_WRITE:
-            sscanf(buffer, "%d %d %lu", &(command->session_id), &(command->fhandle), &(command->len));
-            char ack = 'y';
-            if (write(fcli[command->session_id], &ack, sizeof(char)) < 0) {
-                pthread_mutex_unlock(&command_lock);
-                return NULL;
-            }
-            command->txt_info = (char*)malloc(command->len + 1);
-            if (try_read(fserv, command->txt_info, command->len) < 0) {
-                free(command->txt_info);
-                pthread_mutex_unlock(&command_lock);
-                return NULL;
-            }
-            command_buffer[command->session_id] = command;
+            result = handle_tfs_write(command);
             break;
         case TFS_OP_CODE_READ:
-            sscanf(buffer, "%d %d %lu", &(command->session_id), &(command->fhandle), &(command->len));
-            command_buffer[command->session_id] = command;
+            result = handle_tfs_read(command);
+            break;
+        case TFS_OP_CODE_LSEEK:
+            result = handle_tfs_lseek(command);
+            break;
+        case TFS_OP_CODE_TRUNCATE:
+            result = handle_tfs_truncate(command);
+            break;
+        case TFS_OP_CODE_FALLOCATE:
+            result = handle_tfs_fallocate(command);
+            break;
+        case TFS_OP_CODE_STAT:
+            result = handle_tfs_stat(command);
+            break;
+        case TFS_OP_CODE_FSTAT:
+            result = handle_tfs_fstat(command);
+            break;
+        case TFS_OP_CODE_STAT_MANY:
+            result = handle_tfs_stat_many(command);
+            break;
+        case TFS_OP_CODE_PUT:
+            result = handle_tfs_put(command);
+            break;
+        case TFS_OP_CODE_GET:
+            result = handle_tfs_get(command);
+            break;
+        case TFS_OP_CODE_SET_QOS:
+            result = handle_tfs_set_qos(command);
+            break;
+        case TFS_OP_CODE_STATS:
+            result = handle_tfs_stats(command);
             break;
         case TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED:
-            sscanf(buffer, "%d", &(command->session_id));
-            command_buffer[command->session_id] = command;
-            break;   
+            result = handle_tfs_shutdown_after_all_closed(command);
+            break;
         default:
-            pthread_mutex_unlock(&command_lock);
-            return NULL;
+            result = -1;
+            break;
     }
-    pthread_mutex_unlock(&command_lock);
-    return command;
-} 
-
-void *handle_request(void* s_id) {
-    int session_id = *((int*)s_id);
-    while(1) {
-        pthread_mutex_lock(&locks[session_id]);
-        while (!busy[session_id])
-            pthread_cond_wait(&mayWork[session_id], &locks[session_id]);
-        parsed_command* command = command_buffer[session_id];
-        if (command == NULL) {
-            exit(1);
+    return result;
+}
+
+int handle_tfs_mount(parsed_command* command) {
+    if (command->flags & TFS_MOUNT_SHARED_MEMORY)
+        return open_ring_session(command->payload, command->tag);
+    char *client_pipe_path = command->payload;
+    char *request_pipe_path = client_pipe_path + strlen(client_pipe_path) + 1;
+    // No session to keep the pipe in, but the client still gets its answer
+    int result = answer_mount(client_pipe_path, open_session(request_pipe_path), command->tag);
+    return result < 0 ? -1 : 0;
+}
+
+/*
+ * Answers a mount over pipes with its session_id (or -1), through the
+ * client's pipe, once the client opened it. Until then the mount is left
+ * pending, for retry_mounts to answer.
+ * Returns 0 if answered with a session, 1 if pending, -1 otherwise.
+ */
+int answer_mount(char const *client_pipe_path, int session_id, uint32_t tag) {
+    pending_mount_t mount = {.session_id = session_id, .tag = tag};
+    clock_gettime(CLOCK_MONOTONIC, &mount.since);
+    strcpy(mount.client_pipe_path, client_pipe_path);
+    // with no room to wait for the client, it is as if it timed out
+    int result = finish_mount(&mount, pending_count < MAX_PENDING_MOUNTS);
+    if (result == 1)
+        pending_mounts[pending_count++] = mount;
+    return result;
+}
+
+/*
+ * Tries to open a pending mount's client pipe, without waiting for the
+ * client, and answers it. A session whose client doesn't open it in time
+ * (right away, unless it can wait), or can't be answered, is let go.
+ * Returns 0 if answered with a session, 1 if still pending, -1 otherwise.
+ */
+int finish_mount(pending_mount_t *mount, int can_wait) {
+    struct timespec now;
+    int fcli = try_open(mount->client_pipe_path, O_WRONLY | O_NONBLOCK);
+    int shed = 0;
+    if (fcli == -1 && (errno == EMFILE || errno == ENFILE) && spare_fd >= 0) {
+        /* Out of file descriptors: the session is let go, and the spare one
+         * makes room to turn the client away */
+        perror(mount->client_pipe_path);
+        if (mount->session_id != -1) {
+            try_close(session_get(mount->session_id)->freq);
+            free_session(mount->session_id);
+            mount->session_id = -1;
         }
-        int op_code = command->op_code;
-        switch (op_code) {
-            case TFS_OP_CODE_UNMOUNT:
-                if (handle_tfs_unmount(command) < 0) {
-                    pthread_mutex_unlock(&locks[session_id]);
-                    return NULL;
-                }
-                goto end;
-            case TFS_OP_CODE_OPEN:
-                if (handle_tfs_open(command) < 0) {
-                    pthread_mutex_unlock(&locks[session_id]);
-                    return NULL;
-                }
-                goto end;
-            case TFS_OP_CODE_CLOSE:
-                if (handle_tfs_close(command) < 0) {
-                    pthread_mutex_unlock(&locks[session_id]);
-                    return NULL;
-                }
-                goto end;
-            case TFS_OP_CODE_WRITE:
-                if (handle_tfs_write(command) < 0) {
-                    pthread_mutex_unlock(&locks[session_id]);
-                    return NULL;
-                }
-                goto end;
-            case TFS_OP_CODE_READ:
-                if (handle_tfs_read(command) < 0) {
-                    pthread_mutex_unlock(&locks[session_id]);
-                    return NULL;
-                }
-                goto end;
-            case TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED:
-                if (handle_tfs_shutdown_after_all_closed(command) < 0) {
-                    pthread_mutex_unlock(&locks[session_id]);
-                    return NULL;
-                }
-                goto end;
-            default:
-                pthread_mutex_unlock(&locks[session_id]);
-                return NULL;
+        release_spare();
+        shed = 1;
+        fcli = try_open(mount->client_pipe_path, O_WRONLY | O_NONBLOCK);
+    }
+    if (fcli == -1 && errno == ENXIO && can_wait) {
+        // no reader yet
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (elapsed_ns(&mount->since, &now) < (uint64_t)MOUNT_TIMEOUT_MS * 1000000) {
+            if (shed)
+                restore_spare();
+            return 1;
         }
-        end:
-        command_buffer[session_id] = NULL;
-        pthread_cond_signal(&maySend[session_id]);
-        pthread_mutex_unlock(&locks[session_id]);
-        busy[session_id] = 0;
     }
-    return NULL;
-}
+    if (fcli == -1 && errno != ENXIO)
+        perror(mount->client_pipe_path);
 
-int handle_tfs_mount(parsed_command* command) {
-    int result; // session_id || -1
-    result = open_session(command->txt_info); // client_pipe_path
-    if (try_write(fcli[result], &result, sizeof(int)) < 0) {
-        free(command);
+    int s_id = mount->session_id;
+    if (fcli >= 0 && clear_nonblock(fcli) < 0) {
+        try_close(fcli);
+        fcli = -1;
+    }
+    if (s_id == -1 || fcli < 0) {
+        if (fcli >= 0) {
+            send_response(fcli, mount->tag, -1, NULL, 0);
+            try_close(fcli);
+        }
+        if (s_id != -1) {
+            try_close(session_get(s_id)->freq);
+            free_session(s_id);
+        }
+        if (shed)
+            restore_spare();
+        return -1;
+    }
+
+    session_t *s = session_get(s_id);
+    s->fcli = fcli;
+    if (watch(s->freq, s_id, EPOLL_CTL_ADD) < 0) {
+        send_response(fcli, mount->tag, -1, NULL, 0);
+        try_close(s->freq);
+        try_close(fcli);
+        free_session(s_id);
+        return -1;
+    }
+    // the session is watched already, so it is closed like any other
+    if (send_response(fcli, mount->tag, s_id, NULL, 0) < 0) {
+        close_session(s_id);
         return -1;
     }
-    free(command);
     return 0;
 }
 
+/*
+ * Retries the pending mounts, answering those whose client opened its pipe
+ * and giving up on those that timed out.
+ */
+void retry_mounts() {
+    for (int i = 0; i < pending_count;) {
+        if (finish_mount(&pending_mounts[i], 1) != 1)
+            pending_mounts[i] = pending_mounts[--pending_count];
+        else
+            i++;
+    }
+}
+
 int handle_tfs_unmount(parsed_command* command) {
-    int result, session_id = command->session_id; // 0 || -1
-    result = close_session(session_id);
-    if (try_write(fcli[session_id], &result, sizeof(int)) < 0) {
-        free(command);
+    int session_id = command->session_id;
+    // answers before the pipe is closed
+    if (respond(command, 0, NULL, 0) < 0) {
+        close_session(session_id);
         return -1;
     }
-    free(command);
-    return 0;
+    return close_session(session_id);
 }
 
 int handle_tfs_open(parsed_command* command) {
-    int session_id = command->session_id, flags = command->flags, result; // fhandle || -1
-    result = tfs_open(command->txt_info, flags);
-    if (try_write(fcli[session_id], &result, sizeof(int)) < 0) {
-        free(command);
-        return -1;
-    }
-    free(command->txt_info);
-    free(command);
-    return 0;
+    int result = tfs_open(command->payload, command->flags); // fhandle || -1
+    if (result != -1 && (command->flags & TFS_O_TRUNC))
+        revoke_leases(leased_file(result));
+    return respond(command, result, NULL, 0);
 }
 
 int handle_tfs_close(parsed_command* command) {
-    int session_id = command->session_id, fhandle = command->fhandle, result; // 0 || -1
-    result = tfs_close(fhandle);
-    if (try_write(fcli[session_id], &result, sizeof(int)) < 0) {
-        free(command);
-        return -1;
-    }
-    free(command);
-    return 0;
+    int result = tfs_close(command->fhandle); // 0 || -1
+    return respond(command, result, NULL, 0);
 }
 
-int handle_tfs_write(parsed_command* command) { 
-    int session_id = command->session_id, fhandle = command->fhandle, result; // bytes || -1
+int handle_tfs_write(parsed_command* command) {
+    ssize_t result = tfs_write(command->fhandle, command->payload, command->len); // bytes || -1
+    if (result > 0)
+        revoke_leases(leased_file(command->fhandle));
+    return respond(command, result, NULL, 0);
+}
+
+int handle_tfs_read(parsed_command* command) {
+    char *to_read = command->reply_buffer;
     size_t len = command->len;
-    result = (int)tfs_write(fhandle, command->txt_info, len);
-    free(command->txt_info);
-    if (try_write(fcli[session_id], &result, sizeof(int)) < 0) {
-        free(command);
-        return -1;
+    // no file holds more than a block
+    if (len > BLOCK_SIZE)
+        len = BLOCK_SIZE;
+    ssize_t result = tfs_read(command->fhandle, to_read, len); // bytes || -1
+    return respond(command, result, to_read, result > 0 ? (size_t)result : 0);
+}
+
+int handle_tfs_lseek(parsed_command* command) {
+    // flags carries whence
+    off_t result = tfs_lseek(command->fhandle, command->offset, command->flags); // offset || -1
+    return respond(command, result, NULL, 0);
+}
+
+int handle_tfs_truncate(parsed_command* command) {
+    int result = tfs_truncate(command->fhandle, command->len); // 0 || -1
+    if (result == 0)
+        revoke_leases(leased_file(command->fhandle));
+    return respond(command, result, NULL, 0);
+}
+
+int handle_tfs_fallocate(parsed_command* command) {
+    int result = -1; // 0 || -1
+    if (command->offset >= 0)
+        result = tfs_fallocate(command->fhandle, (size_t)command->offset, command->len);
+    return respond(command, result, NULL, 0);
+}
+
+int handle_tfs_stat(parsed_command* command) {
+    tfs_stat_t st = {0};
+    int result = tfs_stat(command->payload, &st); // 0 || -1
+    return respond(command, result, &st, sizeof(st));
+}
+
+int handle_tfs_fstat(parsed_command* command) {
+    tfs_stat_t st = {0};
+    int result = tfs_fstat(command->fhandle, &st); // 0 || -1
+    return respond(command, result, &st, sizeof(st));
+}
+
+int handle_tfs_stat_many(parsed_command* command) {
+    size_t count = 0;
+    char const *names[MAX_STAT_PATHS];
+    // all the results, then all the stats
+    struct {
+        int results[MAX_STAT_PATHS];
+        tfs_stat_t stats[MAX_STAT_PATHS];
+    } reply;
+
+    memset(&reply, 0, sizeof(reply));
+    for (size_t pos = 0; count < command->len && pos < command->payload_len; count++) {
+        names[count] = command->payload + pos;
+        pos += strlen(names[count]) + 1;
     }
-    free(command);
-    return 0;
+    if (count < command->len)
+        return respond(command, -1, NULL, 0);
+    tfs_stat_many(names, count, reply.stats, reply.results);
+    memmove((char*)reply.results + count * sizeof(int), reply.stats, count * sizeof(tfs_stat_t));
+    return respond(command, 0, &reply, count * (sizeof(int) + sizeof(tfs_stat_t)));
 }
 
-int handle_tfs_read(parsed_command* command) {
-    int session_id = command->session_id, fhandle = command->fhandle, result; // bytes || -1
-    char *to_read;
+int handle_tfs_put(parsed_command* command) {
+    char *contents = command->payload + strnlen(command->payload, command->payload_len) + 1;
+    ssize_t result = tfs_put(command->payload, contents, command->len, command->flags); // bytes || -1
+    if (result != -1 && atomic_load(&leases_held) > 0)
+        revoke_leases(tfs_lookup(command->payload));
+    return respond(command, result, NULL, 0);
+}
+
+int handle_tfs_get(parsed_command* command) {
+    // on a ring, the reply lands in the slot the path name came in
+    char name[MAX_FILE_NAME + 1];
+    size_t name_len = strnlen(command->payload, command->payload_len);
+    if (name_len > MAX_FILE_NAME)
+        return respond(command, -1, NULL, 0);
+    memcpy(name, command->payload, name_len);
+    name[name_len] = '\0';
+    char *reply = command->reply_buffer;
     size_t len = command->len;
-    free(command);
-    to_read = (char*)malloc(len + 1);
-    result = (int)tfs_read(fhandle, to_read, len);
-    if (try_write(fcli[session_id], to_read, len) < 0) {
-        free(to_read);
-        return -1;
+    if (len > BLOCK_SIZE)
+        len = BLOCK_SIZE;
+    // A lease is granted before the contents are read, so that any write
+    // after them revokes it
+    tfs_lease_t lease = {.inumber = -1, .term_ms = LEASE_TERM_MS};
+    size_t lease_len = 0;
+    if (command->flags & TFS_GET_LEASE) {
+        lease_len = sizeof(lease);
+        int inumber = tfs_lookup(name);
+        if (grant_lease(command->session_id, inumber) == 0)
+            lease.inumber = inumber;
     }
-    free(to_read);
-    if (try_write(fcli[session_id], &result, sizeof(int)) < 0) {
-        return -1;
+    ssize_t result = tfs_get(name, reply + lease_len, len); // bytes || -1
+    if (result == -1)
+        return respond(command, result, NULL, 0);
+    memcpy(reply, &lease, lease_len);
+    return respond(command, result, reply, lease_len + (size_t)result);
+}
+
+int handle_tfs_set_qos(parsed_command* command) {
+    session_t *s = session_get(command->session_id);
+    int result = -1; // 0 || -1
+    // len carries the weight and flags the depth, which can only be lowered
+    if (command->len >= 1 && command->flags >= 1) {
+        pthread_mutex_lock(&queue_lock);
+        s->weight = command->len < MAX_SESSION_WEIGHT ? (int)command->len : MAX_SESSION_WEIGHT;
+        s->depth = command->flags < session_depth ? command->flags : session_depth;
+        pthread_mutex_unlock(&queue_lock);
+        result = 0;
     }
-    return 0;
+    return respond(command, result, NULL, 0);
 }
 
-int handle_tfs_shutdown_after_all_closed(parsed_command* command) {
-    int session_id = command->session_id, result; // 0 || -1
+int handle_tfs_stats(parsed_command* command) {
+    tfs_op_stats_t stats;
+    // flags carries the op code
+    int op_code = command->flags;
+    if (op_code < 1 || op_code >= TFS_OP_CODES)
+        return respond(command, -1, NULL, 0);
 
-    result = tfs_destroy_after_all_closed();
-    if (try_write(fcli[session_id], &result, sizeof(int)) < 0) {
-        free(command);
-        return -1;
+    memset(&stats, 0, sizeof(stats));
+    for (int block = 0; block <= MAX_WORKERS; block++) {
+        // the blocks of workers that were never started are all zeros
+        if (block == num_workers)
+            block = MAX_WORKERS;
+        op_stats_t *s = &op_stats[block][op_code];
+        stats.count += atomic_load_explicit(&s->count, memory_order_relaxed);
+        stats.errors += atomic_load_explicit(&s->errors, memory_order_relaxed);
+        stats.bytes_in += atomic_load_explicit(&s->bytes_in, memory_order_relaxed);
+        stats.bytes_out += atomic_load_explicit(&s->bytes_out, memory_order_relaxed);
+        stats.queue_wait_ns += atomic_load_explicit(&s->queue_wait_ns, memory_order_relaxed);
+        stats.lock_wait_ns += atomic_load_explicit(&s->lock_wait_ns, memory_order_relaxed);
+        stats.metadata_ios += atomic_load_explicit(&s->metadata_ios, memory_order_relaxed);
+        stats.data_ios += atomic_load_explicit(&s->data_ios, memory_order_relaxed);
+        stats.latency_ns += atomic_load_explicit(&s->latency_ns, memory_order_relaxed);
+        for (int i = 0; i < TFS_STATS_BUCKETS; i++)
+            stats.latency[i] += atomic_load_explicit(&s->latency[i], memory_order_relaxed);
     }
+    return respond(command, 0, &stats, sizeof(stats));
+}
+
+int handle_tfs_shutdown_after_all_closed(parsed_command* command) {
+    int result = tfs_destroy_after_all_closed(); // 0 || -1
+    if (respond(command, result, NULL, 0) < 0)
+        return -1;
     if (result == 0) return 1;
-    free(command);
     return 0;
 }
 
-int init_server() {
-    int i;
-    for (i = 0; i < MAX_SESSIONS; i++) {
-        numbers[i] = i;
+/*
+ * Sends a command's response back the way its request came.
+ * Returns 0 if successful, -1 otherwise.
+ */
+int respond(parsed_command *command, int64_t result, void const *payload, size_t payload_len) {
+    session_t *s = session_get(command->session_id);
+    command->failed = result < 0;
+    command->reply_len = payload_len;
+    // counted before the client can see the response, or ask for statistics
+    record_request(command);
+    TRACE_START(start);
+    int sent = 0;
+    if (s->ring == NULL)
+        sent = send_response(s->fcli, command->tag, result, payload, payload_len);
+    else
+        ring_complete(s->ring, command->slot, command->tag, result, payload, payload_len);
+    TRACE_SPAN("reply", start, (int64_t)payload_len);
+    return sent;
+}
+
+/*
+ * Posts a completion, whose payload goes in the given data slot (unless it
+ * was built there already).
+ */
+void ring_complete(tfs_ring_t *ring, uint32_t slot, uint32_t tag, int64_t result, void const *payload, size_t payload_len) {
+    // the client has a free completion for every request it submits
+    uint32_t tail = atomic_load(&ring->cq_tail);
+    tfs_ring_cqe_t *cqe = &ring->cq[tail % TFS_RING_ENTRIES];
+    if (payload_len > 0 && payload != ring->data[slot])
+        memcpy(ring->data[slot], payload, payload_len);
+    cqe->response.result = result;
+    cqe->response.tag = tag;
+    cqe->response.payload_len = (uint32_t)payload_len;
+    cqe->slot = slot;
+    atomic_store(&ring->cq_tail, tail + 1);
+    ring_wake(&ring->cq_tail, &ring->cq_waiting);
+}
+
+/*
+ * Serves a shared-memory session: takes requests off its ring, in order,
+ * handling each in place, until the session is unmounted, the client
+ * disappears or the ring is idle long enough to be parked.
+ */
+void *ring_thread(void *s_id) {
+    int session_id = (int)(intptr_t)s_id;
+    session_t *s = session_get(session_id);
+    tfs_ring_t *ring = s->ring;
+    parsed_command command;
+
+    TRACE_THREAD("ring");
+    while (1) {
+        uint32_t head = atomic_load(&ring->sq_head);
+        while (ring_wait(&ring->sq_tail, head, &ring->sq_waiting, RING_IDLE_CHECK_MS) < 0) {
+            if (kill(ring->client_pid, 0) == -1 && errno == ESRCH) {
+                // the client went away without unmounting
+                close_session(session_id);
+                return NULL;
+            }
+            if (park_ring(s, head))
+                return NULL;
+        }
+
+        /* The client can still write to the ring, so the request is copied
+         * out of it before it is checked, and only the copy is used. Data
+         * written is the exception: nothing in it is checked, so it goes
+         * straight from its slot to a block. Replies are built in the slot. */
+        tfs_request_t request = ring->sq[head % TFS_RING_ENTRIES];
+        command.slot = head % TFS_RING_ENTRIES;
+        command.reply_buffer = ring->data[command.slot];
+        command.payload = command.buffer;
+        if (request.op_code == TFS_OP_CODE_WRITE)
+            command.payload = command.reply_buffer;
+        else if (request.payload_len <= MAX_PAYLOAD_SIZE)
+            memcpy(command.buffer, command.reply_buffer, request.payload_len);
+        command.malformed = 0;
+        command.failed = 0;
+        command.reply_len = 0;
+        clock_gettime(CLOCK_MONOTONIC, &command.received);
+        // handled as soon as it is taken, so it never waits in a queue
+        start_request(&command);
+        request.session_id = session_id;
+        command.session_id = session_id;
+        command.tag = request.tag;
+        TRACE_REQUEST(session_id, request.tag);
+        TRACE_START(start);
+        int result;
+        if (request.payload_len > MAX_PAYLOAD_SIZE || parse_command(&request, &command) < 0 ||
+            command.op_code == TFS_OP_CODE_MOUNT) {
+            command.op_code = request.op_code;
+            command.payload_len = 0;
+            result = respond(&command, -1, NULL, 0);
+        } else {
+            result = handle_request(&command);
+            // the session and its ring are gone
+            if (command.op_code == TFS_OP_CODE_UNMOUNT)
+                return NULL;
+        }
+        TRACE_SPAN("handle", start, command.op_code);
+        TRACE_REQUEST(0, 0);
+        if (result > 0) {
+            // the file system is gone, so is the server
+#ifdef TRACE
+            dump_trace();
+#endif
+            unlink(pipename);
+            unlink(socket_path);
+            exit(0);
+        }
+        atomic_store(&ring->sq_head, head + 1);
+    }
+}
+
+/*
+ * Lets go of the thread of an idle ring, unless a request comes in after
+ * all. Either this thread sees the client's new tail, or the client sees
+ * the ring parked and resumes it.
+ * Returns 1 if the ring was parked, 0 if the thread has to go on.
+ */
+int park_ring(session_t *s, uint32_t head) {
+    tfs_ring_t *ring = s->ring;
+    atomic_store(&ring->sq_parked, 1);
+    // the client that takes the flag back resumes the ring itself
+    if (atomic_load(&ring->sq_tail) != head && atomic_exchange(&ring->sq_parked, 0))
+        return 0;
+    pthread_mutex_lock(&queue_lock);
+    int resumed = s->resume_pending;
+    s->resume_pending = 0;
+    if (!resumed)
+        s->ring_active = 0;
+    pthread_mutex_unlock(&queue_lock);
+    return !resumed;
+}
+
+/*
+ * Starts a thread for a parked ring, which its client found with requests
+ * waiting. If the old thread is still on its way out, it stays instead.
+ */
+void resume_ring(int session_id) {
+    pthread_t thread;
+    pthread_mutex_lock(&queue_lock);
+    session_t *s = NULL;
+    // the id comes from the server's pipe, which anyone can write to
+    if (session_id >= 0 && session_id < session_chunks * SESSION_CHUNK)
+        s = session_get(session_id);
+    int start = s != NULL && s->ring != NULL && !s->ring_active;
+    if (start)
+        s->ring_active = 1;
+    else if (s != NULL && s->ring != NULL)
+        s->resume_pending = 1;
+    pthread_mutex_unlock(&queue_lock);
+    if (!start)
+        return;
+    if (pthread_create(&thread, NULL, ring_thread, (void*)(intptr_t)session_id) == 0) {
+        pthread_detach(thread);
+        return;
+    }
+    pthread_mutex_lock(&queue_lock);
+    s->ring_active = 0;
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/*
+ * Closes the parked rings whose client went away without unmounting, as no
+ * thread of theirs is left to notice. Only the main thread closes parked
+ * rings, as it is the one that resumes them.
+ */
+void reap_sessions() {
+    for (int s_id = 0; s_id < session_chunks * SESSION_CHUNK; s_id++) {
+        pthread_mutex_lock(&queue_lock);
+        session_t *s = session_get(s_id);
+        int parked = s != NULL && s->ring != NULL && !s->ring_active;
+        pthread_mutex_unlock(&queue_lock);
+        if (parked && kill(s->ring->client_pid, 0) == -1 && errno == ESRCH)
+            close_session(s_id);
+    }
+}
+
+/*
+ * Takes a connection to the server's socket, which is a mount by itself: the
+ * client gets its session_id (or -1) right away.
+ * Returns 0 unless the socket can no longer be used.
+ */
+int accept_socket() {
+    int fd;
+    do {
+        fd = accept(fsock, NULL, NULL);
+    } while (fd == -1 && errno == EINTR);
+    if (fd == -1 && (errno == EMFILE || errno == ENFILE) && spare_fd >= 0) {
+        // Out of file descriptors: the spare one makes room to turn the client away
+        perror("accept");
+        release_spare();
+        if ((fd = accept(fsock, NULL, NULL)) >= 0) {
+            send_response(fd, 0, -1, NULL, 0);
+            try_close(fd);
+        }
+        restore_spare();
+        return 0;
+    }
+    if (fd == -1) {
+        if (!transient_error(errno)) {
+            perror("accept");
+            return -1;
+        }
+        if (errno != ECONNABORTED && errno != EAGAIN)
+            perror("accept");
+        return 0;
+    }
+
+    // a mount by itself, so it counts as one
+    parsed_command mount = {.op_code = TFS_OP_CODE_MOUNT};
+    clock_gettime(CLOCK_MONOTONIC, &mount.received);
+    start_request(&mount);
+    int session_id = open_socket_session(fd);
+    if (session_id == -1) {
+        send_response(fd, 0, -1, NULL, 0);
+        try_close(fd);
     }
-    for (i = 0; i < MAX_SESSIONS; i++) {
-        if (pthread_create(&tasks[i], NULL, handle_request, (void*)&(numbers[i]))) return -1;
-        if (pthread_mutex_init(&locks[i], NULL)) return -1;
-        if (pthread_cond_init(&mayWork[i], NULL)) return -1;
-        if (pthread_cond_init(&maySend[i], NULL)) return -1;
-        command_buffer[i] = NULL;
-        busy[i] = 0;
+    mount.failed = session_id == -1;
+    record_request(&mount);
+    return 0;
+}
+
+int init_server(int worker_count, int depth) {
+    if (pthread_mutex_init(&queue_lock, NULL)) return -1;
+    if (pthread_cond_init(&work_ready, NULL)) return -1;
+    if (pthread_cond_init(&session_drained, NULL)) return -1;
+    stopping = 0;
+    session_depth = depth;
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) return -1;
+    session_chunks = 0;
+    free_sessions = -1;
+    ready_head = ready_tail = NULL;
+    active_head = active_tail = NULL;
+    free_commands = NULL;
+    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
+        if (pthread_mutex_init(&leases[i].lock, NULL)) return -1;
+        leases[i].holders = 0;
     }
-    if (pthread_mutex_init(&command_lock, NULL)) return -1;
+    atomic_store(&leases_held, 0);
+    // only once everything they use is initialized
+    for (num_workers = 0; num_workers < worker_count; num_workers++)
+        if (pthread_create(&workers[num_workers], NULL, worker_thread, (void*)(intptr_t)num_workers)) return -1;
     return 0;
 }
 
 int destroy_server() {
-    for (int i = 0; i < MAX_SESSIONS; i++) {
-        if (pthread_mutex_destroy(&command_lock)) return -1;
-        if (pthread_join(tasks[i], NULL)) return -1;
-        if (pthread_mutex_destroy(&locks[i])) return -1;
-        if (pthread_cond_destroy(&mayWork[i])) return -1;
-        if (pthread_cond_destroy(&maySend[i])) return -1;
-    }
+    // the workers finish what was queued, then exit
+    pthread_mutex_lock(&queue_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&work_ready);
+    pthread_mutex_unlock(&queue_lock);
+    for (int i = 0; i < num_workers; i++)
+        if (pthread_join(workers[i], NULL)) return -1;
+    if (try_close(epoll_fd) < 0) return -1;
+    if (pthread_mutex_destroy(&queue_lock)) return -1;
+    if (pthread_cond_destroy(&work_ready)) return -1;
+    if (pthread_cond_destroy(&session_drained)) return -1;
     return 0;
 }
 
@@ -340,7 +1518,7 @@ int try_open(void *pipe, int flags) {
     while (1) {
         o = open(pipe, flags);
         if (o == -1 && errno != EINTR) return -1;
-        else
+        else if (o != -1)
             break;
     }
     return o;
@@ -357,62 +1535,368 @@ int try_close(int fserver) {
     return 0;
 }
 
-int try_read(int fserver, void *buffer, size_t size) {
+/*
+ * Tells whether an error taking a client's connection or opening its pipe
+ * passes, or only concerns that client, instead of ending the server: a
+ * shortage of file descriptors or memory, or a client that went away.
+ */
+int transient_error(int error) {
+    return error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM || error == EAGAIN ||
+           error == ECONNABORTED || error == EPROTO || error == EPERM || error == EINTR;
+}
+
+/*
+ * Gives up the spare file descriptor, for a client to be turned away.
+ */
+void release_spare() {
+    try_close(spare_fd);
+    spare_fd = -1;
+}
+
+/*
+ * Takes a spare file descriptor back, if there is one to take.
+ */
+void restore_spare() {
+    if (spare_fd < 0)
+        spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+int clear_nonblock(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1) return -1;
+    return fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+}
+
+/*
+ * Adds a pipe or socket to the epoll set (op EPOLL_CTL_ADD), or rearms it
+ * (op EPOLL_CTL_MOD). Sessions report a single event each time they are
+ * armed; the server's pipe and socket report all of them.
+ */
+int watch(int fd, int tag, int op) {
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = tag};
+    if (tag >= 0)
+        event.events |= (uint32_t)EPOLLONESHOT;
+    return epoll_ctl(epoll_fd, op, fd, &event);
+}
+
+/*
+ * Reads exactly size bytes from a pipe.
+ * Returns 0 if successful, -1 if the pipe was closed or can't be read.
+ */
+int try_read(int fd, void *buffer, size_t size) {
     ssize_t r = 0;
-    while (1) {
-        r = read(fserver, buffer, size);
-        if (r == -1 && errno != EINTR)
+    size_t done = 0;
+    while (done < size) {
+        r = read(fd, (char*)buffer + done, size - done);
+        if (r == 0 || (r == -1 && errno != EINTR))
             return -1;
-        else if (r == 0) {
-            if (try_close(fserver) < 0) return -1;
-            if ((fserver = try_open(pipename, O_RDONLY)) < 0) return -1;
-        }
-        else
-            break;
+        else if (r > 0)
+            done += (size_t)r;
+    }
+    return 0;
+}
+
+/*
+ * Skips the payload of a request that won't be handled.
+ */
+int discard_payload(int fd, size_t size) {
+    char discard[MAX_PAYLOAD_SIZE];
+    while (size > 0) {
+        size_t n = size < sizeof(discard) ? size : sizeof(discard);
+        if (try_read(fd, discard, n) < 0) return -1;
+        size -= n;
     }
     return 0;
 }
 
-int try_write(int fclient, void *result, size_t size) {
+/*
+ * Sends a response header followed by its payload. Both go out in a single
+ * write, which a pipe keeps contiguous and a socket sends as one message.
+ */
+int send_response(int fclient, uint32_t tag, int64_t result, void const *payload, size_t payload_len) {
+    tfs_response_t response = {
+        .result = result,
+        .tag = tag,
+        .payload_len = (uint32_t)payload_len,
+    };
+    struct iovec iov[2] = {
+        {.iov_base = &response, .iov_len = sizeof(response)},
+        {.iov_base = (void*)payload, .iov_len = payload_len},
+    };
     ssize_t w;
     while (1) {
-        w = write(fclient, result, size);
+        w = writev(fclient, iov, payload_len > 0 ? 2 : 1);
         if (w == -1 && errno != EINTR) return -1;
-        else if (w == 0) return -1;
-        else
+        else if (w != -1)
             break;
     }
+    return w == (ssize_t)(sizeof(response) + payload_len) ? 0 : -1;
+}
+
+/*
+ * Listens on a Unix socket next to the server's pipe, for the clients that
+ * would rather use it.
+ */
+int init_socket() {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(pipename) + strlen(SOCKET_SUFFIX) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(socket_path, pipename);
+    strcat(socket_path, SOCKET_SUFFIX);
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+
+    if ((fsock = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0) return -1;
+    if (bind(fsock, (struct sockaddr*)&addr, sizeof(addr)) < 0) return -1;
+    if (listen(fsock, SOMAXCONN) < 0) return -1;
+    return watch(fsock, SERVER_SOCKET, EPOLL_CTL_ADD);
+}
+
+/*
+ * Finds the session with the given id, which must be taken.
+ */
+session_t *session_get(int session_id) {
+    return session_table[session_id / SESSION_CHUNK]->sessions[session_id % SESSION_CHUNK];
+}
+
+/*
+ * Takes a free session id, with its session cleared.
+ * Returns the session id, or -1 if there are MAX_SESSIONS sessions already.
+ */
+int alloc_session() {
+    pthread_mutex_lock(&queue_lock);
+    if (free_sessions == -1 && grow_sessions() < 0) {
+        pthread_mutex_unlock(&queue_lock);
+        return -1;
+    }
+    int s_id = free_sessions;
+    session_chunk_t *chunk = session_table[s_id / SESSION_CHUNK];
+    free_sessions = chunk->next_free[s_id % SESSION_CHUNK];
+    session_t *s = &chunk->slab[s_id % SESSION_CHUNK];
+    memset(s, 0, sizeof(session_t));
+    s->id = s_id;
+    s->depth = session_depth;
+    s->weight = DEFAULT_SESSION_WEIGHT;
+    chunk->sessions[s_id % SESSION_CHUNK] = s;
+    pthread_mutex_unlock(&queue_lock);
+    return s_id;
+}
+
+/*
+ * Adds a chunk of free ids to the session table. Called with queue_lock
+ * held, once every id is taken.
+ * Returns 0 if successful, -1 otherwise.
+ */
+int grow_sessions() {
+    if (session_chunks == MAX_SESSIONS / SESSION_CHUNK)
+        return -1;
+    session_chunk_t *chunk = calloc(1, sizeof(session_chunk_t));
+    if (chunk == NULL)
+        return -1;
+    // lower ids first
+    for (int i = SESSION_CHUNK - 1; i >= 0; i--) {
+        chunk->next_free[i] = free_sessions;
+        free_sessions = session_chunks * SESSION_CHUNK + i;
+    }
+    session_table[session_chunks++] = chunk;
     return 0;
 }
 
-int try_session() {
-    for (int i = 0; i < MAX_SESSIONS; i++)
-        if (session[i] == NULL)
-            return i;
-    return -1;
+/*
+ * Gives a session's id back, once nothing refers to the session anymore.
+ */
+void free_session(int session_id) {
+    session_chunk_t *chunk = session_table[session_id / SESSION_CHUNK];
+    pthread_mutex_lock(&queue_lock);
+    chunk->sessions[session_id % SESSION_CHUNK] = NULL;
+    chunk->next_free[session_id % SESSION_CHUNK] = free_sessions;
+    free_sessions = session_id;
+    pthread_mutex_unlock(&queue_lock);
 }
 
-int open_session(char* client_pipe_path) {
-    int s_id = try_session();
+/*
+ * Takes a session for a mount over pipes, with its request pipe open. The
+ * client's pipe is opened, and the session watched, once the mount is
+ * answered (see answer_mount).
+ * Returns the session id, or -1 if it can't be opened.
+ */
+int open_session(char* request_pipe_path) {
+    int s_id = alloc_session();
+    if (s_id == -1)
+        return -1;
+    session_t *s = session_get(s_id);
+    s->fcli = -1;
+    // the client only opens its end of the request pipe once it has an answer
+    if ((s->freq = try_open(request_pipe_path, O_RDONLY | O_NONBLOCK)) < 0) {
+        perror(request_pipe_path);
+        free_session(s_id);
+        return -1;
+    }
+    if (clear_nonblock(s->freq) < 0) {
+        try_close(s->freq);
+        free_session(s_id);
+        return -1;
+    }
+    return s_id;
+}
+
+int open_socket_session(int fd) {
+    int s_id = alloc_session();
+    if (s_id == -1)
+        return -1;
+    session_t *s = session_get(s_id);
+    s->fcli = s->freq = fd;
+    s->is_socket = 1;
+    // answered before any request can be read
+    if (send_response(fd, 0, s_id, NULL, 0) < 0 || watch(fd, s_id, EPOLL_CTL_ADD) < 0) {
+        // the caller closes the socket
+        free_session(s_id);
+        return -1;
+    }
+    return s_id;
+}
+
+/*
+ * Maps the ring a client set up and starts serving it. The answer to the
+ * mount goes back through the ring itself, so a ring that can't be mapped
+ * leaves the client to give up waiting.
+ */
+int open_ring_session(char *ring_path, uint32_t tag) {
+    int fd = try_open(ring_path, O_RDWR);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    tfs_ring_t *ring = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size == (off_t)sizeof(tfs_ring_t))
+        ring = mmap(NULL, sizeof(tfs_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    try_close(fd);
+    if (ring == MAP_FAILED)
+        return -1;
+    if (ring->magic != TFS_RING_MAGIC) {
+        munmap(ring, sizeof(tfs_ring_t));
+        return -1;
+    }
+
+    int s_id = alloc_session();
+    pthread_t thread;
     if (s_id != -1) {
-        session[s_id] = client_pipe_path;
-        if ((fcli[s_id] = try_open(client_pipe_path, O_WRONLY)) < 0) {
-            free(client_pipe_path);
-            return -1;
+        session_t *s = session_get(s_id);
+        s->ring = ring;
+        s->ring_active = 1;
+        // answered once the thread is there to take the first request
+        if (pthread_create(&thread, NULL, ring_thread, (void*)(intptr_t)s_id) == 0) {
+            pthread_detach(thread);
+            ring_complete(ring, 0, tag, s_id, NULL, 0);
+            return s_id;
         }
-        return s_id;
+        free_session(s_id);
     }
-    free(client_pipe_path);
+    // No session to serve the ring, but the client still gets its answer
+    ring_complete(ring, 0, tag, -1, NULL, 0);
+    munmap(ring, sizeof(tfs_ring_t));
     return -1;
 }
 
 int close_session(int session_id) {
-    char* client_pipe_path = session[session_id];
-    busy[session_id] = 0;
-    pthread_cond_signal(&maySend[session_id]);
-    session[session_id] = NULL;
-    if (try_close(fcli[session_id]) < 0) return -1;
-    unlink(client_pipe_path);
-    free(client_pipe_path);
-    return 0;
-}
\ No newline at end of file
+    session_t *s = session_get(session_id);
+    int result = 0;
+    // nothing is sent to the session's pipe after it is closed
+    drop_leases(session_id);
+    if (s->ring != NULL) {
+        if (munmap(s->ring, sizeof(tfs_ring_t)) < 0) result = -1;
+    } else {
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s->freq, NULL) < 0) result = -1;
+        if (try_close(s->freq) < 0) result = -1;
+        if (!s->is_socket && try_close(s->fcli) < 0) result = -1;
+    }
+    // only now can the id be taken by another mount
+    free_session(session_id);
+    return result;
+}
+
+/*
+ * Records a lease of the session on a file, or renews the one it has,
+ * forgetting the leases that ran out on the way.
+ * Returns 0 if successful, -1 if the session can't hold one.
+ */
+int grant_lease(int session_id, int inumber) {
+    struct timespec now;
+    if (inumber < 0 || inumber >= INODE_TABLE_SIZE || session_get(session_id)->ring != NULL)
+        return -1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    lease_t *lease = &leases[inumber];
+    pthread_mutex_lock(&lease->lock);
+    int slot = -1;
+    for (int i = 0; i < lease->holders;) {
+        struct timespec *expires = &lease->holder[i].expires;
+        if (expires->tv_sec < now.tv_sec || (expires->tv_sec == now.tv_sec && expires->tv_nsec <= now.tv_nsec)) {
+            lease->holder[i] = lease->holder[--lease->holders];
+            atomic_fetch_sub(&leases_held, 1);
+            continue;
+        }
+        if (lease->holder[i].session_id == session_id)
+            slot = i;
+        i++;
+    }
+    if (slot == -1 && lease->holders < MAX_LEASE_HOLDERS) {
+        slot = lease->holders++;
+        atomic_fetch_add(&leases_held, 1);
+    }
+    if (slot != -1) {
+        lease->holder[slot].session_id = session_id;
+        lease->holder[slot].expires.tv_sec = now.tv_sec + LEASE_TERM_MS / 1000;
+        lease->holder[slot].expires.tv_nsec = now.tv_nsec + (long)(LEASE_TERM_MS % 1000) * 1000000L;
+        if (lease->holder[slot].expires.tv_nsec >= 1000000000L) {
+            lease->holder[slot].expires.tv_sec++;
+            lease->holder[slot].expires.tv_nsec -= 1000000000L;
+        }
+    }
+    pthread_mutex_unlock(&lease->lock);
+    return slot == -1 ? -1 : 0;
+}
+
+/*
+ * Tells the holders of the leases on a file, if any, that their cached
+ * contents are stale (the ones whose lease ran out don't need telling, but
+ * it does no harm either).
+ */
+void revoke_leases(int inumber) {
+    if (inumber < 0 || inumber >= INODE_TABLE_SIZE)
+        return;
+    lease_t *lease = &leases[inumber];
+    pthread_mutex_lock(&lease->lock);
+    for (int i = 0; i < lease->holders; i++)
+        send_response(session_get(lease->holder[i].session_id)->fcli, TFS_REVOKE_TAG, inumber, NULL, 0);
+    atomic_fetch_sub(&leases_held, lease->holders);
+    lease->holders = 0;
+    pthread_mutex_unlock(&lease->lock);
+}
+
+/*
+ * Gets the file an open file handle refers to, once it has been changed,
+ * if any file is leased at all.
+ * Returns the inumber of the file, -1 if there is no lease to revoke.
+ */
+int leased_file(int fhandle) {
+    if (atomic_load(&leases_held) == 0)
+        return -1;
+    return tfs_inumber(fhandle);
+}
+
+/*
+ * Forgets the leases of a session that is going away.
+ */
+void drop_leases(int session_id) {
+    for (int inumber = 0; inumber < INODE_TABLE_SIZE && atomic_load(&leases_held) > 0; inumber++) {
+        lease_t *lease = &leases[inumber];
+        pthread_mutex_lock(&lease->lock);
+        for (int i = 0; i < lease->holders;) {
+            if (lease->holder[i].session_id == session_id) {
+                lease->holder[i] = lease->holder[--lease->holders];
+                atomic_fetch_sub(&leases_held, 1);
+            } else
+                i++;
+        }
+        pthread_mutex_unlock(&lease->lock);
+    }
+}
@@ -0,0 +1,166 @@
+#include "trace.h"
+
+#ifdef TRACE
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    uint64_t ts_ns; // when it started
+    uint64_t dur_ns; // of a span
+    char const *name;
+    uint64_t request; // session_id << 32 | tag, 0 for none
+    int64_t arg;
+    char phase;
+} trace_event_t;
+
+/* A thread's events. Only the thread writes to it, and head is only
+ * published once the event it counts is written. */
+typedef struct {
+    _Atomic uint64_t head; // events ever recorded, the last TRACE_EVENTS kept
+    char const *_Atomic name;
+    trace_event_t events[TRACE_EVENTS];
+} trace_ring_t;
+
+static trace_ring_t *_Atomic rings[MAX_TRACE_THREADS];
+static _Atomic int ring_count = 0;
+
+static _Thread_local trace_ring_t *ring = NULL;
+// set once the thread found no ring left for it
+static _Thread_local int untraced = 0;
+static _Thread_local uint64_t request = 0;
+
+// one of them, merged with its thread's number for sorting
+typedef struct {
+    trace_event_t event;
+    int tid;
+} dumped_event_t;
+
+uint64_t trace_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+/*
+ * Gets the calling thread's ring, the first time allocating it.
+ * Returns NULL if the thread can't be traced.
+ */
+static trace_ring_t *own_ring() {
+    if (ring != NULL || untraced)
+        return ring;
+    int tid = atomic_fetch_add(&ring_count, 1);
+    if (tid >= MAX_TRACE_THREADS || (ring = calloc(1, sizeof(trace_ring_t))) == NULL) {
+        untraced = 1;
+        return NULL;
+    }
+    atomic_store_explicit(&rings[tid], ring, memory_order_release);
+    return ring;
+}
+
+void trace_event(char phase, char const *name, uint64_t start, int64_t arg) {
+    trace_ring_t *r = own_ring();
+    if (r == NULL)
+        return;
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    r->events[head % TRACE_EVENTS] = (trace_event_t){
+        .ts_ns = start,
+        .dur_ns = phase == 'X' ? trace_now() - start : 0,
+        .name = name,
+        .request = request,
+        .arg = arg,
+        .phase = phase,
+    };
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+void trace_request(int session_id, uint32_t tag) {
+    request = (uint64_t)(uint32_t)session_id << 32 | tag;
+}
+
+void trace_thread(char const *name) {
+    trace_ring_t *r = own_ring();
+    if (r != NULL)
+        atomic_store_explicit(&r->name, name, memory_order_relaxed);
+}
+
+static int compare_events(void const *a, void const *b) {
+    uint64_t x = ((dumped_event_t const *)a)->event.ts_ns, y = ((dumped_event_t const *)b)->event.ts_ns;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Copies the events a ring still holds. Those the thread may have started
+ * to overwrite meanwhile are dropped.
+ * Returns how many were copied.
+ */
+static size_t copy_ring(trace_ring_t *r, int tid, dumped_event_t *out) {
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    uint64_t first = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+    for (uint64_t i = first; i < head; i++)
+        out[i - first] = (dumped_event_t){.event = r->events[i % TRACE_EVENTS], .tid = tid};
+    atomic_thread_fence(memory_order_acquire);
+    // the slot of the next event is the one of the oldest copied
+    uint64_t now_head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint64_t overwritten = now_head + 1 > first + TRACE_EVENTS ? now_head + 1 - TRACE_EVENTS - first : 0;
+    if (overwritten >= head - first)
+        return 0;
+    for (uint64_t i = 0; i < head - first - overwritten; i++)
+        out[i] = out[i + overwritten];
+    return (size_t)(head - first - overwritten);
+}
+
+int trace_dump(char const *path) {
+    int threads = atomic_load(&ring_count);
+    if (threads > MAX_TRACE_THREADS)
+        threads = MAX_TRACE_THREADS;
+    dumped_event_t *events = malloc(((size_t)threads * TRACE_EVENTS + 1) * sizeof(dumped_event_t));
+    FILE *out = fopen(path, "w");
+    if (events == NULL || out == NULL) {
+        free(events);
+        if (out != NULL)
+            fclose(out);
+        return -1;
+    }
+
+    int pid = (int)getpid();
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    size_t count = 0;
+    for (int tid = 0; tid < threads; tid++) {
+        trace_ring_t *r = atomic_load_explicit(&rings[tid], memory_order_acquire);
+        if (r == NULL)
+            continue;
+        char const *name = atomic_load_explicit(&r->name, memory_order_relaxed);
+        fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s-%d\"}},\n",
+                pid, tid, name != NULL ? name : "thread", tid);
+        count += copy_ring(r, tid, events + count);
+    }
+    qsort(events, count, sizeof(dumped_event_t), compare_events);
+
+    for (size_t i = 0; i < count; i++) {
+        trace_event_t const *e = &events[i].event;
+        fprintf(out, "{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f", e->name, e->phase, pid,
+                events[i].tid, (double)e->ts_ns / 1000.0);
+        if (e->phase == 'X')
+            fprintf(out, ",\"dur\":%.3f", (double)e->dur_ns / 1000.0);
+        else if (e->phase == 's' || e->phase == 'f')
+            // binds to the span the flow ends in, not the next one
+            fprintf(out, ",\"cat\":\"request\",\"id\":\"0x%" PRIx64 "\"%s", e->request,
+                    e->phase == 'f' ? ",\"bp\":\"e\"" : "");
+        fprintf(out, ",\"args\":{\"request\":\"%u:%u\",\"arg\":%" PRId64 "}},\n", (unsigned)(e->request >> 32),
+                (unsigned)(e->request & UINT32_MAX), e->arg);
+    }
+    // the format allows no trailing comma
+    fprintf(out, "{\"name\":\"trace_end\",\"ph\":\"i\",\"s\":\"g\",\"pid\":%d,\"tid\":0,\"ts\":%.3f}\n]}\n", pid,
+            (double)trace_now() / 1000.0);
+    free(events);
+    return fclose(out) == 0 ? 0 : -1;
+}
+
+#endif // TRACE
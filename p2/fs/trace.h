@@ -0,0 +1,70 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Built with TRACE defined (make TRACE=yes), the server and the file system
+ * record what each thread does in a ring of its own, that keeps its last
+ * TRACE_EVENTS events. Recording takes no lock: only the thread writes to
+ * its ring. trace_dump merges the rings into a JSON file that chrome://tracing
+ * and Perfetto open, with every event tagged with the request the thread was
+ * handling, and arrows from where a request was read to where it was
+ * handled. Built without it, the macros below are no-ops.
+ */
+#ifdef TRACE
+
+// the name of a span or flow is a string literal, as only the pointer is kept
+#define TRACE_START(start) uint64_t start = trace_now()
+#define TRACE_SPAN(name, start, arg) trace_event('X', name, start, arg)
+#define TRACE_BEGIN(name) trace_event('B', name, trace_now(), 0)
+#define TRACE_END(name) trace_event('E', name, trace_now(), 0)
+#define TRACE_FLOW_START(name) trace_event('s', name, trace_now(), 0)
+#define TRACE_FLOW_END(name) trace_event('f', name, trace_now(), 0)
+#define TRACE_REQUEST(session_id, tag) trace_request(session_id, tag)
+#define TRACE_THREAD(name) trace_thread(name)
+#define TRACE_DUMP(path) trace_dump(path)
+
+uint64_t trace_now();
+
+/*
+ * Records an event of the calling thread: a span that started at start and
+ * ends now ('X'), the beginning ('B') or end ('E') of a span at start, for
+ * those that begin in a function and end in another, or the start ('s') or
+ * end ('f') of a request's flow from one thread to another, at start. arg
+ * is shown along with it.
+ */
+void trace_event(char phase, char const *name, uint64_t start, int64_t arg);
+
+/*
+ * Tags the calling thread's next events with a request (0, 0 for none)
+ */
+void trace_request(int session_id, uint32_t tag);
+
+/*
+ * Names the calling thread in the trace
+ */
+void trace_thread(char const *name);
+
+/*
+ * Writes every thread's events, in the Trace Event Format, to a file.
+ * Events being overwritten while it copies them are left out.
+ * Returns 0 if successful, -1 otherwise.
+ */
+int trace_dump(char const *path);
+
+#else
+
+#define TRACE_START(start)
+#define TRACE_SPAN(name, start, arg) ((void)0)
+#define TRACE_BEGIN(name) ((void)0)
+#define TRACE_END(name) ((void)0)
+#define TRACE_FLOW_START(name) ((void)0)
+#define TRACE_FLOW_END(name) ((void)0)
+#define TRACE_REQUEST(session_id, tag) ((void)0)
+#define TRACE_THREAD(name) ((void)0)
+#define TRACE_DUMP(path) ((void)0)
+
+#endif // TRACE
+
+#endif // TRACE_H
@@ -0,0 +1,179 @@
+#include "../client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/*  Keeps several opens, writes and reads in flight at once from a single
+    thread, collecting some with tfs_wait/tfs_poll and some through
+    callbacks, with synchronous calls mixed in between, and checks that the
+    requests on a file handle run in the order they are made. Over the
+    server's pipe, it runs over shared memory as well. */
+
+#define FILES (4)
+// each file is opened several times, for more requests in flight than MAX_IN_FLIGHT
+#define OPENS (FILES * 3)
+// writes in flight on a single handle, more than MAX_IN_FLIGHT
+#define CHUNKS (MAX_IN_FLIGHT * 2)
+#define CHUNK_SIZE (64)
+
+static atomic_int completed;
+static ssize_t callback_results[FILES];
+
+static void on_complete(int handle, ssize_t result, void *arg) {
+    (void)handle;
+    callback_results[(int)(size_t)arg] = result;
+    atomic_fetch_add(&completed, 1);
+}
+
+static void run(char const *name_prefix) {
+    char names[FILES][MAX_FILE_NAME];
+    char data[FILES][BLOCK_SIZE / 4];
+    char buffers[OPENS][BLOCK_SIZE];
+    int handles[OPENS];
+    int fhandles[OPENS];
+    ssize_t result;
+
+    for (int i = 0; i < FILES; i++) {
+        snprintf(names[i], MAX_FILE_NAME, "/%s%d", name_prefix, i);
+        memset(data[i], 'a' + i, sizeof(data[i]));
+    }
+
+    // Opens, collected with tfs_wait
+    for (int i = 0; i < OPENS; i++) {
+        handles[i] = tfs_open_async(names[i % FILES], TFS_O_CREAT | TFS_O_TRUNC, NULL, NULL);
+        assert(handles[i] != -1);
+    }
+    for (int i = 0; i < OPENS; i++) {
+        assert(tfs_wait(handles[i], &result) == 0);
+        assert(result != -1);
+        fhandles[i] = (int)result;
+        // collected already
+        assert(tfs_poll(handles[i], &result) == -1);
+    }
+
+    // Writes through each file's first handle, completed through callbacks,
+    // each of a different length
+    atomic_store(&completed, 0);
+    for (int i = 0; i < FILES; i++)
+        assert(tfs_write_async(fhandles[i], data[i], sizeof(data[i]) - (size_t)i, on_complete,
+                               (void*)(size_t)i) != -1);
+    struct timespec nap = {.tv_nsec = 100000};
+    while (atomic_load(&completed) < FILES)
+        nanosleep(&nap, NULL);
+    for (int i = 0; i < FILES; i++)
+        assert(callback_results[i] == (ssize_t)(sizeof(data[i]) - (size_t)i));
+
+    // Synchronous calls still work alongside the I/O thread
+    for (int i = 0; i < FILES; i++)
+        assert(tfs_lseek(fhandles[i], 0, TFS_SEEK_SET) == 0);
+
+    // Reads through every handle, collected with tfs_poll
+    for (int i = 0; i < OPENS; i++) {
+        memset(buffers[i], 0, sizeof(buffers[i]));
+        handles[i] = tfs_read_async(fhandles[i], buffers[i], sizeof(buffers[i]), NULL, NULL);
+        assert(handles[i] != -1);
+    }
+    int pending = OPENS;
+    while (pending > 0) {
+        for (int i = 0; i < OPENS; i++) {
+            if (handles[i] == -1)
+                continue;
+            int done = tfs_poll(handles[i], &result);
+            assert(done != -1);
+            if (done) {
+                int f = i % FILES;
+                assert(result == (ssize_t)(sizeof(data[f]) - (size_t)f));
+                assert(memcmp(buffers[i], data[f], (size_t)result) == 0);
+                handles[i] = -1;
+                pending--;
+            }
+        }
+    }
+
+    // A read that fails completes too
+    handles[0] = tfs_read_async(-1, buffers[0], sizeof(buffers[0]), NULL, NULL);
+    assert(handles[0] != -1);
+    assert(tfs_wait(handles[0], &result) == 0);
+    assert(result == -1);
+    // unknown handles
+    assert(tfs_poll(-1, &result) == -1);
+    assert(tfs_wait(MAX_ASYNC_REQUESTS, &result) == -1);
+
+    for (int i = 0; i < OPENS; i++)
+        assert(tfs_close(fhandles[i]) != -1);
+}
+
+static void run_ordered(char const *name_prefix) {
+    char name[MAX_FILE_NAME];
+    char chunks[CHUNKS][CHUNK_SIZE];
+    char contents[CHUNKS * CHUNK_SIZE];
+    int handles[CHUNKS];
+    ssize_t result;
+
+    snprintf(name, MAX_FILE_NAME, "/%sordered", name_prefix);
+    int fhandle = tfs_open(name, TFS_O_CREAT);
+    assert(fhandle != -1);
+
+    // Writes on one handle, back to back, land one after the other
+    for (int i = 0; i < CHUNKS; i++) {
+        memset(chunks[i], 'A' + i, CHUNK_SIZE);
+        handles[i] = tfs_write_async(fhandle, chunks[i], CHUNK_SIZE, NULL, NULL);
+        assert(handles[i] != -1);
+    }
+    // and a synchronous call on the handle runs after them, without waiting
+    // for them first
+    assert(tfs_lseek(fhandle, 0, TFS_SEEK_SET) == 0);
+    for (int i = 0; i < CHUNKS; i++) {
+        assert(tfs_poll(handles[i], &result) == 1);
+        assert(result == CHUNK_SIZE);
+    }
+    assert(tfs_read(fhandle, contents, sizeof(contents)) == sizeof(contents));
+    for (int i = 0; i < CHUNKS; i++)
+        assert(memcmp(contents + i * CHUNK_SIZE, chunks[i], CHUNK_SIZE) == 0);
+
+    // Reads on one handle, back to back, go through the file in order
+    assert(tfs_lseek(fhandle, 0, TFS_SEEK_SET) == 0);
+    for (int i = 0; i < CHUNKS; i++) {
+        handles[i] = tfs_read_async(fhandle, contents + i * CHUNK_SIZE, CHUNK_SIZE, NULL, NULL);
+        assert(handles[i] != -1);
+    }
+    for (int i = 0; i < CHUNKS; i++) {
+        assert(tfs_wait(handles[i], &result) == 0);
+        assert(result == CHUNK_SIZE);
+        assert(memcmp(contents + i * CHUNK_SIZE, chunks[i], CHUNK_SIZE) == 0);
+    }
+
+    assert(tfs_close(fhandle) != -1);
+}
+
+int main(int argc, char **argv) {
+
+    char ring_path[MAX_PATH_NAME];
+    struct stat st;
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path'\n");
+        return 1;
+    }
+
+    assert(tfs_mount(argv[1], argv[2]) == 0);
+    run("async");
+    run_ordered("async");
+    assert(tfs_unmount() == 0);
+
+    if (stat(argv[2], &st) == 0 && S_ISFIFO(st.st_mode)) {
+        snprintf(ring_path, sizeof(ring_path), "%s.ring", argv[1]);
+        assert(tfs_mount_shm(ring_path, argv[2]) == 0);
+        run("async");
+        run_ordered("async");
+        assert(tfs_unmount() == 0);
+    }
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,89 @@
+#include "../client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*  Many more clients than workers stay mounted at once, mostly idle, and
+    all of them are still served once they wake up. Over the server's pipe,
+    one of them works over shared memory and stays idle long enough for the
+    server to park its ring, which its next request has to resume. */
+
+#define CLIENTS (64)
+// fewer files than clients, which write the same to the ones they share
+#define FILES (4)
+// longer than a ring is left waiting before it is parked
+#define IDLE_SECONDS (3)
+
+static void client(char const *client_path, char const *server_pipe, int id, int mounted, int go) {
+    char path[MAX_PATH_NAME + 1];
+    char record[16], buffer[16];
+    struct stat st;
+    // shared memory is mounted through the server's pipe, not its socket
+    int shm = id == 0 && stat(server_pipe, &st) == 0 && S_ISFIFO(st.st_mode);
+
+    snprintf(path, sizeof(path), "%s.%d", client_path, id);
+    if (shm)
+        assert(tfs_mount_shm(path, server_pipe) == 0);
+    else
+        assert(tfs_mount(path, server_pipe) == 0);
+
+    // everyone is mounted before anyone goes on
+    assert(write(mounted, "m", 1) == 1);
+    while (read(go, buffer, 1) > 0)
+        ;
+    if (shm)
+        sleep(IDLE_SECONDS);
+
+    int len = snprintf(record, sizeof(record), "/idle%d", id % FILES);
+    assert(tfs_put(record, record, (size_t)len, TFS_O_CREAT | TFS_O_TRUNC) == len);
+    assert(tfs_get(record, buffer, sizeof(buffer)) == len);
+    assert(memcmp(buffer, record, (size_t)len) == 0);
+
+    assert(tfs_unmount() == 0);
+}
+
+int main(int argc, char **argv) {
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_path "
+               "server_pipe_path'\n");
+        return 1;
+    }
+
+    int mounted[2], go[2];
+    assert(pipe(mounted) == 0 && pipe(go) == 0);
+
+    pid_t pids[CLIENTS];
+    for (int i = 0; i < CLIENTS; i++) {
+        pids[i] = fork();
+        assert(pids[i] != -1);
+        if (pids[i] == 0) {
+            close(mounted[0]);
+            close(go[1]);
+            client(argv[1], argv[2], i, mounted[1], go[0]);
+            return 0;
+        }
+    }
+    close(mounted[1]);
+    close(go[0]);
+
+    char c;
+    for (int i = 0; i < CLIENTS; i++)
+        assert(read(mounted[0], &c, 1) == 1);
+    // lets them all go at once
+    close(go[1]);
+
+    for (int i = 0; i < CLIENTS; i++) {
+        int status;
+        assert(waitpid(pids[i], &status, 0) == pids[i]);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,121 @@
+#include "../client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*  Gets a file over and over, which the client caches under a lease, while
+    the file changes in every way that revokes the lease: through another
+    session (in a process of its own, done before the next get) and through
+    the same one. Every get must see the latest contents. */
+
+#define PATH "/lease"
+
+static char const *client_pipe, *server_pipe;
+
+// runs in another session what each step does to the file
+static void in_other_session(int step) {
+    char pipe_path[MAX_PATH_NAME + 1];
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid > 0) {
+        int status;
+        assert(waitpid(pid, &status, 0) == pid);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        return;
+    }
+
+    snprintf(pipe_path, sizeof(pipe_path), "%s.other", client_pipe);
+    assert(tfs_mount(pipe_path, server_pipe) == 0);
+    int f;
+    switch (step) {
+        case 0:
+            assert(tfs_put(PATH, "world!", 6, TFS_O_TRUNC) == 6);
+            break;
+        case 1:
+            f = tfs_open(PATH, 0);
+            assert(f != -1);
+            assert(tfs_write(f, "J", 1) == 1);
+            assert(tfs_close(f) != -1);
+            break;
+        case 2:
+            f = tfs_open(PATH, 0);
+            assert(f != -1);
+            assert(tfs_truncate(f, 3) == 0);
+            assert(tfs_close(f) != -1);
+            break;
+        case 3:
+            f = tfs_open(PATH, TFS_O_TRUNC);
+            assert(f != -1);
+            assert(tfs_close(f) != -1);
+            break;
+        default:
+            assert(0);
+    }
+    assert(tfs_unmount() == 0);
+    _exit(0);
+}
+
+static void expect(char const *contents) {
+    char buffer[BLOCK_SIZE];
+    size_t len = strlen(contents);
+    // more than once, as the later ones are served from the cache
+    for (int i = 0; i < 3; i++) {
+        assert(tfs_get(PATH, buffer, sizeof(buffer)) == (ssize_t)len);
+        assert(memcmp(buffer, contents, len) == 0);
+    }
+    // shorter than the file
+    if (len > 1) {
+        memset(buffer, 0, sizeof(buffer));
+        assert(tfs_get(PATH, buffer, 1) == 1);
+        assert(buffer[0] == contents[0] && buffer[1] == 0);
+    }
+}
+
+int main(int argc, char **argv) {
+
+    char buffer[BLOCK_SIZE];
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path'\n");
+        return 1;
+    }
+    client_pipe = argv[1];
+    server_pipe = argv[2];
+
+    assert(tfs_mount(client_pipe, server_pipe) == 0);
+    assert(tfs_get("/none", buffer, sizeof(buffer)) == -1);
+    assert(tfs_put(PATH, "hello", 5, TFS_O_CREAT | TFS_O_TRUNC) == 5);
+    expect("hello");
+
+    // Changed by another session
+    in_other_session(0);
+    expect("world!");
+    in_other_session(1);
+    expect("Jorld!");
+    in_other_session(2);
+    expect("Jor");
+    in_other_session(3);
+    expect("");
+
+    // Changed by this very session
+    assert(tfs_put(PATH, "again", 5, 0) == 5);
+    expect("again");
+    int f = tfs_open(PATH, 0);
+    assert(f != -1);
+    assert(tfs_lseek(f, 0, TFS_SEEK_END) == 5);
+    assert(tfs_write(f, "!", 1) == 1);
+    expect("again!");
+    assert(tfs_truncate(f, 2) == 0);
+    expect("ag");
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_unmount() == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
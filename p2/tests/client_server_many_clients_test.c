@@ -0,0 +1,66 @@
+#include "../client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*  Several clients, each in its own process and session, work on their own
+    files at the same time. Each client's requests must still be handled in
+    the order they were sent. */
+
+#define CLIENTS (4)
+#define ROUNDS (50)
+
+static void client(char const *client_pipe, char const *server_pipe, int id) {
+    char pipe_path[MAX_PATH_NAME + 1];
+    char path[MAX_FILE_NAME];
+    char record[16], buffer[16];
+
+    snprintf(pipe_path, sizeof(pipe_path), "%s.%d", client_pipe, id);
+    snprintf(path, sizeof(path), "/c%d", id);
+    assert(tfs_mount(pipe_path, server_pipe) == 0);
+
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    for (int i = 0; i < ROUNDS; i++) {
+        int len = snprintf(record, sizeof(record), "%d:%d", id, i);
+        assert(tfs_lseek(f, 0, TFS_SEEK_SET) == 0);
+        assert(tfs_write(f, record, (size_t)len) == len);
+        assert(tfs_lseek(f, 0, TFS_SEEK_SET) == 0);
+        assert(tfs_read(f, buffer, (size_t)len) == len);
+        assert(memcmp(buffer, record, (size_t)len) == 0);
+    }
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_unmount() == 0);
+}
+
+int main(int argc, char **argv) {
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path'\n");
+        return 1;
+    }
+
+    pid_t pids[CLIENTS];
+    for (int i = 0; i < CLIENTS; i++) {
+        pids[i] = fork();
+        assert(pids[i] != -1);
+        if (pids[i] == 0) {
+            client(argv[1], argv[2], i);
+            return 0;
+        }
+    }
+    for (int i = 0; i < CLIENTS; i++) {
+        int status;
+        assert(waitpid(pids[i], &status, 0) == pids[i]);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    printf("Successful test.\n");
+
+    return 0;
+}
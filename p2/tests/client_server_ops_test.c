@@ -0,0 +1,63 @@
+#include "../client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Goes through the requests beyond open/read/write/close, checking that
+    each one's arguments and results make it across the client-server
+    protocol. */
+
+int main(int argc, char **argv) {
+
+    char const *names[] = {"/f1", "/f2", "/f1"};
+    char buffer[40];
+    tfs_stat_t st, stats[3];
+    int results[3];
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path'\n");
+        return 1;
+    }
+    assert(tfs_mount(argv[1], argv[2]) == 0);
+
+    int f = tfs_open(names[0], TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_fallocate(f, 0, 10) == 0);
+    assert(tfs_write(f, "hello", 5) == 5);
+
+    assert(tfs_lseek(f, -4, TFS_SEEK_END) == 1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 4);
+    assert(memcmp(buffer, "ello", 4) == 0);
+
+    assert(tfs_truncate(f, 3) == 0);
+    assert(tfs_fstat(f, &st) == 0);
+    assert(st.st_type == TFS_T_FILE && st.st_size == 3 && st.st_blocks == 1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_fstat(-1, &st) == -1);
+
+    assert(tfs_stat(names[0], &st) == 0 && st.st_size == 3);
+    assert(tfs_stat_many(names, 3, stats, results) == 0);
+    assert(results[0] == 0 && results[1] == -1 && results[2] == 0);
+    assert(stats[2].st_size == 3);
+
+    /* Whole-file requests */
+    assert(tfs_put("/f3", "abc", 3, TFS_O_CREAT | TFS_O_TRUNC) == 3);
+    assert(tfs_put("/f3", "de", 2, TFS_O_APPEND) == 2);
+    assert(tfs_get("/f3", buffer, sizeof(buffer)) == 5);
+    assert(memcmp(buffer, "abcde", 5) == 0);
+    assert(tfs_get("/f3", buffer, 2) == 2);
+    assert(tfs_put("/f4", "x", 1, 0) == -1);
+    assert(tfs_get("/f4", buffer, sizeof(buffer)) == -1);
+
+    /* A heavier, shallower session still gets its answers */
+    assert(tfs_set_qos(0, 1) == -1);
+    assert(tfs_set_qos(4, 1) == 0);
+    assert(tfs_get("/f3", buffer, sizeof(buffer)) == 5);
+
+    assert(tfs_unmount() == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,59 @@
+#include "../client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Stats more paths than fit in a request, so that several requests are in
+    flight at once and may be answered out of order; each result must still
+    land in its own place. */
+
+#define FILES (10)
+#define PATHS (MAX_STAT_PATHS * MAX_IN_FLIGHT * 2 + 7)
+
+int main(int argc, char **argv) {
+
+    char storage[PATHS][MAX_FILE_NAME];
+    char const *names[PATHS];
+    tfs_stat_t stats[PATHS];
+    int results[PATHS];
+    char data[FILES];
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path'\n");
+        return 1;
+    }
+    assert(tfs_mount(argv[1], argv[2]) == 0);
+
+    memset(data, 'p', sizeof(data));
+    for (int i = 0; i < FILES; i++) {
+        snprintf(storage[i], MAX_FILE_NAME, "/pipe%d", i);
+        int f = tfs_open(storage[i], TFS_O_CREAT | TFS_O_TRUNC);
+        assert(f != -1);
+        assert(tfs_write(f, data, (size_t)i + 1) == i + 1);
+        assert(tfs_close(f) != -1);
+    }
+
+    // every other path is missing
+    for (int i = 0; i < PATHS; i++) {
+        if (i % 2 == 0)
+            snprintf(storage[i], MAX_FILE_NAME, "/pipe%d", (i / 2) % FILES);
+        else
+            snprintf(storage[i], MAX_FILE_NAME, "/none%d", i);
+        names[i] = storage[i];
+    }
+    assert(tfs_stat_many(names, PATHS, stats, results) == 0);
+    for (int i = 0; i < PATHS; i++) {
+        if (i % 2 == 0) {
+            assert(results[i] == 0);
+            assert(stats[i].st_size == (size_t)((i / 2) % FILES + 1));
+        } else
+            assert(results[i] == -1);
+    }
+
+    assert(tfs_unmount() == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,129 @@
+#include "../client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Spreads files over several servers and checks that each file lives in a
+    single one, that the same servers (in any order) find the same files,
+    and that file handles, tfs_stat_many and asynchronous requests reach the
+    server that holds each file. */
+
+#define FILES (12)
+
+static char names[FILES][MAX_FILE_NAME];
+
+static void expect_contents(int i) {
+    char buffer[BLOCK_SIZE];
+    ssize_t len = tfs_get(names[i], buffer, sizeof(buffer));
+    assert(len == (ssize_t)strlen(names[i]));
+    assert(memcmp(buffer, names[i], (size_t)len) == 0);
+}
+
+int main(int argc, char **argv) {
+
+    char const *servers[MAX_SERVERS];
+    char const *reversed[MAX_SERVERS];
+    char const *missing = "/no_such_shard";
+    char buffer[BLOCK_SIZE];
+    int fhandles[FILES];
+
+    if (argc < 4) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path server_pipe_path...'\n");
+        return 1;
+    }
+    int count = argc - 2;
+    assert(count <= MAX_SERVERS);
+    for (int i = 0; i < count; i++) {
+        servers[i] = argv[2 + i];
+        reversed[count - 1 - i] = argv[2 + i];
+    }
+    for (int i = 0; i < FILES; i++)
+        snprintf(names[i], MAX_FILE_NAME, "/shard%d", i);
+
+    assert(tfs_mount_sharded(argv[1], servers, count) == 0);
+    for (int i = 0; i < FILES; i++)
+        assert(tfs_put(names[i], names[i], strlen(names[i]), TFS_O_CREAT | TFS_O_TRUNC) ==
+               (ssize_t)strlen(names[i]));
+
+    // Handles of different servers don't get mixed up
+    for (int i = 0; i < FILES; i++) {
+        fhandles[i] = tfs_open(names[i], TFS_O_APPEND);
+        assert(fhandles[i] != -1);
+        for (int j = 0; j < i; j++)
+            assert(fhandles[j] != fhandles[i]);
+    }
+    for (int i = 0; i < FILES; i++)
+        assert(tfs_write(fhandles[i], "!", 1) == 1);
+    for (int i = 0; i < FILES; i++) {
+        size_t len = strlen(names[i]);
+        tfs_stat_t st;
+        assert(tfs_fstat(fhandles[i], &st) == 0);
+        assert(st.st_size == len + 1);
+        assert(tfs_lseek(fhandles[i], 0, TFS_SEEK_SET) == 0);
+        assert(tfs_read(fhandles[i], buffer, sizeof(buffer)) == (ssize_t)len + 1);
+        assert(memcmp(buffer, names[i], len) == 0 && buffer[len] == '!');
+        assert(tfs_truncate(fhandles[i], len) == 0);
+    }
+
+    // Asynchronous requests too
+    int handles[FILES];
+    ssize_t result;
+    for (int i = 0; i < FILES; i++) {
+        assert(tfs_lseek(fhandles[i], 0, TFS_SEEK_SET) == 0);
+        handles[i] = tfs_read_async(fhandles[i], buffer, 1, NULL, NULL);
+        assert(handles[i] != -1);
+    }
+    for (int i = 0; i < FILES; i++) {
+        assert(tfs_wait(handles[i], &result) == 0);
+        assert(result == 1);
+    }
+    for (int i = 0; i < FILES; i++)
+        assert(tfs_close(fhandles[i]) != -1);
+
+    // Metadata from every server at once, in the order asked for
+    char const *lookups[FILES + 1];
+    tfs_stat_t stats[FILES + 1];
+    int results[FILES + 1];
+    for (int i = 0; i < FILES; i++)
+        lookups[i] = names[FILES - 1 - i];
+    lookups[FILES] = missing;
+    assert(tfs_stat_many(lookups, FILES + 1, stats, results) == 0);
+    for (int i = 0; i < FILES; i++) {
+        assert(results[i] == 0);
+        assert(stats[i].st_size == strlen(lookups[i]));
+    }
+    assert(results[FILES] == -1);
+    assert(tfs_unmount() == 0);
+
+    // Each file is in exactly one server, and they don't all go to one
+    int held[FILES] = {0};
+    int servers_used = 0;
+    for (int s = 0; s < count; s++) {
+        tfs_stat_t st;
+        int holds = 0;
+        assert(tfs_mount(argv[1], servers[s]) == 0);
+        for (int i = 0; i < FILES; i++) {
+            if (tfs_stat(names[i], &st) == 0) {
+                held[i]++;
+                holds = 1;
+            }
+        }
+        assert(tfs_unmount() == 0);
+        servers_used += holds;
+    }
+    for (int i = 0; i < FILES; i++)
+        assert(held[i] == 1);
+    assert(servers_used > 1);
+
+    // The order the servers are given in doesn't matter
+    assert(tfs_mount_sharded(argv[1], reversed, count) == 0);
+    for (int i = 0; i < FILES; i++)
+        expect_contents(i);
+    assert(tfs_get(missing, buffer, sizeof(buffer)) == -1);
+    assert(tfs_unmount() == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
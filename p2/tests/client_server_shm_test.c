@@ -0,0 +1,55 @@
+#include "../client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Runs a session over shared memory instead of named pipes, checking that
+    payloads make it both ways through the ring, and that the ring can be
+    mounted again once unmounted. */
+
+int main(int argc, char **argv) {
+
+    char const *names[] = {"/shm", "/missing"};
+    char data[BLOCK_SIZE], buffer[BLOCK_SIZE];
+    tfs_stat_t st, stats[2];
+    int results[2];
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_ring_path "
+               "server_pipe_path'\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (char)('a' + i % 26);
+
+    for (int round = 0; round < 2; round++) {
+        assert(tfs_mount_shm(argv[1], argv[2]) == 0);
+
+        int f = tfs_open(names[0], TFS_O_CREAT | TFS_O_TRUNC);
+        assert(f != -1);
+        assert(tfs_write(f, data, sizeof(data)) == sizeof(data));
+        assert(tfs_lseek(f, 0, TFS_SEEK_SET) == 0);
+        assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+        assert(memcmp(buffer, data, sizeof(data)) == 0);
+        assert(tfs_fstat(f, &st) == 0 && st.st_size == sizeof(data));
+        assert(tfs_close(f) != -1);
+
+        assert(tfs_stat_many(names, 2, stats, results) == 0);
+        assert(results[0] == 0 && stats[0].st_size == sizeof(data));
+        assert(results[1] == -1);
+
+        /* The whole file comes back in the slot its name went in */
+        memset(buffer, 0, sizeof(buffer));
+        assert(tfs_get(names[0], buffer, sizeof(buffer)) == sizeof(buffer));
+        assert(memcmp(buffer, data, sizeof(data)) == 0);
+        assert(tfs_put(names[0], "shm", 3, 0) == 3);
+        assert(tfs_get(names[0], buffer, 3) == 3 && memcmp(buffer, "shm", 3) == 0);
+
+        assert(tfs_unmount() == 0);
+    }
+
+    printf("Successful test.\n");
+
+    return 0;
+}
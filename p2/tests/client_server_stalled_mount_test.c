@@ -0,0 +1,94 @@
+#include "../client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*  A client asks the server to mount and never opens its pipe to get the
+    answer. Another client still mounts and is served meanwhile, instead of
+    waiting behind it. Runs over the server's pipe. */
+
+// longer than the server waits for a client to open its pipe
+#define STALL_SECONDS (2)
+// how long the other client can take before the test gives up
+#define TIMEOUT_SECONDS (1)
+
+/*
+ * Sends a mount request for a client pipe that is never opened, and says so
+ * through sent.
+ */
+static void stalled_mount(char const *client_path, char const *server_pipe, int sent) {
+    char path[MAX_PATH_NAME + 1], request_path[MAX_PATH_NAME + 1];
+    snprintf(path, sizeof(path), "%s.stalled", client_path);
+    snprintf(request_path, sizeof(request_path), "%s.stalled.req", client_path);
+    unlink(path);
+    unlink(request_path);
+    assert(mkfifo(path, 0777) == 0 && mkfifo(request_path, 0777) == 0);
+
+    char payload[2 * (MAX_PATH_NAME + 1)];
+    size_t path_len = strlen(path);
+    memcpy(payload, path, path_len + 1);
+    strcpy(payload + path_len + 1, request_path);
+    tfs_request_t request = {.version = TFS_PROTOCOL_VERSION,
+                             .op_code = TFS_OP_CODE_MOUNT,
+                             .payload_len = (uint32_t)(path_len + 1 + strlen(request_path))};
+    struct iovec iov[2] = {{.iov_base = &request, .iov_len = sizeof(request)},
+                           {.iov_base = payload, .iov_len = request.payload_len}};
+    int fserv = open(server_pipe, O_WRONLY);
+    assert(fserv != -1);
+    assert(writev(fserv, iov, 2) == (ssize_t)(sizeof(request) + request.payload_len));
+    close(fserv);
+    assert(write(sent, "s", 1) == 1);
+
+    sleep(STALL_SECONDS);
+    unlink(path);
+    unlink(request_path);
+}
+
+int main(int argc, char **argv) {
+
+    char buffer[8];
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path'\n");
+        return 1;
+    }
+
+    int sent[2];
+    assert(pipe(sent) == 0);
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        close(sent[0]);
+        stalled_mount(argv[1], argv[2], sent[1]);
+        return 0;
+    }
+    close(sent[1]);
+    assert(read(sent[0], buffer, 1) == 1);
+
+    // killed if the server doesn't get to it
+    alarm(TIMEOUT_SECONDS);
+
+    assert(tfs_mount(argv[1], argv[2]) == 0);
+    int f = tfs_open("/stalled", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "ok", 2) == 2);
+    assert(tfs_close(f) != -1);
+    f = tfs_open("/stalled", 0);
+    assert(f != -1 && tfs_read(f, buffer, sizeof(buffer)) == 2 && memcmp(buffer, "ok", 2) == 0);
+    assert(tfs_close(f) != -1);
+    assert(tfs_unmount() == 0);
+    alarm(0);
+
+    int status;
+    assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
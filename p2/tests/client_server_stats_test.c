@@ -0,0 +1,87 @@
+#include "../client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Checks that the server counts the requests it answers: how many, which
+    failed, the bytes they moved and their latencies. Other clients may be
+    using the server too, so only what this one adds is checked. */
+
+// each of sizeof(data), all within a block
+#define WRITES (10)
+
+static uint64_t total(tfs_op_stats_t const *stats) {
+    uint64_t count = 0;
+    for (int i = 0; i < TFS_STATS_BUCKETS; i++)
+        count += stats->latency[i];
+    return count;
+}
+
+int main(int argc, char **argv) {
+
+    tfs_op_stats_t before, after;
+    char data[100];
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path'\n");
+        return 1;
+    }
+
+    assert(tfs_mount(argv[1], argv[2]) == 0);
+    memset(data, 's', sizeof(data));
+
+    // Writes, some of them to a file handle that isn't open
+    assert(tfs_stats(TFS_OP_CODE_WRITE, &before) == 0);
+    int f = tfs_open("/stats", TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    for (int i = 0; i < WRITES; i++)
+        assert(tfs_write(f, data, sizeof(data)) == sizeof(data));
+    assert(tfs_write(-1, data, 10) == -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_stats(TFS_OP_CODE_WRITE, &after) == 0);
+    assert(after.count - before.count >= WRITES + 1);
+    assert(after.errors - before.errors >= 1);
+    assert(after.bytes_in - before.bytes_in >= WRITES * sizeof(data) + 10);
+    assert(total(&after) - total(&before) >= WRITES + 1);
+    assert(after.latency_ns > before.latency_ns);
+    // every write that worked reached the file's block
+    assert(after.data_ios - before.data_ios >= WRITES);
+    assert(after.metadata_ios > before.metadata_ios);
+
+    // Reads move bytes the other way
+    assert(tfs_stats(TFS_OP_CODE_GET, &before) == 0);
+    char buffer[BLOCK_SIZE];
+    assert(tfs_get("/stats", buffer, sizeof(buffer)) == WRITES * sizeof(data));
+    assert(tfs_stats(TFS_OP_CODE_GET, &after) == 0);
+    assert(after.count > before.count);
+    assert(after.bytes_out - before.bytes_out >= WRITES * sizeof(data));
+
+    // Percentiles go up with the percentile, and stay within the latencies
+    uint64_t p50 = tfs_stats_percentile(&after, 50), p99 = tfs_stats_percentile(&after, 99);
+    uint64_t p100 = tfs_stats_percentile(&after, 100);
+    assert(p50 > 0 && p50 <= p99 && p99 <= p100);
+    assert(p50 <= after.latency_ns);
+    tfs_op_stats_t none;
+    memset(&none, 0, sizeof(none));
+    assert(tfs_stats_percentile(&none, 50) == 0);
+
+    // A single latency in a bucket, whatever the percentile asked for
+    none.latency[TFS_STATS_SUB_BUCKETS * 10] = 1;
+    assert(tfs_stats_percentile(&none, 1) == tfs_stats_percentile(&none, 100));
+    assert(tfs_stats_percentile(&none, 1) >= (uint64_t)1 << 11);
+    assert(tfs_stats_percentile(&none, 1) < (uint64_t)1 << 12);
+
+    // Unknown op codes
+    assert(tfs_stats(0, &after) == -1);
+    assert(tfs_stats(TFS_OP_CODES, &after) == -1);
+    // the requests for statistics count as well
+    assert(tfs_stats(TFS_OP_CODE_STATS, &after) == 0);
+    assert(after.count >= 6 && after.errors >= 2);
+
+    assert(tfs_unmount() == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
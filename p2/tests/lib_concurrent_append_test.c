@@ -0,0 +1,75 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Several threads append fixed-size records to the same file, each through
+    its own append handle. No record can be lost nor overwritten.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+#define NUM_THREADS 4
+#define RECORD_SIZE 16
+#define RECORDS_PER_THREAD (BLOCK_SIZE / RECORD_SIZE / NUM_THREADS)
+
+char *path = "/log";
+
+void *fn_thread(void *arg) {
+    char record[RECORD_SIZE];
+    memset(record, 'A' + *(int *)arg, RECORD_SIZE);
+
+    int f = tfs_open(path, TFS_O_APPEND);
+    assert(f != -1);
+    for (int i = 0; i < RECORDS_PER_THREAD; i++)
+        assert(tfs_write(f, record, RECORD_SIZE) == RECORD_SIZE);
+    assert(tfs_close(f) != -1);
+
+    return NULL;
+}
+
+int main() {
+
+    pthread_t tid[NUM_THREADS];
+    int ids[NUM_THREADS];
+    char buffer[BLOCK_SIZE];
+    int counts[NUM_THREADS] = {0};
+
+    assert(tfs_init() != -1);
+
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tid[i], NULL, fn_thread, &ids[i]) == 0);
+    }
+    for (int i = 0; i < NUM_THREADS; i++)
+        assert(pthread_join(tid[i], NULL) == 0);
+
+    /* The file is full, so further appends write nothing */
+    f = tfs_open(path, TFS_O_APPEND);
+    assert(f != -1);
+    assert(tfs_write(f, "X", 1) == 0);
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == BLOCK_SIZE);
+    for (int i = 0; i < BLOCK_SIZE; i += RECORD_SIZE) {
+        int id = buffer[i] - 'A';
+        assert(id >= 0 && id < NUM_THREADS);
+        for (int j = 1; j < RECORD_SIZE; j++)
+            assert(buffer[i + j] == buffer[i]);
+        counts[id]++;
+    }
+    for (int i = 0; i < NUM_THREADS; i++)
+        assert(counts[i] == RECORDS_PER_THREAD);
+    assert(tfs_close(f) != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,68 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+
+/*  Checks that the simulated storage accesses of each operation are
+    counted, apart, as accesses to metadata and to data.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+/*
+ * Gets what the operation of an op code made since before was taken
+ */
+static tfs_io_stats_t since(int op_code, tfs_io_stats_t const *before) {
+    tfs_io_stats_t after;
+    assert(tfs_io_stats(op_code, &after) == 0);
+    return (tfs_io_stats_t){.calls = after.calls - before->calls,
+                            .metadata_ios = after.metadata_ios - before->metadata_ios,
+                            .data_ios = after.data_ios - before->data_ios};
+}
+
+int main() {
+
+    char const *path = "/f1";
+    char buffer[1];
+    tfs_io_stats_t before, done;
+    tfs_stat_t st;
+
+    assert(tfs_init() != -1);
+    assert(tfs_io_stats(-1, &before) == -1);
+    assert(tfs_io_stats(TFS_OP_CODES, &before) == -1);
+
+    /* Creating a file only touches metadata */
+    assert(tfs_io_stats(TFS_OP_CODE_OPEN, &before) == 0);
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    done = since(TFS_OP_CODE_OPEN, &before);
+    assert(done.calls == 1 && done.metadata_ios > 0 && done.data_ios == 0);
+
+    /* Writing a byte to an empty file allocates a block and writes to it */
+    assert(tfs_io_stats(TFS_OP_CODE_WRITE, &before) == 0);
+    assert(tfs_write(f, "A", 1) == 1);
+    done = since(TFS_OP_CODE_WRITE, &before);
+    assert(done.calls == 1 && done.metadata_ios > 0 && done.data_ios >= 1);
+
+    assert(tfs_lseek(f, 0, TFS_SEEK_SET) == 0);
+    assert(tfs_io_stats(TFS_OP_CODE_READ, &before) == 0);
+    assert(tfs_read(f, buffer, 1) == 1 && buffer[0] == 'A');
+    done = since(TFS_OP_CODE_READ, &before);
+    assert(done.calls == 1 && done.data_ios >= 1);
+
+    /* Nor do stat's accesses count as anything else's */
+    assert(tfs_io_stats(TFS_OP_CODE_STAT, &before) == 0);
+    tfs_io_stats_t read_before;
+    assert(tfs_io_stats(TFS_OP_CODE_READ, &read_before) == 0);
+    assert(tfs_stat(path, &st) == 0 && st.st_size == 1);
+    done = since(TFS_OP_CODE_STAT, &before);
+    assert(done.calls == 1 && done.metadata_ios > 0 && done.data_ios == 0);
+    done = since(TFS_OP_CODE_READ, &read_before);
+    assert(done.calls == 0 && done.metadata_ios == 0 && done.data_ios == 0);
+
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
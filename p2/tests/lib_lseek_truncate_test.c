@@ -0,0 +1,61 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Checks tfs_lseek, tfs_truncate and tfs_fallocate.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+int main() {
+
+    char *str = "AAAABBBB";
+    char *path = "/f1";
+    char buffer[BLOCK_SIZE];
+
+    assert(tfs_init() != -1);
+
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+
+    /* Space reserved ahead of the write doesn't change the size */
+    assert(tfs_fallocate(f, 0, BLOCK_SIZE) == 0);
+    assert(tfs_lseek(f, 0, TFS_SEEK_END) == 0);
+    assert(tfs_fallocate(f, 1, BLOCK_SIZE) == -1);
+
+    assert(tfs_write(f, str, strlen(str)) == strlen(str));
+
+    /* Seeking and reading back */
+    assert(tfs_lseek(f, 4, TFS_SEEK_SET) == 4);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 4);
+    assert(memcmp(buffer, "BBBB", 4) == 0);
+    assert(tfs_lseek(f, -2, TFS_SEEK_CUR) == 6);
+    assert(tfs_lseek(f, -1, TFS_SEEK_SET) == -1);
+    assert(tfs_lseek(f, 1, TFS_SEEK_END) == 9);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 0);
+
+    /* Writing past the end of file leaves a gap of zeros */
+    assert(tfs_lseek(f, 12, TFS_SEEK_SET) == 12);
+    assert(tfs_write(f, "C", 1) == 1);
+    assert(tfs_lseek(f, 0, TFS_SEEK_SET) == 0);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 13);
+    assert(memcmp(buffer, "AAAABBBB\0\0\0\0C", 13) == 0);
+
+    /* Shrinking drops the tail, growing again reads it back as zeros */
+    assert(tfs_truncate(f, 2) == 0);
+    assert(tfs_truncate(f, 6) == 0);
+    assert(tfs_lseek(f, 0, TFS_SEEK_SET) == 0);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 6);
+    assert(memcmp(buffer, "AA\0\0\0\0", 6) == 0);
+    assert(tfs_truncate(f, BLOCK_SIZE + 1) == -1);
+
+    assert(tfs_truncate(f, 0) == 0);
+    assert(tfs_lseek(f, 0, TFS_SEEK_END) == 0);
+
+    assert(tfs_close(f) != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
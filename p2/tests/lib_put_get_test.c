@@ -0,0 +1,52 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Checks tfs_put and tfs_get, and that they leave no file open behind.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+int main() {
+
+    char *path = "/f1";
+    char buffer[BLOCK_SIZE];
+
+    assert(tfs_init() != -1);
+
+    /* The file must exist unless it is created */
+    assert(tfs_put(path, "AAAA", 4, 0) == -1);
+    assert(tfs_get(path, buffer, sizeof(buffer)) == -1);
+    assert(tfs_put(path, "AAAA", 4, TFS_O_CREAT) == 4);
+
+    /* Without truncating, the contents are overwritten from the start */
+    assert(tfs_put(path, "BB", 2, 0) == 2);
+    assert(tfs_get(path, buffer, sizeof(buffer)) == 4);
+    assert(memcmp(buffer, "BBAA", 4) == 0);
+
+    /* Appending writes at the end, even with the file open elsewhere */
+    int f = tfs_open(path, TFS_O_APPEND);
+    assert(f != -1);
+    assert(tfs_write(f, "CC", 2) == 2);
+    assert(tfs_put(path, "DD", 2, TFS_O_APPEND) == 2);
+    assert(tfs_write(f, "EE", 2) == 2);
+    assert(tfs_close(f) != -1);
+    assert(tfs_get(path, buffer, sizeof(buffer)) == 10);
+    assert(memcmp(buffer, "BBAACCDDEE", 10) == 0);
+
+    /* Truncating and reading back less than the whole file */
+    assert(tfs_put(path, "F", 1, TFS_O_TRUNC) == 1);
+    assert(tfs_get(path, buffer, 0) == 0);
+    assert(tfs_get(path, buffer, sizeof(buffer)) == 1 && buffer[0] == 'F');
+
+    /* Writes stop at the maximum file size */
+    memset(buffer, 'G', sizeof(buffer));
+    assert(tfs_put(path, buffer, sizeof(buffer), TFS_O_APPEND) == BLOCK_SIZE - 1);
+
+    assert(tfs_destroy_after_all_closed() == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
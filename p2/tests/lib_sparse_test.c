@@ -0,0 +1,71 @@
+#include "fs/operations.h"
+#include "fs/state.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Checks that holes and all-zero writes don't take data blocks,
+    while still reading back as zeros, unless tfs_fallocate reserved one.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+int main() {
+
+    char *path = "/f1";
+    char zeros[BLOCK_SIZE];
+    char buffer[BLOCK_SIZE];
+    memset(zeros, 0, sizeof(zeros));
+
+    assert(tfs_init() != -1);
+
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    inode_t *inode = inode_get(tfs_lookup(path));
+    assert(inode != NULL);
+
+    /* Growing the file and writing zeros leaves it as a hole */
+    assert(tfs_truncate(f, 100) == 0);
+    assert(tfs_write(f, zeros, 200) == 200);
+    assert(inode->i_data_block == -1);
+
+    memset(buffer, 'x', sizeof(buffer));
+    assert(tfs_lseek(f, 0, TFS_SEEK_SET) == 0);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 200);
+    assert(memcmp(buffer, zeros, 200) == 0);
+
+    /* Data takes a block... */
+    assert(tfs_lseek(f, 150, TFS_SEEK_SET) == 150);
+    assert(tfs_write(f, "A", 1) == 1);
+    assert(inode->i_data_block != -1);
+    assert(tfs_lseek(f, 0, TFS_SEEK_SET) == 0);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 200);
+    assert(buffer[150] == 'A' && buffer[149] == 0 && buffer[151] == 0);
+
+    /* ...until the whole content is overwritten with zeros */
+    assert(tfs_lseek(f, 0, TFS_SEEK_SET) == 0);
+    assert(tfs_write(f, zeros, 200) == 200);
+    assert(inode->i_data_block == -1);
+    assert(inode->i_size == 200);
+
+    /* A block reserved by tfs_fallocate stays, even zero-filled... */
+    assert(tfs_fallocate(f, 0, BLOCK_SIZE) == 0);
+    assert(inode->i_data_block != -1);
+    assert(tfs_lseek(f, 0, TFS_SEEK_SET) == 0);
+    assert(tfs_write(f, zeros, 512) == 512);
+    assert(inode->i_data_block != -1);
+    tfs_stat_t st;
+    assert(tfs_fstat(f, &st) == 0 && st.st_blocks == 1 && st.st_size == 512);
+
+    /* ...until the file is truncated to nothing */
+    assert(tfs_truncate(f, 0) == 0);
+    assert(inode->i_data_block == -1);
+    assert(tfs_write(f, zeros, 512) == 512);
+    assert(inode->i_data_block == -1);
+
+    assert(tfs_close(f) != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,43 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+
+/*  Checks tfs_stat, tfs_fstat and tfs_stat_many.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+int main() {
+
+    char const *names[] = {"/f1", "/f2", "/f3"};
+    tfs_stat_t st, stats[3];
+    int results[3];
+
+    assert(tfs_init() != -1);
+
+    int f = tfs_open(names[0], TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "AAA!", 4) == 4);
+
+    assert(tfs_fstat(f, &st) == 0);
+    assert(st.st_type == TFS_T_FILE && st.st_size == 4 && st.st_blocks == 1);
+    assert(tfs_close(f) != -1);
+
+    /* A hole has a size but no blocks */
+    f = tfs_open(names[2], TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_truncate(f, 100) == 0);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_stat(names[0], &st) == 0 && st.st_size == 4);
+    assert(tfs_stat(names[1], &st) == -1);
+
+    assert(tfs_stat_many(names, 3, stats, results) == 0);
+    assert(results[0] == 0 && stats[0].st_size == 4);
+    assert(results[1] == -1);
+    assert(results[2] == 0 && stats[2].st_size == 100 && stats[2].st_blocks == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}